@@ -0,0 +1,505 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <string.h>
+
+#include "aesgcm.h"
+#include "utils.h"
+
+/* Defining DSOCK_NOAESNI forces the portable implementation even on CPUs
+   with AES-NI. Tests use it to cover the fallback path. */
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__) && \
+    !defined DSOCK_NOAESNI
+#define AESGCM_X86 1
+#include <immintrin.h>
+#endif
+
+static uint32_t aesgcm_ld32be(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void aesgcm_st32be(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint64_t aesgcm_ld64be(const uint8_t *p) {
+    return ((uint64_t)aesgcm_ld32be(p) << 32) | aesgcm_ld32be(p + 4);
+}
+
+static void aesgcm_st64be(uint8_t *p, uint64_t v) {
+    aesgcm_st32be(p, (uint32_t)(v >> 32));
+    aesgcm_st32be(p + 4, (uint32_t)v);
+}
+
+/******************************************************************************/
+/*  Constant-time AES                                                         */
+/******************************************************************************/
+
+/* Arithmetic in GF(2^8) on eight bytes at a time. */
+
+#define AESGCM_L 0x0101010101010101ULL
+
+static uint64_t aesgcm_xtime(uint64_t x) {
+    return ((x & 0x7f7f7f7f7f7f7f7fULL) << 1) ^ (((x >> 7) & AESGCM_L) * 0x1b);
+}
+
+static uint64_t aesgcm_gfmul(uint64_t a, uint64_t b) {
+    uint64_t r = 0;
+    int i;
+    for(i = 0; i != 8; ++i) {
+        r ^= a & (((b >> i) & AESGCM_L) * 0xff);
+        a = aesgcm_xtime(a);
+    }
+    return r;
+}
+
+static uint64_t aesgcm_rotl8(uint64_t x, int n) {
+    return ((x << n) & ((uint64_t)(uint8_t)(0xff << n) * AESGCM_L)) |
+        ((x >> (8 - n)) & ((uint64_t)(0xff >> (8 - n)) * AESGCM_L));
+}
+
+/* Applies the S-box to each byte. Inverse is computed as x^254 instead of
+   being looked up in a table so that there are no secret-dependent memory
+   accesses. */
+static uint64_t aesgcm_sbox(uint64_t x) {
+    uint64_t p = aesgcm_gfmul(x, x);
+    uint64_t y = p;
+    int i;
+    for(i = 0; i != 6; ++i) {
+        p = aesgcm_gfmul(p, p);
+        y = aesgcm_gfmul(y, p);
+    }
+    return y ^ aesgcm_rotl8(y, 1) ^ aesgcm_rotl8(y, 2) ^ aesgcm_rotl8(y, 3) ^
+        aesgcm_rotl8(y, 4) ^ (0x63 * AESGCM_L);
+}
+
+static void aesgcm_subbytes(uint8_t *s, size_t len) {
+    uint64_t v = 0;
+    memcpy(&v, s, len);
+    v = aesgcm_sbox(v);
+    memcpy(s, &v, len);
+}
+
+static uint8_t aesgcm_xt(uint8_t x) {
+    return (uint8_t)((x << 1) ^ (((x >> 7) & 1) * 0x1b));
+}
+
+static void aesgcm_encrypt_sw(const struct aesgcm *self, uint8_t *out,
+      const uint8_t *in) {
+    uint8_t s[16], t[16];
+    int i, r, c;
+    for(i = 0; i != 16; ++i) s[i] = in[i] ^ self->rk[0][i];
+    for(r = 1; r != 15; ++r) {
+        aesgcm_subbytes(s, 8);
+        aesgcm_subbytes(s + 8, 8);
+        /* ShiftRows. State is stored column by column. */
+        for(c = 0; c != 4; ++c)
+            for(i = 0; i != 4; ++i)
+                t[i + 4 * c] = s[i + 4 * ((c + i) % 4)];
+        /* MixColumns, except in the last round. */
+        if(r == 14) {
+            memcpy(s, t, 16);
+        }
+        else {
+            for(c = 0; c != 4; ++c) {
+                uint8_t *b = t + 4 * c;
+                uint8_t a = b[0] ^ b[1] ^ b[2] ^ b[3];
+                s[4 * c] = b[0] ^ a ^ aesgcm_xt(b[0] ^ b[1]);
+                s[4 * c + 1] = b[1] ^ a ^ aesgcm_xt(b[1] ^ b[2]);
+                s[4 * c + 2] = b[2] ^ a ^ aesgcm_xt(b[2] ^ b[3]);
+                s[4 * c + 3] = b[3] ^ a ^ aesgcm_xt(b[3] ^ b[0]);
+            }
+        }
+        for(i = 0; i != 16; ++i) s[i] ^= self->rk[r][i];
+    }
+    memcpy(out, s, 16);
+}
+
+/* AES-256 key schedule. The same round keys are used by AES-NI. */
+static void aesgcm_expand(struct aesgcm *self, const uint8_t *key) {
+    uint8_t *w = &self->rk[0][0];
+    memcpy(w, key, 32);
+    uint8_t rcon = 1;
+    int i;
+    for(i = 8; i != 60; ++i) {
+        uint8_t t[4];
+        memcpy(t, w + 4 * (i - 1), 4);
+        if(i % 8 == 0) {
+            uint8_t t0 = t[0];
+            t[0] = t[1];
+            t[1] = t[2];
+            t[2] = t[3];
+            t[3] = t0;
+            aesgcm_subbytes(t, 4);
+            t[0] ^= rcon;
+            rcon = aesgcm_xt(rcon);
+        }
+        else if(i % 8 == 4) {
+            aesgcm_subbytes(t, 4);
+        }
+        int j;
+        for(j = 0; j != 4; ++j) w[4 * i + j] = w[4 * (i - 8) + j] ^ t[j];
+    }
+}
+
+/******************************************************************************/
+/*  Constant-time GCM                                                         */
+/******************************************************************************/
+
+/* Multiplies x by h in GF(2^128) bit by bit, selecting by masks rather
+   than by branching. */
+static void aesgcm_gmul_sw(uint64_t *x, const uint64_t *h) {
+    uint64_t zh = 0, zl = 0, vh = h[0], vl = h[1];
+    int i;
+    for(i = 0; i != 128; ++i) {
+        uint64_t bit = i < 64 ? (x[0] >> (63 - i)) & 1 : (x[1] >> (127 - i)) & 1;
+        uint64_t m = -bit;
+        zh ^= vh & m;
+        zl ^= vl & m;
+        uint64_t lsb = -(vl & 1);
+        vl = (vl >> 1) | (vh << 63);
+        vh = (vh >> 1) ^ (0xe100000000000000ULL & lsb);
+    }
+    x[0] = zh;
+    x[1] = zl;
+}
+
+/* Absorbs data into the hash, zero-padding the last block. */
+static void aesgcm_ghash_sw(const uint64_t *h, uint64_t *x,
+      const uint8_t *data, size_t len) {
+    while(len) {
+        uint8_t b[16] = {0};
+        size_t n = MIN(len, 16);
+        memcpy(b, data, n);
+        x[0] ^= aesgcm_ld64be(b);
+        x[1] ^= aesgcm_ld64be(b + 8);
+        aesgcm_gmul_sw(x, h);
+        data += n;
+        len -= n;
+    }
+}
+
+static void aesgcm_ctr_sw(const struct aesgcm *self, uint8_t *dst,
+      const uint8_t *src, size_t len, const uint8_t *nonce) {
+    uint8_t ctr[16], ks[16];
+    memcpy(ctr, nonce, 12);
+    uint32_t n = 2;
+    size_t pos, i;
+    for(pos = 0; pos < len; pos += 16, ++n) {
+        aesgcm_st32be(ctr + 12, n);
+        aesgcm_encrypt_sw(self, ks, ctr);
+        size_t k = MIN(len - pos, 16);
+        for(i = 0; i != k; ++i) dst[pos + i] = src[pos + i] ^ ks[i];
+    }
+}
+
+static void aesgcm_tag_sw(const struct aesgcm *self, uint8_t *tag,
+      const uint8_t *c, size_t len, const uint8_t *aad, size_t aadlen,
+      const uint8_t *nonce) {
+    uint64_t h[2] = {aesgcm_ld64be(self->h), aesgcm_ld64be(self->h + 8)};
+    uint64_t x[2] = {0, 0};
+    aesgcm_ghash_sw(h, x, aad, aadlen);
+    aesgcm_ghash_sw(h, x, c, len);
+    x[0] ^= (uint64_t)aadlen * 8;
+    x[1] ^= (uint64_t)len * 8;
+    aesgcm_gmul_sw(x, h);
+    uint8_t j0[16];
+    memcpy(j0, nonce, 12);
+    aesgcm_st32be(j0 + 12, 1);
+    aesgcm_encrypt_sw(self, j0, j0);
+    aesgcm_st64be(tag, x[0]);
+    aesgcm_st64be(tag + 8, x[1]);
+    int i;
+    for(i = 0; i != 16; ++i) tag[i] ^= j0[i];
+}
+
+/******************************************************************************/
+/*  AES-NI and PCLMULQDQ                                                      */
+/******************************************************************************/
+
+#if defined AESGCM_X86
+
+#define AESGCM_NI __attribute__((target("aes,pclmul,ssse3")))
+
+AESGCM_NI
+static __m128i aesgcm_encrypt_ni(const __m128i *k, __m128i b) {
+    b = _mm_xor_si128(b, k[0]);
+    int r;
+    for(r = 1; r != 14; ++r) b = _mm_aesenc_si128(b, k[r]);
+    return _mm_aesenclast_si128(b, k[14]);
+}
+
+/* Carry-less multiplication of byte-reversed operands, as described in
+   Intel's "Carry-Less Multiplication and Its Usage for Computing the GCM
+   Mode" white paper. Adds the 256-bit product to lo and hi. Reduction is
+   linear so several products can be summed before reducing them once. */
+AESGCM_NI
+static void aesgcm_clmul_ni(__m128i a, __m128i b, __m128i *lo, __m128i *hi) {
+    __m128i t3 = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i t4 = _mm_clmulepi64_si128(a, b, 0x10);
+    __m128i t5 = _mm_clmulepi64_si128(a, b, 0x01);
+    __m128i t6 = _mm_clmulepi64_si128(a, b, 0x11);
+    t4 = _mm_xor_si128(t4, t5);
+    *lo = _mm_xor_si128(*lo, _mm_xor_si128(t3, _mm_slli_si128(t4, 8)));
+    *hi = _mm_xor_si128(*hi, _mm_xor_si128(t6, _mm_srli_si128(t4, 8)));
+}
+
+AESGCM_NI
+static __m128i aesgcm_reduce_ni(__m128i t3, __m128i t6) {
+    /* Shift the 256-bit product left by one bit to account for the
+       reflected bit order. */
+    __m128i t7 = _mm_srli_epi32(t3, 31);
+    __m128i t8 = _mm_srli_epi32(t6, 31);
+    t3 = _mm_slli_epi32(t3, 1);
+    t6 = _mm_slli_epi32(t6, 1);
+    __m128i t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    t3 = _mm_or_si128(t3, t7);
+    t6 = _mm_or_si128(t6, t8);
+    t6 = _mm_or_si128(t6, t9);
+    /* Reduce modulo x^128 + x^7 + x^2 + x + 1. */
+    t7 = _mm_slli_epi32(t3, 31);
+    t8 = _mm_slli_epi32(t3, 30);
+    t9 = _mm_slli_epi32(t3, 25);
+    t7 = _mm_xor_si128(t7, t8);
+    t7 = _mm_xor_si128(t7, t9);
+    t8 = _mm_srli_si128(t7, 4);
+    t7 = _mm_slli_si128(t7, 12);
+    t3 = _mm_xor_si128(t3, t7);
+    __m128i t2 = _mm_srli_epi32(t3, 1);
+    __m128i t4 = _mm_srli_epi32(t3, 2);
+    __m128i t5 = _mm_srli_epi32(t3, 7);
+    t2 = _mm_xor_si128(t2, t4);
+    t2 = _mm_xor_si128(t2, t5);
+    t2 = _mm_xor_si128(t2, t8);
+    t3 = _mm_xor_si128(t3, t2);
+    return _mm_xor_si128(t6, t3);
+}
+
+AESGCM_NI
+static __m128i aesgcm_gmul_ni(__m128i a, __m128i b) {
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    aesgcm_clmul_ni(a, b, &lo, &hi);
+    return aesgcm_reduce_ni(lo, hi);
+}
+
+/* 'h' holds powers of the hash subkey, h[i] being H^(i+1). */
+AESGCM_NI
+static __m128i aesgcm_ghash_ni(const __m128i *h, __m128i x,
+      const uint8_t *data, size_t len) {
+    const __m128i bswap = _mm_set_epi8(
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    /* Four blocks at a time with a single reduction:
+       X' = (X + C0) * H^4 + C1 * H^3 + C2 * H^2 + C3 * H */
+    while(len >= 64) {
+        const __m128i *in = (const __m128i*)data;
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        aesgcm_clmul_ni(_mm_xor_si128(x,
+            _mm_shuffle_epi8(_mm_loadu_si128(in), bswap)), h[3], &lo, &hi);
+        aesgcm_clmul_ni(_mm_shuffle_epi8(_mm_loadu_si128(in + 1), bswap),
+            h[2], &lo, &hi);
+        aesgcm_clmul_ni(_mm_shuffle_epi8(_mm_loadu_si128(in + 2), bswap),
+            h[1], &lo, &hi);
+        aesgcm_clmul_ni(_mm_shuffle_epi8(_mm_loadu_si128(in + 3), bswap),
+            h[0], &lo, &hi);
+        x = aesgcm_reduce_ni(lo, hi);
+        data += 64;
+        len -= 64;
+    }
+    while(len) {
+        __m128i b;
+        if(dsock_fast(len >= 16)) {
+            b = _mm_loadu_si128((const __m128i*)data);
+        }
+        else {
+            uint8_t tmp[16] = {0};
+            memcpy(tmp, data, len);
+            b = _mm_loadu_si128((const __m128i*)tmp);
+        }
+        x = _mm_xor_si128(x, _mm_shuffle_epi8(b, bswap));
+        x = aesgcm_gmul_ni(x, h[0]);
+        size_t n = MIN(len, 16);
+        data += n;
+        len -= n;
+    }
+    return x;
+}
+
+AESGCM_NI
+static void aesgcm_ctr_ni(const struct aesgcm *self, uint8_t *dst,
+      const uint8_t *src, size_t len, const uint8_t *nonce) {
+    __m128i k[15];
+    int r;
+    for(r = 0; r != 15; ++r)
+        k[r] = _mm_loadu_si128((const __m128i*)self->rk[r]);
+    /* Counter blocks are assembled in registers. Going through memory
+       would stall on store forwarding. */
+    int n0, n1, n2;
+    memcpy(&n0, nonce, 4);
+    memcpy(&n1, nonce + 4, 4);
+    memcpy(&n2, nonce + 8, 4);
+    uint8_t ctr[16];
+    memcpy(ctr, nonce, 12);
+    uint32_t n = 2;
+    size_t pos = 0;
+    /* Four blocks at a time to hide the latency of AESENC. Blocks are kept
+       in separate variables so that they stay in registers. */
+    for(; pos + 64 <= len; pos += 64, n += 4) {
+        __m128i b0 = _mm_xor_si128(_mm_set_epi32(
+            (int)__builtin_bswap32(n), n2, n1, n0), k[0]);
+        __m128i b1 = _mm_xor_si128(_mm_set_epi32(
+            (int)__builtin_bswap32(n + 1), n2, n1, n0), k[0]);
+        __m128i b2 = _mm_xor_si128(_mm_set_epi32(
+            (int)__builtin_bswap32(n + 2), n2, n1, n0), k[0]);
+        __m128i b3 = _mm_xor_si128(_mm_set_epi32(
+            (int)__builtin_bswap32(n + 3), n2, n1, n0), k[0]);
+        for(r = 1; r != 14; ++r) {
+            b0 = _mm_aesenc_si128(b0, k[r]);
+            b1 = _mm_aesenc_si128(b1, k[r]);
+            b2 = _mm_aesenc_si128(b2, k[r]);
+            b3 = _mm_aesenc_si128(b3, k[r]);
+        }
+        b0 = _mm_aesenclast_si128(b0, k[14]);
+        b1 = _mm_aesenclast_si128(b1, k[14]);
+        b2 = _mm_aesenclast_si128(b2, k[14]);
+        b3 = _mm_aesenclast_si128(b3, k[14]);
+        const __m128i *in = (const __m128i*)(src + pos);
+        __m128i *out = (__m128i*)(dst + pos);
+        _mm_storeu_si128(out, _mm_xor_si128(_mm_loadu_si128(in), b0));
+        _mm_storeu_si128(out + 1, _mm_xor_si128(_mm_loadu_si128(in + 1), b1));
+        _mm_storeu_si128(out + 2, _mm_xor_si128(_mm_loadu_si128(in + 2), b2));
+        _mm_storeu_si128(out + 3, _mm_xor_si128(_mm_loadu_si128(in + 3), b3));
+    }
+    for(; pos < len; pos += 16, ++n) {
+        aesgcm_st32be(ctr + 12, n);
+        uint8_t ks[16];
+        _mm_storeu_si128((__m128i*)ks,
+            aesgcm_encrypt_ni(k, _mm_loadu_si128((const __m128i*)ctr)));
+        size_t i, m = MIN(len - pos, 16);
+        for(i = 0; i != m; ++i) dst[pos + i] = src[pos + i] ^ ks[i];
+    }
+}
+
+AESGCM_NI
+static void aesgcm_tag_ni(const struct aesgcm *self, uint8_t *tag,
+      const uint8_t *c, size_t len, const uint8_t *aad, size_t aadlen,
+      const uint8_t *nonce) {
+    const __m128i bswap = _mm_set_epi8(
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i h[4];
+    h[0] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)self->h), bswap);
+    int i;
+    for(i = 1; i != 4; ++i) h[i] = aesgcm_gmul_ni(h[i - 1], h[0]);
+    __m128i x = _mm_setzero_si128();
+    x = aesgcm_ghash_ni(h, x, aad, aadlen);
+    x = aesgcm_ghash_ni(h, x, c, len);
+    uint8_t lens[16];
+    aesgcm_st64be(lens, (uint64_t)aadlen * 8);
+    aesgcm_st64be(lens + 8, (uint64_t)len * 8);
+    x = aesgcm_ghash_ni(h, x, lens, 16);
+    __m128i k[15];
+    int r;
+    for(r = 0; r != 15; ++r)
+        k[r] = _mm_loadu_si128((const __m128i*)self->rk[r]);
+    uint8_t j0[16];
+    memcpy(j0, nonce, 12);
+    aesgcm_st32be(j0 + 12, 1);
+    __m128i e = aesgcm_encrypt_ni(k, _mm_loadu_si128((const __m128i*)j0));
+    _mm_storeu_si128((__m128i*)tag,
+        _mm_xor_si128(_mm_shuffle_epi8(x, bswap), e));
+}
+
+static int aesgcm_hasni(void) {
+    static int ni = -1;
+    if(dsock_slow(ni < 0)) {
+        __builtin_cpu_init();
+        ni = __builtin_cpu_supports("aes") &&
+            __builtin_cpu_supports("pclmul") &&
+            __builtin_cpu_supports("ssse3") ? 1 : 0;
+    }
+    return ni;
+}
+
+#endif
+
+/******************************************************************************/
+/*  Public interface                                                          */
+/******************************************************************************/
+
+static void aesgcm_ctr(const struct aesgcm *self, uint8_t *dst,
+      const uint8_t *src, size_t len, const uint8_t *nonce) {
+#if defined AESGCM_X86
+    if(aesgcm_hasni()) {aesgcm_ctr_ni(self, dst, src, len, nonce); return;}
+#endif
+    aesgcm_ctr_sw(self, dst, src, len, nonce);
+}
+
+static void aesgcm_tag(const struct aesgcm *self, uint8_t *tag,
+      const uint8_t *c, size_t len, const uint8_t *aad, size_t aadlen,
+      const uint8_t *nonce) {
+#if defined AESGCM_X86
+    if(aesgcm_hasni()) {
+        aesgcm_tag_ni(self, tag, c, len, aad, aadlen, nonce);
+        return;
+    }
+#endif
+    aesgcm_tag_sw(self, tag, c, len, aad, aadlen, nonce);
+}
+
+void aesgcm_init(struct aesgcm *self, const uint8_t *key) {
+    aesgcm_expand(self, key);
+    memset(self->h, 0, 16);
+    aesgcm_encrypt_sw(self, self->h, self->h);
+}
+
+void aesgcm_seal(const struct aesgcm *self, uint8_t *tag, uint8_t *dst,
+      const uint8_t *src, size_t len, const uint8_t *aad, size_t aadlen,
+      const uint8_t *nonce) {
+    aesgcm_ctr(self, dst, src, len, nonce);
+    aesgcm_tag(self, tag, dst, len, aad, aadlen, nonce);
+}
+
+int aesgcm_open(const struct aesgcm *self, uint8_t *dst, const uint8_t *src,
+      size_t len, const uint8_t *tag, const uint8_t *aad, size_t aadlen,
+      const uint8_t *nonce) {
+    uint8_t computed[16];
+    aesgcm_tag(self, computed, src, len, aad, aadlen, nonce);
+    uint8_t diff = 0;
+    int i;
+    for(i = 0; i != 16; ++i) diff |= computed[i] ^ tag[i];
+    if(dsock_slow(diff)) return -1;
+    aesgcm_ctr(self, dst, src, len, nonce);
+    return 0;
+}
+
+void aesgcm_term(struct aesgcm *self) {
+    memset(self, 0, sizeof(struct aesgcm));
+}
@@ -0,0 +1,61 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef DSOCK_AESGCM_H_INCLUDED
+#define DSOCK_AESGCM_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* AES-256-GCM with 12-byte nonces and 16-byte tags. AES-NI and PCLMULQDQ
+   are used if the CPU supports them. Otherwise a slower constant-time
+   implementation is used: S-box is computed arithmetically rather than
+   looked up and GHASH multiplication doesn't branch on secret data. */
+struct aesgcm {
+    /* Expanded key. */
+    uint8_t rk[15][16];
+    /* Hash subkey. */
+    uint8_t h[16];
+};
+
+/* 'key' is 32 bytes long. */
+void aesgcm_init(struct aesgcm *self, const uint8_t *key);
+
+/* Encrypts 'len' bytes from 'src' to 'dst' and stores the 16-byte
+   authentication tag to 'tag'. 'dst' may be the same as 'src'. */
+void aesgcm_seal(const struct aesgcm *self, uint8_t *tag, uint8_t *dst,
+    const uint8_t *src, size_t len, const uint8_t *aad, size_t aadlen,
+    const uint8_t *nonce);
+
+/* Checks the tag and, if it matches, decrypts the data. Returns 0 on
+   success, -1 if authentication fails. In the latter case 'dst' is not
+   touched. */
+int aesgcm_open(const struct aesgcm *self, uint8_t *dst, const uint8_t *src,
+    size_t len, const uint8_t *tag, const uint8_t *aad, size_t aadlen,
+    const uint8_t *nonce);
+
+void aesgcm_term(struct aesgcm *self);
+
+#endif
+
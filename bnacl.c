@@ -0,0 +1,408 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <libdillimpl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsock.h"
+#include "iol.h"
+#include "salsa20.h"
+#include "utils.h"
+
+dsock_unique_id(bnacl_type);
+
+static void *bnacl_hquery(struct hvfs *hvfs, const void *type);
+static void bnacl_hclose(struct hvfs *hvfs);
+static int bnacl_bsendl(struct bsock_vfs *bvfs,
+    struct iolist *first, struct iolist *last, int64_t deadline);
+static int bnacl_brecvl(struct bsock_vfs *bvfs,
+    struct iolist *first, struct iolist *last, int64_t deadline);
+
+/* Each direction of the stream starts with a random nonce. It is followed
+   by records, each consisting of 4-byte header, authenticator and the
+   encrypted data. The header holds the size of the data and a flag marking
+   the last record of the stream. Nonce is incremented for every record and
+   the header is bound into it, so that records can't be reordered, resized
+   or dropped without the receiver noticing. */
+#define BNACL_KEYBYTES 32
+#define BNACL_NONCEBYTES 24
+#define BNACL_TAGBYTES 16
+#define BNACL_HDRBYTES 4
+#define BNACL_OVERHEAD (BNACL_HDRBYTES + BNACL_TAGBYTES)
+#define BNACL_FINAL 0x80000000u
+
+/* Time allowed for sending a partial record once the interval expires.
+   There's no user waiting for it, so there's no deadline to obey, but
+   a stalled peer must not block the sender forever. */
+#define BNACL_FLUSHTIMEOUT 10000
+
+/* Requests passed from the user to the sender coroutine. */
+#define BNACL_SEND 0
+#define BNACL_FLUSH 1
+#define BNACL_CLOSE 2
+
+struct bnacl_vec {
+    int op;
+    struct iolist *first;
+    struct iolist *last;
+    int64_t deadline;
+};
+
+struct bnacl_sock {
+    struct hvfs hvfs;
+    struct bsock_vfs bvfs;
+    int s;
+    size_t recordlen;
+    int64_t interval;
+    uint8_t key[BNACL_KEYBYTES];
+    /* Outbound record being filled in. Owned by the sender coroutine. */
+    uint8_t *sbuf;
+    uint8_t send_nonce[BNACL_NONCEBYTES];
+    /* Channel to the sender coroutine. The user uses ch[0], the sender
+       uses ch[1]. */
+    int ch[2];
+    int sender;
+    /* Set once the outbound stream is broken by a canceled send. */
+    int txerr;
+    /* Last inbound record, decrypted. */
+    uint8_t *rbuf;
+    size_t rpos;
+    size_t rlen;
+    int rstarted;
+    int rfinal;
+    int rxerr;
+    uint8_t recv_nonce[BNACL_NONCEBYTES];
+};
+
+static coroutine void bnacl_sender(struct bnacl_sock *obj);
+
+static void *bnacl_hquery(struct hvfs *hvfs, const void *type) {
+    struct bnacl_sock *obj = (struct bnacl_sock*)hvfs;
+    if(type == bsock_type) return &obj->bvfs;
+    if(type == bnacl_type) return obj;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+int bnacl_attach(int s, const void *key, size_t keylen, size_t recordlen,
+      int64_t interval, int64_t deadline) {
+    int rc;
+    int err;
+    if(dsock_slow(!key || keylen != BNACL_KEYBYTES || !recordlen ||
+          recordlen >= BNACL_FINAL)) {err = EINVAL; goto error1;}
+    /* Check whether underlying socket is a bytestream. */
+    if(dsock_slow(!hquery(s, bsock_type))) {err = errno; goto error1;}
+    /* Create the object. */
+    struct bnacl_sock *obj = malloc(sizeof(struct bnacl_sock));
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
+    obj->hvfs.query = bnacl_hquery;
+    obj->hvfs.close = bnacl_hclose;
+    obj->bvfs.bsendl = bnacl_bsendl;
+    obj->bvfs.brecvl = bnacl_brecvl;
+    obj->s = s;
+    obj->recordlen = recordlen;
+    obj->interval = interval;
+    memcpy(obj->key, key, BNACL_KEYBYTES);
+    obj->rpos = 0;
+    obj->rlen = 0;
+    obj->rstarted = 0;
+    obj->rfinal = 0;
+    obj->rxerr = 0;
+    obj->txerr = 0;
+    obj->sbuf = malloc(BNACL_OVERHEAD + recordlen);
+    if(dsock_slow(!obj->sbuf)) {err = ENOMEM; goto error2;}
+    obj->rbuf = malloc(BNACL_OVERHEAD + recordlen);
+    if(dsock_slow(!obj->rbuf)) {err = ENOMEM; goto error3;}
+    /* Start the outbound stream with a random nonce. */
+    rc = dsock_random(obj->send_nonce, BNACL_NONCEBYTES, deadline);
+    if(dsock_slow(rc != 0)) {err = errno; goto error4;}
+    rc = bsend(s, obj->send_nonce, BNACL_NONCEBYTES, deadline);
+    if(dsock_slow(rc != 0)) {err = errno; goto error4;}
+    rc = chmake(obj->ch);
+    if(dsock_slow(rc != 0)) {err = errno; goto error4;}
+    obj->sender = go(bnacl_sender(obj));
+    if(dsock_slow(obj->sender < 0)) {err = errno; goto error5;}
+    /* Create the handle. */
+    int h = hmake(&obj->hvfs);
+    if(dsock_slow(h < 0)) {err = errno; goto error6;}
+    return h;
+error6:
+    rc = hclose(obj->sender);
+    dsock_assert(rc == 0);
+error5:
+    rc = hclose(obj->ch[1]);
+    dsock_assert(rc == 0);
+    rc = hclose(obj->ch[0]);
+    dsock_assert(rc == 0);
+error4:
+    free(obj->rbuf);
+error3:
+    free(obj->sbuf);
+error2:
+    memset(obj->key, 0, sizeof(obj->key));
+    free(obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+/* Stops the sender coroutine and deallocates the object. */
+static void bnacl_free(struct bnacl_sock *obj) {
+    int rc;
+    if(obj->sender >= 0) {
+        rc = hclose(obj->sender);
+        dsock_assert(rc == 0);
+    }
+    rc = hclose(obj->ch[1]);
+    dsock_assert(rc == 0);
+    rc = hclose(obj->ch[0]);
+    dsock_assert(rc == 0);
+    free(obj->sbuf);
+    free(obj->rbuf);
+    memset(obj->key, 0, sizeof(obj->key));
+    free(obj);
+}
+
+/* Passes a request to the sender coroutine and waits till it's done. */
+static int bnacl_request(struct bnacl_sock *obj, int op,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    if(dsock_slow(obj->txerr)) {errno = obj->txerr; return -1;}
+    struct bnacl_vec vec = {op, first, last, deadline};
+    int rc = chsend(obj->ch[0], &vec, sizeof(vec), deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    /* The sender obeys the deadline itself. Waiting for it without one
+       ensures it doesn't access user's buffers after we return. */
+    int err;
+    rc = chrecv(obj->ch[0], &err, sizeof(err), -1);
+    if(dsock_slow(rc < 0)) {
+        /* Canceled while the sender may still be reading user's buffers.
+           Stop it before returning. Part of the data may have been sent
+           already, so the outbound stream can't be used any more. */
+        err = errno;
+        rc = hclose(obj->sender);
+        dsock_assert(rc == 0);
+        obj->sender = -1;
+        obj->txerr = ECONNRESET;
+        errno = err;
+        return -1;
+    }
+    if(dsock_slow(err != 0)) {errno = err; return -1;}
+    return 0;
+}
+
+int bnacl_flush(int s, int64_t deadline) {
+    struct bnacl_sock *obj = hquery(s, bnacl_type);
+    if(dsock_slow(!obj)) return -1;
+    return bnacl_request(obj, BNACL_FLUSH, NULL, NULL, deadline);
+}
+
+int bnacl_detach(int s, int64_t deadline) {
+    struct bnacl_sock *obj = hquery(s, bnacl_type);
+    if(dsock_slow(!obj)) return -1;
+    /* Flush the buffered data and let the peer know the stream is over. */
+    int rc = bnacl_request(obj, BNACL_CLOSE, NULL, NULL, deadline);
+    int err = errno;
+    int u = obj->s;
+    bnacl_free(obj);
+    if(dsock_slow(rc < 0)) {
+        rc = hclose(u);
+        dsock_assert(rc == 0);
+        errno = err;
+        return -1;
+    }
+    return u;
+}
+
+static int bnacl_bsendl(struct bsock_vfs *bvfs,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    struct bnacl_sock *obj = dsock_cont(bvfs, struct bnacl_sock, bvfs);
+    int rc = iol_check(first, last, NULL, NULL);
+    if(dsock_slow(rc < 0)) return -1;
+    /* Send is done in a worker coroutine. */
+    return bnacl_request(obj, BNACL_SEND, first, last, deadline);
+}
+
+/* Nonce of the next record. */
+static void bnacl_nonce(uint8_t *dst, uint8_t *nonce, uint32_t hdr) {
+    int i;
+    for(i = 0; i != BNACL_NONCEBYTES; ++i) {
+        nonce[i]++;
+        if(nonce[i]) break;
+    }
+    memcpy(dst, nonce, BNACL_NONCEBYTES);
+    dst[BNACL_NONCEBYTES - 4] ^= (uint8_t)hdr;
+    dst[BNACL_NONCEBYTES - 3] ^= (uint8_t)(hdr >> 8);
+    dst[BNACL_NONCEBYTES - 2] ^= (uint8_t)(hdr >> 16);
+    dst[BNACL_NONCEBYTES - 1] ^= (uint8_t)(hdr >> 24);
+}
+
+/* Encrypts 'len' bytes in the outbound buffer and sends them as a record.
+   Returns 0 or error code. */
+static int bnacl_sendrecord(struct bnacl_sock *obj, size_t len, int final,
+      int64_t deadline) {
+    uint32_t hdr = (uint32_t)len | (final ? BNACL_FINAL : 0);
+    dsock_putl(obj->sbuf, hdr);
+    uint8_t nonce[BNACL_NONCEBYTES];
+    bnacl_nonce(nonce, obj->send_nonce, hdr);
+    uint8_t *data = obj->sbuf + BNACL_OVERHEAD;
+    xsalsa20poly1305_seal(obj->sbuf + BNACL_HDRBYTES, data, data, len, nonce,
+        obj->key);
+    int rc = bsend(obj->s, obj->sbuf, BNACL_OVERHEAD + len, deadline);
+    if(dsock_slow(rc < 0)) return errno;
+    return 0;
+}
+
+static coroutine void bnacl_sender(struct bnacl_sock *obj) {
+    int ch = obj->ch[1];
+    /* Amount of data in the outbound record. */
+    size_t len = 0;
+    /* Time when the first byte of the record was buffered. */
+    int64_t first = 0;
+    /* Once sending fails the stream is broken. */
+    int err = 0;
+    while(1) {
+        /* Get data to send from the user coroutine. */
+        struct bnacl_vec vec;
+        int rc = chrecv(ch, &vec, sizeof(vec),
+            obj->interval >= 0 && len ? first + obj->interval : -1);
+        if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
+        /* Timeout expired. Flush the partial record. */
+        if(dsock_slow(rc < 0 && errno == ETIMEDOUT)) {
+            if(!err) err = bnacl_sendrecord(obj, len, 0,
+                now() + BNACL_FLUSHTIMEOUT);
+            if(dsock_slow(err == ECANCELED)) return;
+            /* The stream is broken. Make subsequent operations fail
+               straight away rather than queue up behind the sender. */
+            if(dsock_slow(err)) obj->txerr = err;
+            len = 0;
+            continue;
+        }
+        dsock_assert(rc == 0);
+        /* Split the data into records, sending each one that fills up. */
+        struct iolist *it;
+        for(it = vec.first; it && !err; it = it->iol_next) {
+            const uint8_t *src = it->iol_base;
+            size_t rmn = it->iol_len;
+            while(rmn) {
+                if(!len) first = now();
+                size_t tocopy = MIN(rmn, obj->recordlen - len);
+                memcpy(obj->sbuf + BNACL_OVERHEAD + len, src, tocopy);
+                len += tocopy;
+                src += tocopy;
+                rmn -= tocopy;
+                if(len == obj->recordlen) {
+                    err = bnacl_sendrecord(obj, len, 0, vec.deadline);
+                    len = 0;
+                    if(dsock_slow(err)) break;
+                }
+            }
+        }
+        if(!err && (vec.op == BNACL_CLOSE || (vec.op == BNACL_FLUSH && len))) {
+            err = bnacl_sendrecord(obj, len, vec.op == BNACL_CLOSE,
+                vec.deadline);
+            len = 0;
+        }
+        if(dsock_slow(err == ECANCELED)) return;
+        /* Pass the result to the user. */
+        rc = chsend(ch, &err, sizeof(err), -1);
+        if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
+        dsock_assert(rc == 0);
+    }
+}
+
+/* Receives next record and decrypts it into the inbound buffer. */
+static int bnacl_recvrecord(struct bnacl_sock *obj, int64_t deadline) {
+    if(dsock_slow(obj->rfinal)) {errno = EPIPE; return -1;}
+    int rc;
+    if(dsock_slow(!obj->rstarted)) {
+        rc = brecv(obj->s, obj->recv_nonce, BNACL_NONCEBYTES, deadline);
+        if(dsock_slow(rc < 0)) goto error;
+        obj->rstarted = 1;
+    }
+    rc = brecv(obj->s, obj->rbuf, BNACL_OVERHEAD, deadline);
+    if(dsock_slow(rc < 0)) goto error;
+    uint32_t hdr = dsock_getl(obj->rbuf);
+    size_t len = hdr & ~BNACL_FINAL;
+    if(dsock_slow(len > obj->recordlen)) {errno = EPROTO; goto error;}
+    uint8_t *data = obj->rbuf + BNACL_OVERHEAD;
+    rc = brecv(obj->s, data, len, deadline);
+    if(dsock_slow(rc < 0)) goto error;
+    uint8_t nonce[BNACL_NONCEBYTES];
+    bnacl_nonce(nonce, obj->recv_nonce, hdr);
+    rc = xsalsa20poly1305_open(data, data, len, obj->rbuf + BNACL_HDRBYTES,
+        nonce, obj->key);
+    if(dsock_slow(rc < 0)) {errno = EACCES; goto error;}
+    obj->rpos = BNACL_OVERHEAD;
+    obj->rlen = BNACL_OVERHEAD + len;
+    obj->rfinal = hdr & BNACL_FINAL ? 1 : 0;
+    return 0;
+error:
+    /* Connection closed without the final record means the stream may have
+       been truncated. */
+    if(errno == EPIPE) errno = ECONNRESET;
+    /* Part of the record may have been lost, the stream can't be resynced. */
+    obj->rxerr = errno;
+    return -1;
+}
+
+static int bnacl_brecvl(struct bsock_vfs *bvfs,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    struct bnacl_sock *obj = dsock_cont(bvfs, struct bnacl_sock, bvfs);
+    int rc = iol_check(first, last, NULL, NULL);
+    if(dsock_slow(rc < 0)) return -1;
+    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
+    struct iolist *it;
+    for(it = first; it; it = it->iol_next) {
+        uint8_t *dst = it->iol_base;
+        size_t rmn = it->iol_len;
+        while(rmn) {
+            if(obj->rpos == obj->rlen) {
+                rc = bnacl_recvrecord(obj, deadline);
+                if(dsock_slow(rc < 0)) return -1;
+                continue;
+            }
+            size_t tocopy = MIN(rmn, obj->rlen - obj->rpos);
+            if(dst) {
+                memcpy(dst, obj->rbuf + obj->rpos, tocopy);
+                dst += tocopy;
+            }
+            obj->rpos += tocopy;
+            rmn -= tocopy;
+        }
+    }
+    return 0;
+}
+
+/* Closing can't block, so buffered data is dropped rather than flushed.
+   Use bnacl_detach() to deliver it. */
+static void bnacl_hclose(struct hvfs *hvfs) {
+    struct bnacl_sock *obj = (struct bnacl_sock*)hvfs;
+    int u = obj->s;
+    bnacl_free(obj);
+    int rc = hclose(u);
+    dsock_assert(rc == 0);
+}
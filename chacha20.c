@@ -0,0 +1,301 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <string.h>
+
+#include "chacha20.h"
+#include "poly1305.h"
+#include "utils.h"
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#define CHACHA20_X86 1
+#include <immintrin.h>
+#endif
+
+/* The rounds are written once in terms of ADD, XOR and ROTL so that
+   the same code serves the scalar kernel and the vector kernels, where
+   each variable holds the same word of several consecutive blocks. */
+
+#define CHACHA20_QR(ADD, XOR, ROTL, a, b, c, d) \
+    a = ADD(a, b); d = XOR(d, a); d = ROTL(d, 16);\
+    c = ADD(c, d); b = XOR(b, c); b = ROTL(b, 12);\
+    a = ADD(a, b); d = XOR(d, a); d = ROTL(d, 8);\
+    c = ADD(c, d); b = XOR(b, c); b = ROTL(b, 7);
+
+#define CHACHA20_ROUNDS(ADD, XOR, ROTL, x) \
+    do {\
+        int r_;\
+        for(r_ = 0; r_ != 10; ++r_) {\
+            CHACHA20_QR(ADD, XOR, ROTL, x[0], x[4], x[8], x[12])\
+            CHACHA20_QR(ADD, XOR, ROTL, x[1], x[5], x[9], x[13])\
+            CHACHA20_QR(ADD, XOR, ROTL, x[2], x[6], x[10], x[14])\
+            CHACHA20_QR(ADD, XOR, ROTL, x[3], x[7], x[11], x[15])\
+            CHACHA20_QR(ADD, XOR, ROTL, x[0], x[5], x[10], x[15])\
+            CHACHA20_QR(ADD, XOR, ROTL, x[1], x[6], x[11], x[12])\
+            CHACHA20_QR(ADD, XOR, ROTL, x[2], x[7], x[8], x[13])\
+            CHACHA20_QR(ADD, XOR, ROTL, x[3], x[4], x[9], x[14])\
+        }\
+    } while(0)
+
+#define CHACHA20_ADD(a, b) ((a) + (b))
+#define CHACHA20_XOR(a, b) ((a) ^ (b))
+#define CHACHA20_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static uint32_t chacha20_ld32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void chacha20_st32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+/* Generates one 64-byte keystream block. */
+static void chacha20_block(uint8_t *out, const uint32_t *s) {
+    uint32_t x[16];
+    memcpy(x, s, sizeof(x));
+    CHACHA20_ROUNDS(CHACHA20_ADD, CHACHA20_XOR, CHACHA20_ROTL, x);
+    int i;
+    for(i = 0; i != 16; ++i)
+        chacha20_st32(out + 4 * i, x[i] + s[i]);
+}
+
+/* Each vector kernel processes as many groups of blocks as possible,
+   advances the block counter (word 12) in the state and returns number
+   of bytes processed. */
+
+#if defined CHACHA20_X86
+
+#define CHACHA20_ADD8(a, b) _mm256_add_epi32(a, b)
+#define CHACHA20_XOR8(a, b) _mm256_xor_si256(a, b)
+/* Rotations by whole bytes are done by a single shuffle. */
+#define CHACHA20_ROTL8(v, n) \
+    ((n) == 16 ? _mm256_shuffle_epi8(v, rot16) :\
+    (n) == 8 ? _mm256_shuffle_epi8(v, rot8) :\
+    _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n))))
+
+__attribute__((target("avx2")))
+static void chacha20_out8(uint8_t *dst, const uint8_t *src, size_t off,
+      __m256i v) {
+    if(src) v = _mm256_xor_si256(v,
+        _mm256_loadu_si256((const __m256i*)(src + off)));
+    _mm256_storeu_si256((__m256i*)(dst + off), v);
+}
+
+__attribute__((target("avx2")))
+static size_t chacha20_avx2(uint8_t *dst, const uint8_t *src, size_t len,
+      uint32_t *s) {
+    const __m256i rot16 = _mm256_set_epi8(
+        13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+        13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    const __m256i rot8 = _mm256_set_epi8(
+        14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+        14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+    uint32_t ctr = s[12];
+    size_t pos = 0;
+    for(; pos + 512 <= len; pos += 512, ctr += 8) {
+        __m256i x[16], orig[16];
+        int i;
+        for(i = 0; i != 16; ++i) orig[i] = _mm256_set1_epi32((int)s[i]);
+        orig[12] = _mm256_add_epi32(_mm256_set1_epi32((int)ctr),
+            _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+        memcpy(x, orig, sizeof(x));
+        CHACHA20_ROUNDS(CHACHA20_ADD8, CHACHA20_XOR8, CHACHA20_ROTL8, x);
+        for(i = 0; i != 16; ++i) x[i] = _mm256_add_epi32(x[i], orig[i]);
+        /* Transpose each group of four words. Low 128-bit half holds
+           blocks 0-3, high half holds blocks 4-7. */
+        __m256i t[16];
+        int g;
+        for(g = 0; g != 4; ++g) {
+            __m256i *a = x + 4 * g;
+            __m256i t0 = _mm256_unpacklo_epi32(a[0], a[1]);
+            __m256i t1 = _mm256_unpacklo_epi32(a[2], a[3]);
+            __m256i t2 = _mm256_unpackhi_epi32(a[0], a[1]);
+            __m256i t3 = _mm256_unpackhi_epi32(a[2], a[3]);
+            t[g] = _mm256_unpacklo_epi64(t0, t1);
+            t[4 + g] = _mm256_unpackhi_epi64(t0, t1);
+            t[8 + g] = _mm256_unpacklo_epi64(t2, t3);
+            t[12 + g] = _mm256_unpackhi_epi64(t2, t3);
+        }
+        /* Combine the halves into 32-byte pieces of the output blocks. */
+        int j;
+        for(j = 0; j != 4; ++j) {
+            __m256i *b = t + 4 * j;
+            chacha20_out8(dst, src, pos + 64 * j,
+                _mm256_permute2x128_si256(b[0], b[1], 0x20));
+            chacha20_out8(dst, src, pos + 64 * j + 32,
+                _mm256_permute2x128_si256(b[2], b[3], 0x20));
+            chacha20_out8(dst, src, pos + 64 * (j + 4),
+                _mm256_permute2x128_si256(b[0], b[1], 0x31));
+            chacha20_out8(dst, src, pos + 64 * (j + 4) + 32,
+                _mm256_permute2x128_si256(b[2], b[3], 0x31));
+        }
+    }
+    s[12] = ctr;
+    return pos;
+}
+
+static int chacha20_hasavx2(void) {
+    static int avx2 = -1;
+    if(dsock_slow(avx2 < 0)) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return avx2;
+}
+
+#endif
+
+#if defined __SSE2__
+
+#include <emmintrin.h>
+
+#define CHACHA20_ADD4(a, b) _mm_add_epi32(a, b)
+#define CHACHA20_XOR4(a, b) _mm_xor_si128(a, b)
+#define CHACHA20_ROTL4(v, n) \
+    _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+static void chacha20_out4(uint8_t *dst, const uint8_t *src, size_t off,
+      __m128i v) {
+    if(src) v = _mm_xor_si128(v, _mm_loadu_si128((const __m128i*)(src + off)));
+    _mm_storeu_si128((__m128i*)(dst + off), v);
+}
+
+static size_t chacha20_sse2(uint8_t *dst, const uint8_t *src, size_t len,
+      uint32_t *s) {
+    uint32_t ctr = s[12];
+    size_t pos = 0;
+    for(; pos + 256 <= len; pos += 256, ctr += 4) {
+        __m128i x[16], orig[16];
+        int i;
+        for(i = 0; i != 16; ++i) orig[i] = _mm_set1_epi32((int)s[i]);
+        orig[12] = _mm_add_epi32(_mm_set1_epi32((int)ctr),
+            _mm_set_epi32(3, 2, 1, 0));
+        memcpy(x, orig, sizeof(x));
+        CHACHA20_ROUNDS(CHACHA20_ADD4, CHACHA20_XOR4, CHACHA20_ROTL4, x);
+        for(i = 0; i != 16; ++i) x[i] = _mm_add_epi32(x[i], orig[i]);
+        /* Transpose each group of four words into four blocks. */
+        int g;
+        for(g = 0; g != 4; ++g) {
+            __m128i *a = x + 4 * g;
+            __m128i t0 = _mm_unpacklo_epi32(a[0], a[1]);
+            __m128i t1 = _mm_unpacklo_epi32(a[2], a[3]);
+            __m128i t2 = _mm_unpackhi_epi32(a[0], a[1]);
+            __m128i t3 = _mm_unpackhi_epi32(a[2], a[3]);
+            chacha20_out4(dst, src, pos + 16 * g,
+                _mm_unpacklo_epi64(t0, t1));
+            chacha20_out4(dst, src, pos + 64 + 16 * g,
+                _mm_unpackhi_epi64(t0, t1));
+            chacha20_out4(dst, src, pos + 128 + 16 * g,
+                _mm_unpacklo_epi64(t2, t3));
+            chacha20_out4(dst, src, pos + 192 + 16 * g,
+                _mm_unpackhi_epi64(t2, t3));
+        }
+    }
+    s[12] = ctr;
+    return pos;
+}
+
+#endif
+
+void chacha20_xor(uint8_t *dst, const uint8_t *src, size_t len,
+      const uint8_t *nonce, uint32_t ic, const uint8_t *key) {
+    uint32_t s[16];
+    s[0] = 0x61707865;
+    s[1] = 0x3320646e;
+    s[2] = 0x79622d32;
+    s[3] = 0x6b206574;
+    int i;
+    for(i = 0; i != 8; ++i) s[4 + i] = chacha20_ld32(key + 4 * i);
+    s[12] = ic;
+    for(i = 0; i != 3; ++i) s[13 + i] = chacha20_ld32(nonce + 4 * i);
+    size_t pos = 0;
+#if defined CHACHA20_X86
+    if(len >= 512 && chacha20_hasavx2())
+        pos = chacha20_avx2(dst, src, len, s);
+#endif
+#if defined __SSE2__
+    pos += chacha20_sse2(dst + pos, src ? src + pos : NULL, len - pos, s);
+#endif
+    /* Portable block-at-a-time fallback, also used for the tail. */
+    while(pos != len) {
+        uint8_t ks[64];
+        chacha20_block(ks, s);
+        s[12]++;
+        size_t n = MIN(len - pos, 64);
+        size_t j;
+        if(src)
+            for(j = 0; j != n; ++j) dst[pos + j] = src[pos + j] ^ ks[j];
+        else
+            memcpy(dst + pos, ks, n);
+        pos += n;
+    }
+}
+
+/* Computes the tag over the AAD and the ciphertext. */
+static void chacha20poly1305_tag(uint8_t *tag, const uint8_t *c, size_t len,
+      const uint8_t *aad, size_t aadlen, const uint8_t *nonce,
+      const uint8_t *key) {
+    /* One-time key is the beginning of the first keystream block. */
+    uint8_t otk[64];
+    chacha20_xor(otk, NULL, sizeof(otk), nonce, 0, key);
+    struct poly1305 st;
+    poly1305_init(&st, otk);
+    static const uint8_t zeros[16] = {0};
+    poly1305_update(&st, aad, aadlen);
+    poly1305_update(&st, zeros, (16 - aadlen % 16) % 16);
+    poly1305_update(&st, c, len);
+    poly1305_update(&st, zeros, (16 - len % 16) % 16);
+    uint8_t lens[16];
+    chacha20_st32(lens, (uint32_t)aadlen);
+    chacha20_st32(lens + 4, (uint32_t)((uint64_t)aadlen >> 32));
+    chacha20_st32(lens + 8, (uint32_t)len);
+    chacha20_st32(lens + 12, (uint32_t)((uint64_t)len >> 32));
+    poly1305_update(&st, lens, sizeof(lens));
+    poly1305_finish(&st, tag);
+    memset(otk, 0, sizeof(otk));
+}
+
+void chacha20poly1305_seal(uint8_t *tag, uint8_t *dst, const uint8_t *src,
+      size_t len, const uint8_t *aad, size_t aadlen, const uint8_t *nonce,
+      const uint8_t *key) {
+    chacha20_xor(dst, src, len, nonce, 1, key);
+    chacha20poly1305_tag(tag, dst, len, aad, aadlen, nonce, key);
+}
+
+int chacha20poly1305_open(uint8_t *dst, const uint8_t *src, size_t len,
+      const uint8_t *tag, const uint8_t *aad, size_t aadlen,
+      const uint8_t *nonce, const uint8_t *key) {
+    uint8_t computed[16];
+    chacha20poly1305_tag(computed, src, len, aad, aadlen, nonce, key);
+    uint8_t diff = 0;
+    int i;
+    for(i = 0; i != 16; ++i) diff |= computed[i] ^ tag[i];
+    if(dsock_slow(diff)) return -1;
+    chacha20_xor(dst, src, len, nonce, 1, key);
+    return 0;
+}
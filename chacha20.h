@@ -0,0 +1,53 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef DSOCK_CHACHA20_H_INCLUDED
+#define DSOCK_CHACHA20_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* XORs 'len' bytes from 'src' with ChaCha20 keystream (RFC 8439) and stores
+   the result to 'dst'. 'dst' may be the same as 'src'. If 'src' is NULL,
+   keystream itself is stored. 'nonce' is 12 bytes long, 'key' is 32 bytes
+   long. 'ic' is the number of the 64-byte block to start with. */
+void chacha20_xor(uint8_t *dst, const uint8_t *src, size_t len,
+    const uint8_t *nonce, uint32_t ic, const uint8_t *key);
+
+/* ChaCha20-Poly1305 AEAD (RFC 8439). Encrypts 'len' bytes from 'src' to
+   'dst' and stores the 16-byte authentication tag to 'tag'. 'dst' may be
+   the same as 'src'. */
+void chacha20poly1305_seal(uint8_t *tag, uint8_t *dst, const uint8_t *src,
+    size_t len, const uint8_t *aad, size_t aadlen, const uint8_t *nonce,
+    const uint8_t *key);
+
+/* Checks the tag and, if it matches, decrypts the data. Returns 0 on
+   success, -1 if authentication fails. In the latter case 'dst' is not
+   touched. */
+int chacha20poly1305_open(uint8_t *dst, const uint8_t *src, size_t len,
+    const uint8_t *tag, const uint8_t *aad, size_t aadlen,
+    const uint8_t *nonce, const uint8_t *key);
+
+#endif
+
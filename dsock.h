@@ -69,6 +69,18 @@
 #define DSOCK_EXPORT
 #endif
 
+/******************************************************************************/
+/*  Scratch buffers.                                                          */
+/*  Transformation layers, such as NaCl and LZ4, encode and decode messages   */
+/*  in scratch buffers shared by all the sockets in the thread. Buffers are   */
+/*  borrowed only for the duration of a single operation. Idle buffers are    */
+/*  kept for reuse up to 'limit' bytes in total per thread, 1MB by default.   */
+/*  Anything above that is released to the system as soon as it is returned.  */
+/******************************************************************************/
+
+DSOCK_EXPORT void dsock_scratchlimit(
+    size_t limit);
+
 /******************************************************************************/
 /*  UDP protocol.                                                             */
 /******************************************************************************/
@@ -105,6 +117,11 @@ DSOCK_EXPORT ssize_t udp_recvl(
 
 DSOCK_EXPORT int http_attach(
     int s);
+
+/*  http_detach() returns the underlying bytestream that was passed to        */
+/*  http_attach(). Earlier versions returned a CRLF socket layered on top of  */
+/*  it. Detach between messages, e.g. after a 101 (Switching Protocols)       */
+/*  response, and use the returned socket for the upgraded protocol.          */
 DSOCK_EXPORT int http_detach(
     int s,
     int64_t deadline);
@@ -113,6 +130,12 @@ DSOCK_EXPORT int http_sendrequest(
     const char *command,
     const char *resource,
     int64_t deadline);
+
+/*  http_recvrequest() fails with EMSGSIZE if the resource doesn't fit into   */
+/*  the supplied buffer or into the receive buffer within the socket and      */
+/*  with ENOTSUP if the command doesn't fit. Malformed request line makes it  */
+/*  fail with EPROTO.                                                         */
+
 DSOCK_EXPORT int http_recvrequest(
     int s,
     char *command,
@@ -143,6 +166,206 @@ DSOCK_EXPORT int http_recvfield(
     size_t valuelen,
     int64_t deadline);
 
+/*  Receives all the remaining fields up to the end of the header and stores  */
+/*  them in a table within the socket. Returns number of fields received.     */
+/*  Returned names and values point directly into the receive buffer and are  */
+/*  valid only until next invocation of http_recvfields(). Lookups are        */
+/*  case-insensitive.                                                         */
+
+#define DSOCK_HTTP_HOST 0
+#define DSOCK_HTTP_CONTENT_LENGTH 1
+#define DSOCK_HTTP_CONNECTION 2
+#define DSOCK_HTTP_TRANSFER_ENCODING 3
+#define DSOCK_HTTP_NKNOWN 4
+
+DSOCK_EXPORT int http_recvfields(
+    int s,
+    int64_t deadline);
+DSOCK_EXPORT const char *http_field(
+    int s,
+    const char *name);
+DSOCK_EXPORT const char *http_knownfield(
+    int s,
+    int id);
+DSOCK_EXPORT int http_fieldat(
+    int s,
+    size_t idx,
+    const char **name,
+    const char **value);
+
+/*  Builds the start line and the fields in a buffer within the socket and    */
+/*  sends them, terminated by an empty line, in a single write. Optional body */
+/*  passed to http_sendheader() is sent as a part of the same write.          */
+
+DSOCK_EXPORT int http_startrequest(
+    int s,
+    const char *command,
+    const char *resource);
+DSOCK_EXPORT int http_startstatus(
+    int s,
+    int status,
+    const char *reason);
+DSOCK_EXPORT int http_addfield(
+    int s,
+    const char *name,
+    const char *value);
+DSOCK_EXPORT int http_sendheader(
+    int s,
+    struct iolist *first,
+    struct iolist *last,
+    int64_t deadline);
+
+/*  Adds Date field with the current time to the header being built. The     */
+/*  value is formatted at most once a second.                                 */
+
+DSOCK_EXPORT int http_adddate(
+    int s);
+
+/*  Header templates hold a pre-serialized status line and a set of fields.   */
+/*  http_starttemplate() starts a response by copying the template into the   */
+/*  socket. More fields can be added to it using http_addfield() before it's  */
+/*  sent by http_sendheader(). Templates are closed by hclose().              */
+
+DSOCK_EXPORT int http_mktemplate(
+    int status,
+    const char *reason);
+DSOCK_EXPORT int http_templatefield(
+    int t,
+    const char *name,
+    const char *value);
+DSOCK_EXPORT int http_starttemplate(
+    int s,
+    int t);
+
+/*  Message body is framed according to Content-Length and Transfer-Encoding */
+/*  fields of the received header. Body of a response that is neither        */
+/*  chunked nor has Content-Length runs until the connection is closed and   */
+/*  the connection can't be reused afterwards. http_recvbody() receives the  */
+/*  next piece of the body directly into the supplied buffers and returns    */
+/*  its size, or 0 once the body is complete. Unread part of the message is  */
+/*  skipped when next request or status is received.                         */
+
+DSOCK_EXPORT ssize_t http_recvbody(
+    int s,
+    struct iolist *first,
+    struct iolist *last,
+    int64_t deadline);
+DSOCK_EXPORT int http_sendbody(
+    int s,
+    struct iolist *first,
+    struct iolist *last,
+    int64_t deadline);
+DSOCK_EXPORT int http_sendchunk(
+    int s,
+    struct iolist *first,
+    struct iolist *last,
+    int64_t deadline);
+
+/*  Requests can be pipelined, i.e. sent without waiting for the responses.  */
+/*  Responses are matched to requests in order. At most 64 requests can be   */
+/*  outstanding. Sending one more fails with ENOBUFS and sends nothing.      */
+/*  http_pending() returns the number of requests not yet responded to.      */
+/*  http_reusable() returns 1 if the connection is idle and can be used for  */
+/*  a new request.                                                           */
+
+DSOCK_EXPORT int http_setmaxheader(
+    int s,
+    size_t len);
+DSOCK_EXPORT int http_pending(
+    int s);
+DSOCK_EXPORT int http_reusable(
+    int s);
+
+/*  Pool of client connections keyed by host and port. httppool_get() returns */
+/*  an idle connection or opens a new one. If there are already 'maxperhost'  */
+/*  connections to the host it waits for one to be returned. httppool_put()   */
+/*  returns the connection to the pool. Connections that can't be reused are  */
+/*  closed. Connections to any host that have been idle for more than 'idle'  */
+/*  milliseconds are closed by subsequent httppool_get() or httppool_put().   */
+/*  If the pool is closed while httppool_get() waits, it fails with           */
+/*  ECANCELED.                                                                */
+
+DSOCK_EXPORT int httppool_make(
+    size_t maxperhost,
+    int64_t idle);
+DSOCK_EXPORT int httppool_get(
+    int p,
+    const char *host,
+    int port,
+    int64_t deadline);
+DSOCK_EXPORT int httppool_put(
+    int p,
+    int s);
+
+/*  Router maps method and path of a request to user-supplied data. Patterns */
+/*  consist of literal segments, parameters (":name") which match a single   */
+/*  segment and a trailing wildcard ("*name") which matches the rest of the  */
+/*  path. NULL method matches any method. Matching doesn't allocate memory.  */
+/*  At each position literal match is preferred to a parameter, which is in  */
+/*  turn preferred to a wildcard. If the preferred alternative leads to no   */
+/*  route the next one is tried, but at most 64 times per match, so that     */
+/*  routes overlapping at many levels can't make matching arbitrarily slow.  */
+/*  Values of parameters point into the matched resource string and are not  */
+/*  NUL-terminated. httprouter_recv() receives the request line and matches  */
+/*  it. If there's no matching route it fails with ENOENT.                   */
+
+#define DSOCK_HTTPROUTER_MAXPARAMS 8
+
+struct httprouter_param {
+    const char *name;
+    const char *value;
+    size_t len;
+};
+
+struct httprouter_match {
+    void *data;
+    size_t nparams;
+    struct httprouter_param params[DSOCK_HTTPROUTER_MAXPARAMS];
+    char command[16];
+    char resource[1024];
+};
+
+DSOCK_EXPORT int httprouter_make(void);
+DSOCK_EXPORT int httprouter_add(
+    int r,
+    const char *method,
+    const char *pattern,
+    void *data);
+DSOCK_EXPORT int httprouter_match(
+    int r,
+    const char *method,
+    const char *resource,
+    struct httprouter_match *m);
+DSOCK_EXPORT int httprouter_recv(
+    int s,
+    int r,
+    struct httprouter_match *m,
+    int64_t deadline);
+
+/*  Server accepts connections from listener 'ls' and processes each of them */
+/*  in a separate coroutine. At most 'maxconns' connections are processed at */
+/*  the same time. Handler is invoked for each request once the header was   */
+/*  received. It must send the response and may read the body. Returning -1  */
+/*  closes the connection. 'timeout' limits the time to receive the header   */
+/*  and to process the request. 'maxheader' limits the size of the header,   */
+/*  zero means the default. The server takes ownership of the listener.      */
+/*  httpserver_listen() creates a listener with SO_REUSEPORT. To spread the  */
+/*  load among threads create one such listener and server in each thread.   */
+
+typedef int (*httpserver_handler)(int s, const char *command,
+    const char *resource, void *arg, int64_t deadline);
+
+DSOCK_EXPORT int httpserver_listen(
+    struct ipaddr *addr,
+    int backlog);
+DSOCK_EXPORT int httpserver_make(
+    int ls,
+    size_t maxconns,
+    int64_t timeout,
+    size_t maxheader,
+    httpserver_handler handler,
+    void *arg);
+
 /******************************************************************************/
 /*  WebSocket protocol.                                                       */
 /******************************************************************************/
@@ -154,6 +377,88 @@ DSOCK_EXPORT int websock_detach(
     int s,
     int64_t deadline);
 
+/*  Client copies and masks outgoing data in a staging buffer. The frame     */
+/*  header is sent together with the first batch of data. websock_setbuf()   */
+/*  changes the size of the buffer. If in-place masking is enabled, client   */
+/*  masks the user's buffers directly and sends each message in a single     */
+/*  write. The content of the buffers is undefined after the send.           */
+
+DSOCK_EXPORT int websock_setbuf(
+    int s,
+    size_t len);
+DSOCK_EXPORT int websock_setinplace(
+    int s,
+    int inplace);
+
+/*  Pings from the peer are answered automatically when receiving. Close     */
+/*  frame is echoed back and causes the receive to fail with EPIPE. If a     */
+/*  frame is being sent at the time, the reply follows once it's done.       */
+/*  Likewise, a send started while another frame or a reply is being sent    */
+/*  waits for it to finish, so several coroutines can send at once.          */
+/*  websock_ping() sends a timestamped ping. The matching pong is processed  */
+/*  by a subsequent receive and websock_rtt() then returns the smoothed      */
+/*  round-trip time in milliseconds.                                         */
+
+DSOCK_EXPORT int websock_ping(
+    int s,
+    int64_t deadline);
+DSOCK_EXPORT int64_t websock_rtt(
+    int s);
+
+/*  Streaming send. Message is started by websock_begin(). Data passed to    */
+/*  websock_append() is sent immediately as frames of at most the fragment   */
+/*  size set by websock_setfragment(). websock_end() finishes the message.   */
+/*  Messages can't be sent by msend() while a message is being streamed.     */
+
+DSOCK_EXPORT int websock_setfragment(
+    int s,
+    size_t len);
+DSOCK_EXPORT int websock_begin(
+    int s);
+DSOCK_EXPORT int websock_append(
+    int s,
+    struct iolist *first,
+    struct iolist *last,
+    int64_t deadline);
+DSOCK_EXPORT int websock_end(
+    int s,
+    int64_t deadline);
+
+/*  Broadcast. websock_mkframe() encodes a message into a frame once.        */
+/*  websock_broadcast() then writes the frame to each of the supplied        */
+/*  server-side connections in a single write per connection. Connections    */
+/*  are written to by a bounded pool of coroutines, so a slow peer doesn't   */
+/*  delay the others. Deadline applies to each connection on its own. The    */
+/*  function returns once all the sends are done, with the number of         */
+/*  connections the frame was sent to. If 'errs' is not NULL, error code of  */
+/*  each send, or zero on success, is stored there. The frame handle can be  */
+/*  closed while a broadcast using it is still in progress.                  */
+
+DSOCK_EXPORT int websock_mkframe(
+    struct iolist *first,
+    struct iolist *last,
+    int text);
+DSOCK_EXPORT int websock_broadcast(
+    int f,
+    const int *hs,
+    int *errs,
+    size_t nhs,
+    int64_t deadline);
+
+/*  Partial-delivery receive. Returns the next piece of the message, at most */
+/*  the size of the supplied buffers. Data already available is returned     */
+/*  without waiting for the next frame. 'eom' is set once the last piece of  */
+/*  the message was received. mrecv() fails with EBUSY while a message is    */
+/*  received this way. Text messages are checked to be valid UTF-8 as they   */
+/*  arrive; invalid text makes the receive fail with EPROTO.                 */
+
+DSOCK_EXPORT ssize_t websock_recvpart(
+    int s,
+    struct iolist *first,
+    struct iolist *last,
+    int *eom,
+    int64_t deadline);
+
 /******************************************************************************/
 /*  NaCl encryption and authentication protocol.                              */
 /*  Uses crypto_secretbox_xsalsa20poly1305 algorithm. Key is 32B long.        */
@@ -164,9 +469,101 @@ DSOCK_EXPORT int nacl_attach(
     const void *key,
     size_t keylen,
     int64_t deadline);
+
+/*  Same as nacl_attach() but allows to choose the cipher suite. All suites  */
+/*  use 32B keys and the same framing. XSalsa20 uses 24B nonces, the other   */
+/*  suites 12B nonces. AES-256-GCM is fast on CPUs with AES-NI, otherwise    */
+/*  ChaCha20-Poly1305 is preferable. Both peers must use the same suite.     */
+
+#define DSOCK_NACL_XSALSA20_POLY1305 0
+#define DSOCK_NACL_CHACHA20_POLY1305 1
+#define DSOCK_NACL_AES256_GCM 2
+
+DSOCK_EXPORT int nacl_attach_suite(
+    int s,
+    int suite,
+    const void *key,
+    size_t keylen,
+    int64_t deadline);
+/*  Public-key variant. Peers are identified by 32B X25519 key pairs such     */
+/*  as those generated by nacl_keypair(). nacl_attach_box() exchanges         */
+/*  ephemeral public keys authenticated by the long-term keys and derives     */
+/*  a session key from them. The handshake fails with EACCES if the peer      */
+/*  doesn't own the secret key matching 'peerpk'. Afterwards, messages are    */
+/*  protected as if nacl_attach() was called with the session key.            */
+
+DSOCK_EXPORT int nacl_keypair(
+    void *pk,
+    void *sk,
+    int64_t deadline);
+DSOCK_EXPORT int nacl_attach_box(
+    int s,
+    const void *sk,
+    const void *peerpk,
+    int64_t deadline);
+/*  Splits messages into independently authenticated chunks of at most        */
+/*  'len' bytes. Chunks of large messages are encrypted and decrypted in      */
+/*  parallel by a pool of worker threads; the calling coroutine waits         */
+/*  while the other coroutines keep running. Both peers must use the same     */
+/*  chunk size. Zero, the default, disables chunking. Chunks of 64kB or       */
+/*  more keep the per-chunk overhead negligible.                              */
+
+DSOCK_EXPORT int nacl_setchunklen(
+    int s,
+    size_t len);
+/*  Compact framing. Instead of the full nonce, messages carry only its       */
+/*  'deltalen' (1-8) low-order bytes, from which the peer reconstructs the    */
+/*  full nonce. Full nonce is still sent in the first message and whenever    */
+/*  the low-order bytes wrap around. Receiver rejects replayed messages.      */
+/*  Both peers must enable it before exchanging messages. Zero, the           */
+/*  default, disables it.                                                     */
+
+DSOCK_EXPORT int nacl_setcompact(
+    int s,
+    size_t deltalen);
+/*  Replay protection for unreliable transports such as UDP. Receiver         */
+/*  remembers the last 'window' messages and rejects duplicates and messages  */
+/*  older than that with EACCES. Messages may arrive out of order. The        */
+/*  window follows a single sender, so if the peer restarts, both sides       */
+/*  must attach anew. Can't be combined with compact framing. Zero, the       */
+/*  default, disables it.                                                     */
+
+DSOCK_EXPORT int nacl_setwindow(
+    int s,
+    size_t window);
 DSOCK_EXPORT int nacl_detach(
     int s);
 
+/******************************************************************************/
+/*  NaCl bytestream encryption protocol.                                      */
+/*  Splits the bytestream into records of at most 'recordlen' bytes, each     */
+/*  encrypted and authenticated using xsalsa20poly1305. Key is 32B long.      */
+/*  Partial record is sent when 'interval' milliseconds elapse after its      */
+/*  first byte was buffered, or when bnacl_flush() is called. Negative        */
+/*  interval means no timeout. If a record sent because the interval elapsed  */
+/*  can't be sent within 10 seconds, the stream is broken and subsequent      */
+/*  operations fail with ETIMEDOUT. bnacl_detach() flushes the data and marks */
+/*  the end of the stream. Peer then gets EPIPE, whereas it gets ECONNRESET   */
+/*  if the underlying connection is closed without detaching first, as the    */
+/*  stream may have been truncated. hclose() discards any buffered data and   */
+/*  doesn't mark the end of the stream. Only bnacl_detach() delivers the      */
+/*  buffered data to the peer. Both peers must use the same record size.      */
+/******************************************************************************/
+
+DSOCK_EXPORT int bnacl_attach(
+    int s,
+    const void *key,
+    size_t keylen,
+    size_t recordlen,
+    int64_t interval,
+    int64_t deadline);
+DSOCK_EXPORT int bnacl_flush(
+    int s,
+    int64_t deadline);
+DSOCK_EXPORT int bnacl_detach(
+    int s,
+    int64_t deadline);
+
 /******************************************************************************/
 /*  LZ4 bytestream compression protocol.                                      */
 /*  Compresses data using LZ4 compression algorithm.                          */
@@ -37,6 +37,8 @@
 #define FD_NOSIGNAL 0
 #endif
 
+dsock_unique_id(fd_rxbuf_type);
+
 void fd_initrxbuf(struct fd_rxbuf *rxbuf) {
     dsock_assert(rxbuf);
     rxbuf->len = 0;
@@ -273,6 +275,25 @@ int fd_recv(int s, struct fd_rxbuf *rxbuf, struct iolist *first,
     }
 }
 
+int fd_fill(int s, struct fd_rxbuf *rxbuf, int64_t deadline) {
+    if(rxbuf->pos < rxbuf->len) return 0;
+    while(1) {
+        ssize_t sz = recv(s, rxbuf->data, sizeof(rxbuf->data), 0);
+        if(dsock_slow(sz == 0)) {errno = EPIPE; return -1;}
+        if(sz > 0) {
+            rxbuf->len = sz;
+            rxbuf->pos = 0;
+            return 0;
+        }
+        if(dsock_slow(errno != EWOULDBLOCK && errno != EAGAIN)) {
+            if(errno == EPIPE) errno = ECONNRESET;
+            return -1;
+        }
+        int rc = fdin(s, deadline);
+        if(dsock_slow(rc < 0)) return -1;
+    }
+}
+
 int fd_close(int s) {
     fdclean(s);
     /* Discard any pending outbound data. If SO_LINGER option cannot
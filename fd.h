@@ -37,6 +37,17 @@ struct fd_rxbuf {
     uint8_t data[2000];
 };
 
+/* Bytestreams that keep their input in fd_rxbuf expose it via this
+   interface. It allows protocols on top of them to parse the data in place
+   rather than receiving them byte by byte. fill() waits till there's at
+   least one byte in the buffer. Consumed data are marked by advancing
+   'pos'. */
+extern const void *fd_rxbuf_type;
+
+struct fd_rxbuf_vfs {
+    struct fd_rxbuf *(*fill)(struct fd_rxbuf_vfs *vfs, int64_t deadline);
+};
+
 void fd_initrxbuf(
     struct fd_rxbuf *rxbuf);
 int fd_unblock(
@@ -62,6 +73,10 @@ int fd_recv(
     struct iolist *first,
     struct iolist *last,
     int64_t deadline);
+int fd_fill(
+    int s,
+    struct fd_rxbuf *rxbuf,
+    int64_t deadline);
 int fd_close(
     int s);
 
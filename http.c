@@ -24,13 +24,18 @@
 
 #include <errno.h>
 #include <libdillimpl.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 
 #include "dsock.h"
+#include "fd.h"
+#include "iol.h"
 #include "utils.h"
 
 dsock_unique_id(http_type);
@@ -39,12 +44,95 @@ static void *http_hquery(struct hvfs *hvfs, const void *type);
 static void http_hclose(struct hvfs *hvfs);
 static int http_hdone(struct hvfs *hvfs, int64_t deadline);
 
+/* Maximum number of fields http_recvfields() is able to store. */
+#define HTTP_MAXFIELDS 64
+/* Number of slots in the field hash table. Must be a power of two larger
+   than HTTP_MAXFIELDS to keep the probe sequences short. */
+#define HTTP_HASHSLOTS 128
+
+/* A field stored in the header table. Name and value are NUL-terminated
+   strings living directly in the header buffer. */
+struct http_field {
+    uint32_t hash;
+    uint16_t name;
+    uint16_t value;
+};
+
+/* Body framing of the message being received. */
+#define HTTP_BODY_NONE 0
+#define HTTP_BODY_LENGTH 1
+#define HTTP_BODY_CHUNKED 2
+/* Body of a response that is neither chunked nor has Content-Length runs
+   until the connection is closed. */
+#define HTTP_BODY_EOF 3
+
+/* Maximum number of requests that can be sent without receiving a response. */
+#define HTTP_MAXPIPELINE 64
+
 struct http_sock {
     struct hvfs hvfs;
-    /* Underlying CRLF socket. */
+    /* Underlying bytestream socket. CRLF framing is done here rather than
+       in a CRLF socket so that an empty line terminates the header without
+       terminating the connection and the body can be read directly. */
     int s;
     int rxerr;
+    int txerr;
+    /* Set once empty line terminating the header was received. */
+    int rxhdrdone;
+    /* Set once start line of the current message was received. */
+    int rxstarted;
+    /* Body of the message being received. For chunked encoding 'rxbody'
+       is the number of bytes left in the current chunk. */
+    int rxmode;
+    uint64_t rxbody;
+    /* Set if the message being received is a response. */
+    int rxresp;
+    /* Set if Transfer-Encoding field was received. It takes precedence
+       over Content-Length. */
+    int rxte;
+    /* Set if the message being received has no body irrespective of its
+       fields, e.g. response to HEAD request. */
+    int rxnobody;
+    /* Set if peer asked for the connection to be closed. */
+    int rxclose;
+    /* Requests sent but not yet responded to, oldest first. An entry is
+       set if the request was HEAD. Responses arrive in the same order. */
+    uint8_t pipeline[HTTP_MAXPIPELINE];
+    size_t pfirst;
+    size_t pcount;
+    /* Input buffer of the underlying socket, if it exposes one. Otherwise
+       the data are received into 'rxbyte', one byte at a time. */
+    struct fd_rxbuf_vfs *rx;
+    struct fd_rxbuf *rxfd;
+    char rxbyte;
     char rxbuf[1024];
+    /* Header table filled in by http_recvfields(). */
+    size_t nfields;
+    struct http_field fields[HTTP_MAXFIELDS];
+    /* Open-addressing hash index. Zero means empty slot, otherwise it's
+       index into 'fields' plus one. */
+    uint8_t slots[HTTP_HASHSLOTS];
+    /* Indices of well-known fields, plus one. Zero means not present. */
+    uint8_t known[DSOCK_HTTP_NKNOWN];
+    char hdrbuf[8192];
+    /* Limit on the size of the header received by http_recvfields(). */
+    size_t hdrmax;
+    /* Header being built by http_start*() and http_addfield(). */
+    size_t txlen;
+    char txbuf[4096];
+    /* Set if the header being built is a request. */
+    int txreq;
+    int txhead;
+};
+
+static int http_startmessage(struct http_sock *obj, int64_t deadline);
+
+/* Names of well-known fields, indexed by DSOCK_HTTP_* constants. */
+static const char *http_knownnames[DSOCK_HTTP_NKNOWN] = {
+    "Host",
+    "Content-Length",
+    "Connection",
+    "Transfer-Encoding"
 };
 
 static void *http_hquery(struct hvfs *hvfs, const void *type) {
@@ -66,22 +154,38 @@ int http_attach(int s) {
     obj->hvfs.done = http_hdone;
     obj->s = -1;
     obj->rxerr = 0;
+    obj->txerr = 0;
+    obj->rxhdrdone = 0;
+    obj->rxstarted = 0;
+    obj->rxmode = HTTP_BODY_NONE;
+    obj->rxbody = 0;
+    obj->rxresp = 0;
+    obj->rxte = 0;
+    obj->rxnobody = 0;
+    obj->rxclose = 0;
+    obj->pfirst = 0;
+    obj->pcount = 0;
+    obj->rx = NULL;
+    obj->rxfd = NULL;
+    obj->nfields = 0;
+    memset(obj->slots, 0, sizeof(obj->slots));
+    memset(obj->known, 0, sizeof(obj->known));
+    obj->txlen = 0;
+    obj->txreq = 0;
+    obj->txhead = 0;
+    obj->hdrmax = sizeof(obj->hdrbuf);
     /* Create the handle. */
     int h = hmake(&obj->hvfs);
     if(dsock_slow(h < 0)) {err = errno; goto error2;}
     /* Make a private copy of the underlying socket. */
-    int tmp = hdup(s);
-    if(dsock_slow(tmp < 0)) {err = errno; goto error3;}
-    /* Wrap the underlying socket into CRLF protocol. */
-    obj->s = crlf_attach(tmp);
-    if(dsock_slow(obj->s < 0)) {err = errno; goto error4;}
+    obj->s = hdup(s);
+    if(dsock_slow(obj->s < 0)) {err = errno; goto error3;}
+    /* Parse the data in place if the underlying socket allows for it. */
+    obj->rx = hquery(obj->s, fd_rxbuf_type);
     /* Function succeeded. We can now close original undelying handle. */
     int rc = hclose(s);
     dsock_assert(rc == 0);
     return h;
-error4:
-    rc = hclose(tmp);
-    dsock_assert(rc == 0);
 error3:;
     rc = hclose(h);
     dsock_assert(rc == 0);
@@ -93,20 +197,114 @@ error1:
 
 }
 
+/* Terminates the header by sending an empty line. Unlike with plain CRLF
+   sockets, more messages can be sent afterwards. */
 static int http_hdone(struct hvfs *hvfs, int64_t deadline) {
     struct http_sock *obj = (struct http_sock*)hvfs;
-    return hdone(obj->s, deadline);
+    int rc = bsend(obj->s, "\r\n", 2, deadline);
+    if(dsock_slow(rc < 0)) obj->txerr = errno;
+    return rc;
 }
 
 int http_detach(int s, int64_t deadline) {
     struct http_sock *obj = hquery(s, http_type);
     if(dsock_slow(!obj)) return -1;
-    int u = crlf_detach(obj->s, deadline);
-    /* TODO: Handle errors. */
+    int u = obj->s;
     free(obj);
     return u;
 }
 
+/* Returns received data that were not consumed yet and stores their size
+   to 'len'. Bytestream has no partial receive so, unless the underlying
+   socket exposes its input buffer, a single byte is received at a time.
+   Asking for more could block forever or, if the peer closed the
+   connection, lose the data. */
+static const char *http_peek(struct http_sock *obj, size_t *len,
+      int64_t deadline) {
+    if(obj->rx) {
+        obj->rxfd = obj->rx->fill(obj->rx, deadline);
+        if(dsock_slow(!obj->rxfd)) return NULL;
+        *len = obj->rxfd->len - obj->rxfd->pos;
+        return (const char*)obj->rxfd->data + obj->rxfd->pos;
+    }
+    int rc = brecv(obj->s, &obj->rxbyte, 1, deadline);
+    if(dsock_slow(rc < 0)) return NULL;
+    *len = 1;
+    return &obj->rxbyte;
+}
+
+/* Marks 'len' bytes returned by the last http_peek() as consumed.
+   The rest will be returned by the next call to http_peek(). */
+static void http_consume(struct http_sock *obj, size_t len) {
+    if(obj->rx) {obj->rxfd->pos += len; return;}
+    dsock_assert(len == 1);
+}
+
+/* Receives a single line into the supplied buffer, strips the line
+   terminator and NUL-terminates it. */
+static ssize_t http_readline(struct http_sock *obj, char *buf, size_t len,
+      int64_t deadline) {
+    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
+    /* There must be space at least for the terminating zero. */
+    if(dsock_slow(len == 0)) {errno = obj->rxerr = EMSGSIZE; return -1;}
+    size_t pos = 0;
+    while(1) {
+        size_t avail;
+        const char *data = http_peek(obj, &avail, deadline);
+        if(dsock_slow(!data)) {
+            /* Timeout before the line was started is harmless. Otherwise,
+               part of the line was lost and the stream can't be resynced. */
+            if(pos > 0 || (errno != ETIMEDOUT && errno != ECANCELED))
+                obj->rxerr = errno;
+            return -1;
+        }
+        /* Copy the data up to the end of the line. */
+        const char *lf = memchr(data, '\n', avail);
+        size_t n = lf ? (size_t)(lf - data) : avail;
+        if(dsock_slow(pos + n >= len)) {
+            errno = obj->rxerr = EMSGSIZE; return -1;}
+        memcpy(buf + pos, data, n);
+        pos += n;
+        http_consume(obj, lf ? n + 1 : n);
+        if(lf) break;
+    }
+    if(pos > 0 && buf[pos - 1] == '\r') --pos;
+    buf[pos] = 0;
+    return pos;
+}
+
+/* Receives a header line. Empty line marks the end of the header and makes
+   subsequent calls fail with EPIPE until the next message is started. */
+static ssize_t http_recvline(struct http_sock *obj, char *buf, size_t len,
+      int64_t deadline) {
+    if(dsock_slow(obj->rxhdrdone)) {errno = EPIPE; return -1;}
+    ssize_t sz = http_readline(obj, buf, len, deadline);
+    if(dsock_slow(sz < 0)) return -1;
+    if(sz == 0) {obj->rxhdrdone = 1; errno = EPIPE; return -1;}
+    return sz;
+}
+
+/* Sends a single line, appending the line terminator. */
+static int http_sendline(struct http_sock *obj, struct iolist *first,
+      struct iolist *last, int64_t deadline) {
+    struct iolist crlf = {(void*)"\r\n", 2, NULL, 0};
+    last->iol_next = &crlf;
+    int rc = bsendl(obj->s, first, &crlf, deadline);
+    last->iol_next = NULL;
+    if(dsock_slow(rc < 0)) obj->txerr = errno;
+    return rc;
+}
+
+/* Reserves a slot for a request about to be sent so that the response can
+   be matched to it. Must be done before anything is sent. */
+static int http_pushrequest(struct http_sock *obj, int head) {
+    if(dsock_slow(obj->pcount >= HTTP_MAXPIPELINE)) {
+        errno = ENOBUFS; return -1;}
+    obj->pipeline[(obj->pfirst + obj->pcount) % HTTP_MAXPIPELINE] = head;
+    obj->pcount++;
+    return 0;
+}
+
 int http_sendrequest(int s, const char *command, const char *resource,
       int64_t deadline) {
     struct http_sock *obj = hquery(s, http_type);
@@ -129,24 +327,43 @@ int http_sendrequest(int s, const char *command, const char *resource,
     iol[3].iol_len = 9;
     iol[3].iol_next = NULL;
     iol[3].iol_rsvd = 0;
-    return msendl(obj->s, &iol[0], &iol[3], deadline);
+    int rc = http_pushrequest(obj, strcmp(command, "HEAD") == 0);
+    if(dsock_slow(rc < 0)) return -1;
+    rc = http_sendline(obj, &iol[0], &iol[3], deadline);
+    if(dsock_slow(rc < 0)) {obj->pcount--; return -1;}
+    return 0;
+}
+
+/* Request line didn't fit into the receive buffer. The part that was
+   received is still there. Find out which element of the line overflowed. */
+static int http_requestoverflow(struct http_sock *obj) {
+    obj->rxbuf[sizeof(obj->rxbuf) - 1] = 0;
+    size_t pos = 0;
+    while(obj->rxbuf[pos] == ' ') ++pos;
+    while(obj->rxbuf[pos] != 0 && obj->rxbuf[pos] != ' ') ++pos;
+    if(obj->rxbuf[pos] == 0) return ENOTSUP;
+    while(obj->rxbuf[pos] == ' ') ++pos;
+    while(obj->rxbuf[pos] != 0 && obj->rxbuf[pos] != ' ') ++pos;
+    return obj->rxbuf[pos] == 0 ? EMSGSIZE : EPROTO;
 }
 
 int http_recvrequest(int s, char *command, size_t commandlen,
       char *resource, size_t resourcelen, int64_t deadline) {
     struct http_sock *obj = hquery(s, http_type);
     if(dsock_slow(!obj)) return -1;
-    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
-    ssize_t sz = mrecv(obj->s, obj->rxbuf, sizeof(obj->rxbuf) - 1, deadline);
+    int rc = http_startmessage(obj, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    ssize_t sz = http_recvline(obj, obj->rxbuf, sizeof(obj->rxbuf), deadline);
+    if(dsock_slow(sz < 0 && errno == EMSGSIZE)) {
+        errno = http_requestoverflow(obj); return -1;}
     if(dsock_slow(sz < 0)) return -1;
-    obj->rxbuf[sz] = 0;
     size_t pos = 0;
     while(obj->rxbuf[pos] == ' ') ++pos;
     /* Command. */
     size_t start = pos;
     while(obj->rxbuf[pos] != 0 && obj->rxbuf[pos] != ' ') ++pos;
     if(dsock_slow(obj->rxbuf[pos] == 0)) {errno = EPROTO; return -1;}
-    if(dsock_slow(pos - start > commandlen - 1)) {errno = EMSGSIZE; return -1;}
+    if(dsock_slow(pos - start > commandlen - 1)) {errno = ENOTSUP; return -1;}
     memcpy(command, obj->rxbuf + start, pos - start);
     command[pos - start] = 0;
     while(obj->rxbuf[pos] == ' ') ++pos;
@@ -193,16 +410,16 @@ int http_sendstatus(int s, int status, const char *reason, int64_t deadline) {
     iol[2].iol_len = strlen(reason);
     iol[2].iol_next = NULL;
     iol[2].iol_rsvd = 0;
-    return msendl(obj->s, &iol[0], &iol[2], deadline);
+    return http_sendline(obj, &iol[0], &iol[2], deadline);
 }
 
 int http_recvstatus(int s, char *reason, size_t reasonlen, int64_t deadline) {
     struct http_sock *obj = hquery(s, http_type);
     if(dsock_slow(!obj)) return -1;
-    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
-    ssize_t sz = mrecv(obj->s, obj->rxbuf, sizeof(obj->rxbuf) - 1, deadline);
+    int rc = http_startmessage(obj, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    ssize_t sz = http_recvline(obj, obj->rxbuf, sizeof(obj->rxbuf), deadline);
     if(dsock_slow(sz < 0)) return -1;
-    obj->rxbuf[sz] = 0;
     size_t pos = 0;
     while(obj->rxbuf[pos] == ' ') ++pos;
     /* Protocol. */
@@ -225,6 +442,19 @@ int http_recvstatus(int s, char *reason, size_t reasonlen, int64_t deadline) {
     int status = (obj->rxbuf[start] - '0') * 100 +
         (obj->rxbuf[start + 1] - '0') * 10 +
         (obj->rxbuf[start + 2] - '0');
+    /* Interim responses precede the final one for the same request. Final
+       response to HEAD request, as well as 1xx, 204 and 304 responses carry
+       no body whatever the fields say. */
+    if(status < 100 || status >= 200) {
+        if(obj->pcount > 0) {
+            if(obj->pipeline[obj->pfirst]) obj->rxnobody = 1;
+            obj->pfirst = (obj->pfirst + 1) % HTTP_MAXPIPELINE;
+            obj->pcount--;
+        }
+    }
+    if(status < 200 || status == 204 || status == 304) obj->rxnobody = 1;
+    obj->rxresp = 1;
+    if(!obj->rxnobody) obj->rxmode = HTTP_BODY_EOF;
     while(obj->rxbuf[pos] == ' ') ++pos;
     /* Reason. */
     if(sz - pos > reasonlen - 1) {errno = EMSGSIZE; return -1;}
@@ -233,14 +463,20 @@ int http_recvstatus(int s, char *reason, size_t reasonlen, int64_t deadline) {
     return status;
 }
 
-int http_sendfield(int s, const char *name, const char *value,
-      int64_t deadline) {
-    struct http_sock *obj = hquery(s, http_type);
-    if(dsock_slow(!obj)) return -1;
+static int http_checkfield(const char *name, const char *value) {
     /* TODO: Check whether name contains only valid characters! */
     if (strpbrk(name, "(),/:;<=>?@[\\]{}\" \t") != NULL) {
         errno = EPROTO; return -1;}
     if (strlen(value) == 0) {errno = EPROTO; return -1;}
+    return 0;
+}
+
+int http_sendfield(int s, const char *name, const char *value,
+      int64_t deadline) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    int rc = http_checkfield(name, value);
+    if(dsock_slow(rc < 0)) return -1;
     struct iolist iol[3];
     iol[0].iol_base = (void*)name;
     iol[0].iol_len = strlen(name);
@@ -257,44 +493,637 @@ int http_sendfield(int s, const char *name, const char *value,
     iol[2].iol_len = end - start;
     iol[2].iol_next = NULL;
     iol[2].iol_rsvd = 0;
-    return msendl(obj->s, &iol[0], &iol[2], deadline);
+    return http_sendline(obj, &iol[0], &iol[2], deadline);
 }
 
-int http_recvfield(int s, char *name, size_t namelen,
-      char *value, size_t valuelen, int64_t deadline) {
-    struct http_sock *obj = hquery(s, http_type);
-    if(dsock_slow(!obj)) return -1;
-    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
-    ssize_t sz = mrecv(obj->s, obj->rxbuf, sizeof(obj->rxbuf) - 1, deadline);
-    if(dsock_slow(sz < 0)) return -1;
-    obj->rxbuf[sz] = 0;
+/* Parses a field line in place. On success, name and value are
+   NUL-terminated and pointers to them are returned. */
+static int http_parsefield(char *line, size_t sz, char **name, size_t *namelen,
+      char **value, size_t *valuelen) {
+    line[sz] = 0;
     size_t pos = 0;
-    while(obj->rxbuf[pos] == ' ') ++pos;
+    while(line[pos] == ' ') ++pos;
     /* Name. */
     size_t start = pos;
-    while(obj->rxbuf[pos] != 0 &&
-          obj->rxbuf[pos] != ' ' &&
-          obj->rxbuf[pos] != ':')
-        ++pos;
-    if(dsock_slow(obj->rxbuf[pos] == 0)) {errno = EPROTO; return -1;}
-    if(dsock_slow(pos - start > namelen - 1)) {errno = EMSGSIZE; return -1;}
-    memcpy(name, obj->rxbuf + start, pos - start);
-    name[pos - start] = 0;
-    while(obj->rxbuf[pos] == ' ') ++pos;
-    if(dsock_slow(obj->rxbuf[pos] != ':')) {errno = EPROTO; return -1;}
+    while(line[pos] != 0 && line[pos] != ' ' && line[pos] != ':') ++pos;
+    if(dsock_slow(line[pos] == 0)) {errno = EPROTO; return -1;}
+    *name = line + start;
+    *namelen = pos - start;
+    while(line[pos] == ' ') ++pos;
+    if(dsock_slow(line[pos] != ':')) {errno = EPROTO; return -1;}
+    line[start + *namelen] = 0;
     ++pos;
-    while(obj->rxbuf[pos] == ' ') ++pos;
+    while(line[pos] == ' ') ++pos;
     /* Value. */
     start = pos;
-    pos = dsock_rstrip(obj->rxbuf + sz, ' ') - obj->rxbuf;
-    if(dsock_slow(pos - start > valuelen - 1)) {errno = EMSGSIZE; return -1;}
-    memcpy(value, obj->rxbuf + start, pos - start);
-    value[pos - start] = 0;
-    while(obj->rxbuf[pos] == ' ') ++pos;
-    if(dsock_slow(obj->rxbuf[pos] != 0)) {errno = EPROTO; return -1;}
+    pos = dsock_rstrip(line + start, ' ') - line;
+    *value = line + start;
+    *valuelen = pos - start;
+    line[pos] = 0;
+    return 0;
+}
+
+/* Case-insensitive FNV-1a. */
+static uint32_t http_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    size_t i;
+    for(i = 0; i != len; ++i) {
+        uint8_t c = name[i];
+        if(c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+/* Returns the id of a well-known field or -1 if the field is not
+   well-known. Length is checked first so that at most one string
+   comparison is done. */
+static int http_knownid(const char *name, size_t len) {
+    int id;
+    switch(len) {
+    case 4: id = DSOCK_HTTP_HOST; break;
+    case 14: id = DSOCK_HTTP_CONTENT_LENGTH; break;
+    case 10: id = DSOCK_HTTP_CONNECTION; break;
+    case 17: id = DSOCK_HTTP_TRANSFER_ENCODING; break;
+    default: return -1;
+    }
+    return strcasecmp(name, http_knownnames[id]) == 0 ? id : -1;
+}
+
+/* Updates body framing of the message being received based on a field.
+   Transfer encoding takes precedence over content length. */
+static int http_notefield(struct http_sock *obj, int id, const char *value,
+      size_t len) {
+    if(id == DSOCK_HTTP_CONNECTION) {
+        /* Look for "close" token in the comma-separated list. */
+        size_t i = 0;
+        while(i < len) {
+            while(i < len && (value[i] == ' ' || value[i] == ',')) ++i;
+            size_t start = i;
+            while(i < len && value[i] != ' ' && value[i] != ',') ++i;
+            if(i - start == 5 && strncasecmp(value + start, "close", 5) == 0)
+                obj->rxclose = 1;
+        }
+        return 0;
+    }
+    if(obj->rxnobody) return 0;
+    if(id == DSOCK_HTTP_TRANSFER_ENCODING) {
+        /* Only the last coding in the comma-separated list matters. */
+        size_t end = len;
+        while(end > 0 && (value[end - 1] == ' ' || value[end - 1] == ','))
+            --end;
+        size_t start = end;
+        while(start > 0 && value[start - 1] != ' ' && value[start - 1] != ',')
+            --start;
+        obj->rxte = 1;
+        if(end - start == 7 && strncasecmp(value + start, "chunked", 7) == 0) {
+            obj->rxmode = HTTP_BODY_CHUNKED;
+            obj->rxbody = 0;
+            return 0;
+        }
+        /* Length of a request body encoded otherwise can't be determined. */
+        if(dsock_slow(!obj->rxresp)) {errno = EPROTO; return -1;}
+        obj->rxmode = HTTP_BODY_EOF;
+        return 0;
+    }
+    if(id == DSOCK_HTTP_CONTENT_LENGTH) {
+        if(dsock_slow(len == 0)) {errno = EPROTO; return -1;}
+        uint64_t cl = 0;
+        size_t i;
+        for(i = 0; i != len; ++i) {
+            if(dsock_slow(value[i] < '0' || value[i] > '9' ||
+                  cl > (UINT64_MAX - 9) / 10)) {
+                errno = EPROTO; return -1;}
+            cl = cl * 10 + (value[i] - '0');
+        }
+        if(!obj->rxte) {
+            obj->rxmode = cl ? HTTP_BODY_LENGTH : HTTP_BODY_NONE;
+            obj->rxbody = cl;
+        }
+    }
+    return 0;
+}
+
+int http_recvfield(int s, char *name, size_t namelen,
+      char *value, size_t valuelen, int64_t deadline) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    ssize_t sz = http_recvline(obj, obj->rxbuf, sizeof(obj->rxbuf), deadline);
+    if(dsock_slow(sz < 0)) return -1;
+    char *n, *v;
+    size_t nlen, vlen;
+    int rc = http_parsefield(obj->rxbuf, sz, &n, &nlen, &v, &vlen);
+    if(dsock_slow(rc < 0)) return -1;
+    rc = http_notefield(obj, http_knownid(n, nlen), v, vlen);
+    if(dsock_slow(rc < 0)) return -1;
+    if(dsock_slow(nlen > namelen - 1)) {errno = EMSGSIZE; return -1;}
+    memcpy(name, n, nlen + 1);
+    if(dsock_slow(vlen > valuelen - 1)) {errno = EMSGSIZE; return -1;}
+    memcpy(value, v, vlen + 1);
     return 0;
 }
 
+int http_recvfields(int s, int64_t deadline) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    obj->nfields = 0;
+    memset(obj->slots, 0, sizeof(obj->slots));
+    memset(obj->known, 0, sizeof(obj->known));
+    size_t pos = 0;
+    while(1) {
+        /* Fields are received directly into the header buffer and parsed
+           in place. */
+        ssize_t sz = http_recvline(obj, obj->hdrbuf + pos,
+            obj->hdrmax - pos, deadline);
+        /* Empty line terminates the header. */
+        if(sz < 0 && errno == EPIPE && obj->rxhdrdone) break;
+        if(dsock_slow(sz < 0)) return -1;
+        if(dsock_slow(obj->nfields >= HTTP_MAXFIELDS)) {
+            errno = EMSGSIZE; return -1;}
+        char *name, *value;
+        size_t namelen, valuelen;
+        int rc = http_parsefield(obj->hdrbuf + pos, sz, &name, &namelen,
+            &value, &valuelen);
+        if(dsock_slow(rc < 0)) return -1;
+        struct http_field *fld = &obj->fields[obj->nfields];
+        fld->hash = http_hash(name, namelen);
+        fld->name = name - obj->hdrbuf;
+        fld->value = value - obj->hdrbuf;
+        /* Add the field to the hash index. For duplicate names the first
+           field wins on lookup as it sits earlier in the probe sequence. */
+        size_t slot = fld->hash & (HTTP_HASHSLOTS - 1);
+        while(obj->slots[slot]) slot = (slot + 1) & (HTTP_HASHSLOTS - 1);
+        obj->slots[slot] = obj->nfields + 1;
+        int id = http_knownid(name, namelen);
+        if(id >= 0 && !obj->known[id]) obj->known[id] = obj->nfields + 1;
+        rc = http_notefield(obj, id, value, valuelen);
+        if(dsock_slow(rc < 0)) return -1;
+        obj->nfields++;
+        pos += sz + 1;
+    }
+    return obj->nfields;
+}
+
+const char *http_field(int s, const char *name) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return NULL;
+    uint32_t hash = http_hash(name, strlen(name));
+    size_t slot = hash & (HTTP_HASHSLOTS - 1);
+    while(obj->slots[slot]) {
+        struct http_field *fld = &obj->fields[obj->slots[slot] - 1];
+        if(fld->hash == hash &&
+              strcasecmp(obj->hdrbuf + fld->name, name) == 0)
+            return obj->hdrbuf + fld->value;
+        slot = (slot + 1) & (HTTP_HASHSLOTS - 1);
+    }
+    errno = ENOENT;
+    return NULL;
+}
+
+const char *http_knownfield(int s, int id) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return NULL;
+    if(dsock_slow(id < 0 || id >= DSOCK_HTTP_NKNOWN)) {
+        errno = EINVAL; return NULL;}
+    if(!obj->known[id]) {errno = ENOENT; return NULL;}
+    return obj->hdrbuf + obj->fields[obj->known[id] - 1].value;
+}
+
+int http_fieldat(int s, size_t idx, const char **name, const char **value) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(idx >= obj->nfields)) {errno = ENOENT; return -1;}
+    if(name) *name = obj->hdrbuf + obj->fields[idx].name;
+    if(value) *value = obj->hdrbuf + obj->fields[idx].value;
+    return 0;
+}
+
+/* Appends a NULL-terminated list of strings followed by CRLF to the header
+   being built. Either all of it is appended or nothing is. */
+static int http_append(char *buf, size_t bufsz, size_t *buflen, ...) {
+    va_list ap;
+    size_t len = 2;
+    const char *str;
+    va_start(ap, buflen);
+    while((str = va_arg(ap, const char*))) len += strlen(str);
+    va_end(ap);
+    if(dsock_slow(*buflen + len > bufsz)) {errno = EMSGSIZE; return -1;}
+    va_start(ap, buflen);
+    while((str = va_arg(ap, const char*))) {
+        size_t sz = strlen(str);
+        memcpy(buf + *buflen, str, sz);
+        *buflen += sz;
+    }
+    va_end(ap);
+    memcpy(buf + *buflen, "\r\n", 2);
+    *buflen += 2;
+    return 0;
+}
+
+static int http_appendstatus(char *buf, size_t bufsz, size_t *buflen,
+      int status, const char *reason) {
+    if(dsock_slow(status < 100 || status > 599)) {errno = EINVAL; return -1;}
+    char code[5];
+    code[0] = (status / 100) + '0';
+    status %= 100;
+    code[1] = (status / 10) + '0';
+    status %= 10;
+    code[2] = status + '0';
+    code[3] = ' ';
+    code[4] = 0;
+    return http_append(buf, bufsz, buflen, "HTTP/1.1 ", code, reason, NULL);
+}
+
+static int http_appendfield(char *buf, size_t bufsz, size_t *buflen,
+      const char *name, const char *value) {
+    int rc = http_checkfield(name, value);
+    if(dsock_slow(rc < 0)) return -1;
+    const char *start = dsock_lstrip(value, ' ');
+    const char *end = dsock_rstrip(start, ' ');
+    dsock_assert(start < end);
+    /* Value is not NUL-terminated at 'end' so http_append() can't be used. */
+    size_t vlen = end - start;
+    size_t nlen = strlen(name);
+    if(dsock_slow(*buflen + nlen + 2 + vlen + 2 > bufsz)) {
+        errno = EMSGSIZE; return -1;}
+    memcpy(buf + *buflen, name, nlen);
+    *buflen += nlen;
+    memcpy(buf + *buflen, ": ", 2);
+    *buflen += 2;
+    memcpy(buf + *buflen, start, vlen);
+    *buflen += vlen;
+    memcpy(buf + *buflen, "\r\n", 2);
+    *buflen += 2;
+    return 0;
+}
+
+int http_startrequest(int s, const char *command, const char *resource) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    obj->txlen = 0;
+    obj->txreq = 1;
+    obj->txhead = strcmp(command, "HEAD") == 0;
+    return http_append(obj->txbuf, sizeof(obj->txbuf), &obj->txlen,
+        command, " ", resource, " HTTP/1.1", NULL);
+}
+
+int http_startstatus(int s, int status, const char *reason) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    obj->txlen = 0;
+    obj->txreq = 0;
+    return http_appendstatus(obj->txbuf, sizeof(obj->txbuf), &obj->txlen,
+        status, reason);
+}
+
+int http_addfield(int s, const char *name, const char *value) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    /* Start line must be added first. */
+    if(dsock_slow(obj->txlen == 0)) {errno = EINVAL; return -1;}
+    return http_appendfield(obj->txbuf, sizeof(obj->txbuf), &obj->txlen,
+        name, value);
+}
+
+/* Date field is formatted at most once a second. The cache is per thread
+   so that threads running their own schedulers don't race on it. */
+static __thread time_t http_datetime = -1;
+static __thread char http_datebuf[40];
+static __thread size_t http_datelen = 0;
+
+static void http_updatedate(void) {
+    static const char *days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri",
+        "Sat"};
+    static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    time_t t = time(NULL);
+    if(dsock_fast(t == http_datetime)) return;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    /* IMF-fixdate, e.g. "Date: Sun, 06 Nov 1994 08:49:37 GMT". */
+    int sz = snprintf(http_datebuf, sizeof(http_datebuf),
+        "Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n", days[tm.tm_wday],
+        tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour,
+        tm.tm_min, tm.tm_sec);
+    dsock_assert(sz > 0 && sz < sizeof(http_datebuf));
+    http_datelen = sz;
+    http_datetime = t;
+}
+
+int http_adddate(int s) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(obj->txlen == 0)) {errno = EINVAL; return -1;}
+    http_updatedate();
+    if(dsock_slow(obj->txlen + http_datelen > sizeof(obj->txbuf))) {
+        errno = EMSGSIZE; return -1;}
+    memcpy(obj->txbuf + obj->txlen, http_datebuf, http_datelen);
+    obj->txlen += http_datelen;
+    return 0;
+}
+
+/******************************************************************************/
+/*  Header templates                                                          */
+/******************************************************************************/
+
+dsock_unique_id(http_template_type);
+
+struct http_template {
+    struct hvfs hvfs;
+    size_t len;
+    char buf[4096];
+};
+
+static void *http_template_hquery(struct hvfs *hvfs, const void *type) {
+    struct http_template *obj = (struct http_template*)hvfs;
+    if(type == http_template_type) return obj;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+static void http_template_hclose(struct hvfs *hvfs) {
+    free(hvfs);
+}
+
+int http_mktemplate(int status, const char *reason) {
+    int err;
+    struct http_template *obj = malloc(sizeof(struct http_template));
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
+    obj->hvfs.query = http_template_hquery;
+    obj->hvfs.close = http_template_hclose;
+    obj->hvfs.done = NULL;
+    obj->len = 0;
+    int rc = http_appendstatus(obj->buf, sizeof(obj->buf), &obj->len,
+        status, reason);
+    if(dsock_slow(rc < 0)) {err = errno; goto error2;}
+    int h = hmake(&obj->hvfs);
+    if(dsock_slow(h < 0)) {err = errno; goto error2;}
+    return h;
+error2:
+    free(obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+int http_templatefield(int t, const char *name, const char *value) {
+    struct http_template *obj = hquery(t, http_template_type);
+    if(dsock_slow(!obj)) return -1;
+    return http_appendfield(obj->buf, sizeof(obj->buf), &obj->len,
+        name, value);
+}
+
+int http_starttemplate(int s, int t) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    struct http_template *tmpl = hquery(t, http_template_type);
+    if(dsock_slow(!tmpl)) return -1;
+    /* Template can't be bigger than the transmit buffer. */
+    memcpy(obj->txbuf, tmpl->buf, tmpl->len);
+    obj->txlen = tmpl->len;
+    obj->txreq = 0;
+    return 0;
+}
+
+int http_sendheader(int s, struct iolist *first, struct iolist *last,
+      int64_t deadline) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(obj->txlen == 0)) {errno = EINVAL; return -1;}
+    if(dsock_slow(!first != !last)) {errno = EINVAL; return -1;}
+    if(dsock_slow(obj->txlen + 2 > sizeof(obj->txbuf))) {
+        errno = EMSGSIZE; return -1;}
+    int rc;
+    if(obj->txreq) {
+        rc = http_pushrequest(obj, obj->txhead);
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    /* Terminate the header with an empty line. */
+    memcpy(obj->txbuf + obj->txlen, "\r\n", 2);
+    obj->txlen += 2;
+    /* Header and the body go out in a single write. */
+    struct iolist hdr = {obj->txbuf, obj->txlen, first, 0};
+    obj->txlen = 0;
+    rc = bsendl(obj->s, &hdr, last ? last : &hdr, deadline);
+    if(dsock_slow(rc < 0)) {
+        if(obj->txreq) obj->pcount--;
+        obj->txerr = errno;
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads chunk header. Zero-sized chunk terminates the body. In such case
+   the trailer is read and discarded. */
+static int http_readchunkhdr(struct http_sock *obj, int64_t deadline) {
+    ssize_t sz = http_readline(obj, obj->rxbuf, sizeof(obj->rxbuf), deadline);
+    if(dsock_slow(sz < 0)) return -1;
+    uint64_t csz = 0;
+    ssize_t i;
+    for(i = 0; i != sz; ++i) {
+        char c = obj->rxbuf[i];
+        int d;
+        if(c >= '0' && c <= '9') d = c - '0';
+        else if(c >= 'a' && c <= 'f') d = c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F') d = c - 'A' + 10;
+        else break;
+        if(dsock_slow(csz >> 60)) {errno = obj->rxerr = EPROTO; return -1;}
+        csz = (csz << 4) | d;
+    }
+    /* Chunk extensions, if any, are ignored. */
+    if(dsock_slow(i == 0 || (i < sz && obj->rxbuf[i] != ';' &&
+          obj->rxbuf[i] != ' '))) {
+        errno = obj->rxerr = EPROTO; return -1;}
+    if(csz > 0) {
+        obj->rxbody = csz;
+        return 0;
+    }
+    while(1) {
+        sz = http_readline(obj, obj->rxbuf, sizeof(obj->rxbuf), deadline);
+        if(dsock_slow(sz < 0)) {obj->rxerr = errno; return -1;}
+        if(sz == 0) break;
+    }
+    obj->rxmode = HTTP_BODY_NONE;
+    return 0;
+}
+
+/* Receives next piece of the body directly into the supplied iolist.
+   Returns 0 once the whole body was received. */
+static ssize_t http_readbody(struct http_sock *obj, struct iolist *first,
+      struct iolist *last, int64_t deadline) {
+    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
+    size_t len;
+    int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) return -1;
+    if(obj->rxmode == HTTP_BODY_CHUNKED && obj->rxbody == 0) {
+        rc = http_readchunkhdr(obj, deadline);
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    if(obj->rxmode == HTTP_BODY_NONE) return 0;
+    if(dsock_slow(len == 0)) {errno = EINVAL; return -1;}
+    if(obj->rxmode == HTTP_BODY_EOF) {
+        /* Bytestream doesn't say how much was received before the peer
+           closed the connection so the body is copied from whatever data
+           are available at the moment. */
+        size_t pos = 0;
+        size_t off = 0;
+        struct iolist *it = first;
+        while(pos != len) {
+            size_t avail;
+            const char *data = http_peek(obj, &avail, deadline);
+            if(dsock_slow(!data)) {
+                if(errno != EPIPE) {obj->rxerr = errno; return -1;}
+                /* Connection is closed and can't be reused. */
+                obj->rxmode = HTTP_BODY_NONE;
+                obj->rxclose = 1;
+                return pos;
+            }
+            size_t n = MIN(avail, len - pos);
+            size_t left = n;
+            while(left) {
+                while(off == it->iol_len) {off = 0; it = it->iol_next;}
+                size_t sz = MIN(it->iol_len - off, left);
+                if(it->iol_base)
+                    memcpy((char*)it->iol_base + off, data + (n - left), sz);
+                off += sz;
+                left -= sz;
+            }
+            http_consume(obj, n);
+            pos += n;
+        }
+        return len;
+    }
+    size_t sz = obj->rxbody < len ? obj->rxbody : len;
+    struct iol_slice slc;
+    iol_slice_init(&slc, first, last, 0, sz);
+    rc = brecvl(obj->s, &slc.first, slc.last, deadline);
+    iol_slice_term(&slc);
+    if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
+    obj->rxbody -= sz;
+    if(obj->rxbody > 0) return sz;
+    if(obj->rxmode == HTTP_BODY_LENGTH) {
+        obj->rxmode = HTTP_BODY_NONE;
+        return sz;
+    }
+    /* Chunk data are followed by CRLF. */
+    ssize_t n = http_readline(obj, obj->rxbuf, sizeof(obj->rxbuf), deadline);
+    if(dsock_slow(n < 0)) {obj->rxerr = errno; return -1;}
+    if(dsock_slow(n != 0)) {errno = obj->rxerr = EPROTO; return -1;}
+    return sz;
+}
+
+/* Skips whatever is left of the previous message and prepares the socket
+   for receiving a new one. This allows the connection to be reused even if
+   the user is not interested in the entire message. */
+static int http_startmessage(struct http_sock *obj, int64_t deadline) {
+    if(obj->rxstarted) {
+        while(1) {
+            ssize_t sz = http_recvline(obj, obj->rxbuf, sizeof(obj->rxbuf),
+                deadline);
+            if(sz < 0 && errno == EPIPE && obj->rxhdrdone) break;
+            if(dsock_slow(sz < 0)) return -1;
+            char *n, *v;
+            size_t nlen, vlen;
+            int rc = http_parsefield(obj->rxbuf, sz, &n, &nlen, &v, &vlen);
+            if(dsock_slow(rc < 0)) return -1;
+            rc = http_notefield(obj, http_knownid(n, nlen), v, vlen);
+            if(dsock_slow(rc < 0)) return -1;
+        }
+        while(obj->rxmode != HTTP_BODY_NONE) {
+            struct iolist iol = {NULL, 65536, NULL, 0};
+            ssize_t sz = http_readbody(obj, &iol, &iol, deadline);
+            if(dsock_slow(sz < 0)) return -1;
+        }
+    }
+    obj->rxstarted = 1;
+    obj->rxhdrdone = 0;
+    obj->rxmode = HTTP_BODY_NONE;
+    obj->rxbody = 0;
+    obj->rxresp = 0;
+    obj->rxte = 0;
+    obj->rxnobody = 0;
+    return 0;
+}
+
+ssize_t http_recvbody(int s, struct iolist *first, struct iolist *last,
+      int64_t deadline) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    /* Header has to be fully received first. */
+    if(dsock_slow(!obj->rxhdrdone)) {errno = EINVAL; return -1;}
+    return http_readbody(obj, first, last, deadline);
+}
+
+int http_sendbody(int s, struct iolist *first, struct iolist *last,
+      int64_t deadline) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    int rc = bsendl(obj->s, first, last, deadline);
+    if(dsock_slow(rc < 0)) obj->txerr = errno;
+    return rc;
+}
+
+int http_sendchunk(int s, struct iolist *first, struct iolist *last,
+      int64_t deadline) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    size_t len = 0;
+    if(first || last) {
+        int rc = iol_check(first, last, NULL, &len);
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    /* Empty chunk terminates the body. No trailer is sent. */
+    if(len == 0) {
+        int rc = bsend(obj->s, "0\r\n\r\n", 5, deadline);
+        if(dsock_slow(rc < 0)) obj->txerr = errno;
+        return rc;
+    }
+    char buf[18];
+    size_t pos = sizeof(buf) - 2;
+    buf[pos] = '\r';
+    buf[pos + 1] = '\n';
+    do {
+        buf[--pos] = "0123456789abcdef"[len & 0xf];
+        len >>= 4;
+    } while(len);
+    /* Chunk header, data and the trailing CRLF are sent in a single write. */
+    struct iolist hdr = {buf + pos, sizeof(buf) - pos, first, 0};
+    struct iolist crlf = {(void*)"\r\n", 2, NULL, 0};
+    last->iol_next = &crlf;
+    int rc = bsendl(obj->s, &hdr, &crlf, deadline);
+    last->iol_next = NULL;
+    if(dsock_slow(rc < 0)) obj->txerr = errno;
+    return rc;
+}
+
+int http_setmaxheader(int s, size_t len) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(len == 0 || len > sizeof(obj->hdrbuf))) {
+        errno = EINVAL; return -1;}
+    obj->hdrmax = len;
+    return 0;
+}
+
+int http_pending(int s) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    return (int)obj->pcount;
+}
+
+int http_reusable(int s) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    /* Connection is in an undefined state after a failure. */
+    if(obj->rxerr || obj->txerr || obj->rxclose) return 0;
+    /* Partially built header or outstanding requests. */
+    if(obj->txlen || obj->pcount) return 0;
+    /* Unread body of the last response would have to be skipped. */
+    if(obj->rxstarted && (!obj->rxhdrdone || obj->rxmode != HTTP_BODY_NONE))
+        return 0;
+    return 1;
+}
+
 static void http_hclose(struct hvfs *hvfs) {
     struct http_sock *obj = (struct http_sock*)hvfs;
     if(dsock_fast(obj->s >= 0)) {
@@ -0,0 +1,351 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <libdillimpl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "dsock.h"
+#include "utils.h"
+
+dsock_unique_id(httppool_type);
+
+/* Hosts are checked for stale connections at most this often, in
+   milliseconds, even if the idle period is shorter. */
+#define HTTPPOOL_SWEEP 10
+
+static void *httppool_hquery(struct hvfs *hvfs, const void *type);
+static void httppool_hclose(struct hvfs *hvfs);
+
+struct httppool_host;
+
+struct httppool_conn {
+    int s;
+    /* Time when the connection was returned to the pool. */
+    int64_t last;
+    struct httppool_host *host;
+    struct httppool_conn *next;
+};
+
+struct httppool_host {
+    char *name;
+    int port;
+    /* Number of open connections to the host, whether idle or in use. */
+    size_t nconns;
+    /* Idle connections, the most recently used one first. */
+    struct httppool_conn *idle;
+    /* Coroutines waiting for a connection to the host. Returned connections
+       are passed to them via the channel. NULL passed via the channel means
+       that the waiter may open a new connection instead. */
+    int ch[2];
+    size_t waiters;
+    /* Number of coroutines blocked in httppool_get() on this host. If the
+       pool is closed meanwhile, the host is marked as closed and the last
+       of them deallocates it. */
+    size_t refs;
+    int closed;
+    struct httppool_host *next;
+};
+
+struct httppool {
+    struct hvfs hvfs;
+    size_t maxperhost;
+    int64_t idle;
+    /* Time of the next check of all the hosts for stale connections. */
+    int64_t nextsweep;
+    struct httppool_host *hosts;
+    /* Connections handed out to the user. */
+    struct httppool_conn *busy;
+};
+
+static void *httppool_hquery(struct hvfs *hvfs, const void *type) {
+    struct httppool *obj = (struct httppool*)hvfs;
+    if(type == httppool_type) return obj;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+int httppool_make(size_t maxperhost, int64_t idle) {
+    int err;
+    if(dsock_slow(maxperhost == 0)) {err = EINVAL; goto error1;}
+    /* Create the object. */
+    struct httppool *obj = malloc(sizeof(struct httppool));
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
+    obj->hvfs.query = httppool_hquery;
+    obj->hvfs.close = httppool_hclose;
+    obj->hvfs.done = NULL; /* hdone() is not supported for pools. */
+    obj->maxperhost = maxperhost;
+    obj->idle = idle;
+    obj->nextsweep = now();
+    obj->hosts = NULL;
+    obj->busy = NULL;
+    /* Create the handle. */
+    int h = hmake(&obj->hvfs);
+    if(dsock_slow(h < 0)) {err = errno; goto error2;}
+    return h;
+error2:
+    free(obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+static struct httppool_host *httppool_host(struct httppool *obj,
+      const char *name, int port) {
+    struct httppool_host *host;
+    for(host = obj->hosts; host; host = host->next)
+        if(host->port == port && strcasecmp(host->name, name) == 0)
+            return host;
+    int err;
+    host = malloc(sizeof(struct httppool_host));
+    if(dsock_slow(!host)) {err = ENOMEM; goto error1;}
+    host->name = strdup(name);
+    if(dsock_slow(!host->name)) {err = ENOMEM; goto error2;}
+    int rc = chmake(host->ch);
+    if(dsock_slow(rc < 0)) {err = errno; goto error3;}
+    host->port = port;
+    host->nconns = 0;
+    host->idle = NULL;
+    host->waiters = 0;
+    host->refs = 0;
+    host->closed = 0;
+    host->next = obj->hosts;
+    obj->hosts = host;
+    return host;
+error3:
+    free(host->name);
+error2:
+    free(host);
+error1:
+    errno = err;
+    return NULL;
+}
+
+/* Closes idle connections to the host that were returned to the pool
+   before 'before'. */
+static void httppool_expire(struct httppool_host *host, int64_t before) {
+    /* The most recently used connections come first so the stale ones form
+       the tail of the list. */
+    struct httppool_conn **c = &host->idle;
+    while(*c && (*c)->last >= before) c = &(*c)->next;
+    while(*c) {
+        struct httppool_conn *conn = *c;
+        *c = conn->next;
+        int rc = hclose(conn->s);
+        dsock_assert(rc == 0);
+        free(conn);
+        host->nconns--;
+    }
+}
+
+static void httppool_freehost(struct httppool_host *host) {
+    dsock_assert(host->refs == 0);
+    httppool_expire(host, INT64_MAX);
+    int rc = hclose(host->ch[0]);
+    dsock_assert(rc == 0);
+    rc = hclose(host->ch[1]);
+    dsock_assert(rc == 0);
+    free(host->name);
+    free(host);
+}
+
+/* Closes connections to the host that have been idle for too long. Other
+   hosts are checked at most once per idle period, so the cost of a single
+   operation doesn't grow with the number of hosts. At that point hosts with
+   no connections that nobody waits for are forgotten, except for 'host'
+   itself. */
+static void httppool_prune(struct httppool *obj, struct httppool_host *host) {
+    int64_t nw = now();
+    if(obj->idle >= 0) httppool_expire(host, nw - obj->idle);
+    if(dsock_fast(nw < obj->nextsweep)) return;
+    obj->nextsweep = nw + MAX(obj->idle, HTTPPOOL_SWEEP);
+    struct httppool_host **it = &obj->hosts;
+    while(*it) {
+        struct httppool_host *h = *it;
+        if(obj->idle >= 0) httppool_expire(h, nw - obj->idle);
+        if(h != host && h->nconns == 0 && h->refs == 0) {
+            *it = h->next;
+            httppool_freehost(h);
+            continue;
+        }
+        it = &h->next;
+    }
+}
+
+/* Opens a new connection to the host. The slot in host->nconns must be
+   already reserved by the caller. */
+static struct httppool_conn *httppool_connect(struct httppool_host *host,
+      int64_t deadline) {
+    int err;
+    struct httppool_conn *conn = malloc(sizeof(struct httppool_conn));
+    if(dsock_slow(!conn)) {err = ENOMEM; goto error1;}
+    struct ipaddr addr;
+    int rc = ipaddr_remote(&addr, host->name, host->port, 0, deadline);
+    if(dsock_slow(rc < 0)) {err = errno; goto error2;}
+    int s = tcp_connect(&addr, deadline);
+    if(dsock_slow(s < 0)) {err = errno; goto error2;}
+    conn->s = http_attach(s);
+    if(dsock_slow(conn->s < 0)) {err = errno; goto error3;}
+    conn->host = host;
+    return conn;
+error3:
+    rc = hclose(s);
+    dsock_assert(rc == 0);
+error2:
+    free(conn);
+error1:
+    errno = err;
+    return NULL;
+}
+
+/* Gives up a connection slot. If there's a coroutine waiting for
+   a connection it inherits the slot. */
+static void httppool_release(struct httppool_host *host) {
+    if(host->waiters > 0) {
+        struct httppool_conn *conn = NULL;
+        int rc = chsend(host->ch[0], &conn, sizeof(conn), 0);
+        if(dsock_fast(rc == 0)) return;
+    }
+    host->nconns--;
+}
+
+/* Waits for a free slot or a connection returned to the pool, and opens
+   a new connection if needed. The host is referenced meanwhile, and if the
+   pool is closed in the meantime, the function fails with ECANCELED. */
+static struct httppool_conn *httppool_wait(struct httppool_host *h,
+      size_t maxperhost, int64_t deadline) {
+    int err;
+    struct httppool_conn *conn = NULL;
+    h->refs++;
+    if(h->nconns < maxperhost) {
+        h->nconns++;
+    }
+    else {
+        /* Wait till a connection is returned to the pool. */
+        h->waiters++;
+        int rc = chrecv(h->ch[1], &conn, sizeof(conn), deadline);
+        h->waiters--;
+        if(dsock_slow(rc < 0)) {
+            err = h->closed ? ECANCELED : errno;
+            goto error1;
+        }
+    }
+    if(!conn && dsock_fast(!h->closed)) {
+        conn = httppool_connect(h, deadline);
+        if(dsock_slow(!conn)) {err = errno; goto error2;}
+    }
+    if(dsock_slow(h->closed)) {err = ECANCELED; goto error3;}
+    h->refs--;
+    return conn;
+error3:
+    if(conn) {
+        int rc = hclose(conn->s);
+        dsock_assert(rc == 0);
+        free(conn);
+    }
+error2:
+    if(!h->closed) httppool_release(h);
+error1:
+    h->refs--;
+    if(dsock_slow(h->closed && h->refs == 0)) httppool_freehost(h);
+    errno = err;
+    return NULL;
+}
+
+int httppool_get(int p, const char *host, int port, int64_t deadline) {
+    struct httppool *obj = hquery(p, httppool_type);
+    if(dsock_slow(!obj)) return -1;
+    struct httppool_host *h = httppool_host(obj, host, port);
+    if(dsock_slow(!h)) return -1;
+    httppool_prune(obj, h);
+    /* Try the idle connections first. */
+    struct httppool_conn *conn = h->idle;
+    if(conn) h->idle = conn->next;
+    else {
+        /* The pool may be closed while waiting. Don't touch 'obj' unless
+           the wait succeeds. */
+        conn = httppool_wait(h, obj->maxperhost, deadline);
+        if(dsock_slow(!conn)) return -1;
+    }
+    conn->next = obj->busy;
+    obj->busy = conn;
+    return conn->s;
+}
+
+int httppool_put(int p, int s) {
+    struct httppool *obj = hquery(p, httppool_type);
+    if(dsock_slow(!obj)) return -1;
+    struct httppool_conn **it = &obj->busy;
+    while(*it && (*it)->s != s) it = &(*it)->next;
+    if(dsock_slow(!*it)) {errno = EINVAL; return -1;}
+    struct httppool_conn *conn = *it;
+    *it = conn->next;
+    struct httppool_host *h = conn->host;
+    if(http_reusable(s) != 1) {
+        int rc = hclose(s);
+        dsock_assert(rc == 0);
+        free(conn);
+        httppool_release(h);
+        httppool_prune(obj, h);
+        return 0;
+    }
+    /* Hand the connection directly to a waiter, if any. */
+    if(h->waiters > 0) {
+        int rc = chsend(h->ch[0], &conn, sizeof(conn), 0);
+        if(dsock_fast(rc == 0)) return 0;
+    }
+    conn->last = now();
+    conn->next = h->idle;
+    h->idle = conn;
+    httppool_prune(obj, h);
+    return 0;
+}
+
+static void httppool_hclose(struct hvfs *hvfs) {
+    struct httppool *obj = (struct httppool*)hvfs;
+    /* Connections in use are owned by the user. Only forget about them. */
+    while(obj->busy) {
+        struct httppool_conn *conn = obj->busy;
+        obj->busy = conn->next;
+        free(conn);
+    }
+    while(obj->hosts) {
+        struct httppool_host *h = obj->hosts;
+        obj->hosts = h->next;
+        if(dsock_slow(h->refs > 0)) {
+            /* Coroutines blocked in httppool_get() still use the host. Wake
+               them up. The last one to leave deallocates the host. */
+            h->closed = 1;
+            httppool_expire(h, INT64_MAX);
+            int rc = hdone(h->ch[0], -1);
+            dsock_assert(rc == 0);
+            continue;
+        }
+        httppool_freehost(h);
+    }
+    free(obj);
+}
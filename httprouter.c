@@ -0,0 +1,357 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <libdillimpl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsock.h"
+#include "utils.h"
+
+dsock_unique_id(httprouter_type);
+
+static void *httprouter_hquery(struct hvfs *hvfs, const void *type);
+static void httprouter_hclose(struct hvfs *hvfs);
+
+struct httprouter_handler {
+    /* NULL matches any method. */
+    char *method;
+    void *data;
+    struct httprouter_handler *next;
+};
+
+/* Node of the radix trie. Literal part of the pattern is stored in the
+   edges leading to the node. Parameters and wildcards are stored as special
+   children so that literal matches can be tried first. */
+struct httprouter_node {
+    char *prefix;
+    size_t prefixlen;
+    /* Literal children. No two of them start with the same character. */
+    struct httprouter_node *children;
+    struct httprouter_node *next;
+    /* ":name" matches a single non-empty path segment. */
+    struct httprouter_node *param;
+    char *paramname;
+    /* "*name" matches the rest of the path. */
+    struct httprouter_node *wildcard;
+    char *wildcardname;
+    struct httprouter_handler *handlers;
+};
+
+struct httprouter {
+    struct hvfs hvfs;
+    struct httprouter_node root;
+};
+
+static void *httprouter_hquery(struct hvfs *hvfs, const void *type) {
+    struct httprouter *obj = (struct httprouter*)hvfs;
+    if(type == httprouter_type) return obj;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+static void httprouter_initnode(struct httprouter_node *node) {
+    node->prefix = NULL;
+    node->prefixlen = 0;
+    node->children = NULL;
+    node->next = NULL;
+    node->param = NULL;
+    node->paramname = NULL;
+    node->wildcard = NULL;
+    node->wildcardname = NULL;
+    node->handlers = NULL;
+}
+
+static struct httprouter_node *httprouter_mknode(const char *prefix,
+      size_t prefixlen) {
+    struct httprouter_node *node = malloc(sizeof(struct httprouter_node));
+    if(dsock_slow(!node)) {errno = ENOMEM; return NULL;}
+    httprouter_initnode(node);
+    if(prefixlen) {
+        node->prefix = malloc(prefixlen);
+        if(dsock_slow(!node->prefix)) {free(node); errno = ENOMEM; return NULL;}
+        memcpy(node->prefix, prefix, prefixlen);
+        node->prefixlen = prefixlen;
+    }
+    return node;
+}
+
+static void httprouter_termnode(struct httprouter_node *node) {
+    while(node->children) {
+        struct httprouter_node *child = node->children;
+        node->children = child->next;
+        httprouter_termnode(child);
+        free(child);
+    }
+    if(node->param) {
+        httprouter_termnode(node->param);
+        free(node->param);
+    }
+    if(node->wildcard) {
+        httprouter_termnode(node->wildcard);
+        free(node->wildcard);
+    }
+    while(node->handlers) {
+        struct httprouter_handler *h = node->handlers;
+        node->handlers = h->next;
+        free(h->method);
+        free(h);
+    }
+    free(node->prefix);
+    free(node->paramname);
+    free(node->wildcardname);
+}
+
+int httprouter_make(void) {
+    int err;
+    struct httprouter *obj = malloc(sizeof(struct httprouter));
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
+    obj->hvfs.query = httprouter_hquery;
+    obj->hvfs.close = httprouter_hclose;
+    obj->hvfs.done = NULL; /* hdone() is not supported for routers. */
+    httprouter_initnode(&obj->root);
+    int h = hmake(&obj->hvfs);
+    if(dsock_slow(h < 0)) {err = errno; goto error2;}
+    return h;
+error2:
+    free(obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+/* Walks the literal part of the pattern down the trie, splitting the edges
+   and creating new nodes as needed. */
+static struct httprouter_node *httprouter_addliteral(
+      struct httprouter_node *node, const char *str, size_t len) {
+    while(len) {
+        struct httprouter_node *child = node->children;
+        while(child && child->prefix[0] != str[0]) child = child->next;
+        if(!child) {
+            child = httprouter_mknode(str, len);
+            if(dsock_slow(!child)) return NULL;
+            child->next = node->children;
+            node->children = child;
+            return child;
+        }
+        size_t common = 1;
+        while(common < len && common < child->prefixlen &&
+              str[common] == child->prefix[common])
+            ++common;
+        if(common < child->prefixlen) {
+            /* Split the edge. The tail takes over all the descendants. */
+            struct httprouter_node *tail = httprouter_mknode(
+                child->prefix + common, child->prefixlen - common);
+            if(dsock_slow(!tail)) return NULL;
+            tail->children = child->children;
+            tail->param = child->param;
+            tail->paramname = child->paramname;
+            tail->wildcard = child->wildcard;
+            tail->wildcardname = child->wildcardname;
+            tail->handlers = child->handlers;
+            child->prefixlen = common;
+            child->children = tail;
+            child->param = NULL;
+            child->paramname = NULL;
+            child->wildcard = NULL;
+            child->wildcardname = NULL;
+            child->handlers = NULL;
+        }
+        node = child;
+        str += common;
+        len -= common;
+    }
+    return node;
+}
+
+/* Returns the special child for parameter or wildcard. All patterns must
+   use the same name at the same position. */
+static struct httprouter_node *httprouter_addspecial(
+      struct httprouter_node **child, char **childname,
+      const char *name, size_t namelen) {
+    if(*child) {
+        if(dsock_slow(strlen(*childname) != namelen ||
+              memcmp(*childname, name, namelen) != 0)) {
+            errno = EINVAL; return NULL;}
+        return *child;
+    }
+    char *n = malloc(namelen + 1);
+    if(dsock_slow(!n)) {errno = ENOMEM; return NULL;}
+    memcpy(n, name, namelen);
+    n[namelen] = 0;
+    struct httprouter_node *node = httprouter_mknode(NULL, 0);
+    if(dsock_slow(!node)) {free(n); return NULL;}
+    *child = node;
+    *childname = n;
+    return node;
+}
+
+int httprouter_add(int r, const char *method, const char *pattern,
+      void *data) {
+    struct httprouter *obj = hquery(r, httprouter_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(!pattern || pattern[0] != '/')) {errno = EINVAL; return -1;}
+    struct httprouter_node *node = &obj->root;
+    const char *pos = pattern;
+    size_t nparams = 0;
+    while(*pos) {
+        if(*pos == ':' || *pos == '*') {
+            /* Parameters and wildcards must span whole segments. */
+            if(dsock_slow(pos[-1] != '/')) {errno = EINVAL; return -1;}
+            const char *name = pos + 1;
+            const char *end = name;
+            while(*end && *end != '/') ++end;
+            if(dsock_slow(end == name)) {errno = EINVAL; return -1;}
+            if(dsock_slow(++nparams > DSOCK_HTTPROUTER_MAXPARAMS)) {
+                errno = EINVAL; return -1;}
+            if(*pos == '*') {
+                /* Wildcard must be the last segment. */
+                if(dsock_slow(*end)) {errno = EINVAL; return -1;}
+                node = httprouter_addspecial(&node->wildcard,
+                    &node->wildcardname, name, end - name);
+            }
+            else {
+                node = httprouter_addspecial(&node->param,
+                    &node->paramname, name, end - name);
+            }
+            if(dsock_slow(!node)) return -1;
+            pos = end;
+            continue;
+        }
+        const char *end = pos;
+        while(*end && *end != ':' && *end != '*') ++end;
+        node = httprouter_addliteral(node, pos, end - pos);
+        if(dsock_slow(!node)) return -1;
+        pos = end;
+    }
+    /* Register the handler. */
+    struct httprouter_handler *h;
+    for(h = node->handlers; h; h = h->next) {
+        if(dsock_slow((!h->method && !method) ||
+              (h->method && method && strcmp(h->method, method) == 0))) {
+            errno = EEXIST; return -1;}
+    }
+    h = malloc(sizeof(struct httprouter_handler));
+    if(dsock_slow(!h)) {errno = ENOMEM; return -1;}
+    h->method = NULL;
+    if(method) {
+        h->method = strdup(method);
+        if(dsock_slow(!h->method)) {free(h); errno = ENOMEM; return -1;}
+    }
+    h->data = data;
+    h->next = node->handlers;
+    node->handlers = h;
+    return 0;
+}
+
+static int httprouter_handler(struct httprouter_node *node, const char *method,
+      struct httprouter_match *m) {
+    struct httprouter_handler *h;
+    struct httprouter_handler *any = NULL;
+    for(h = node->handlers; h; h = h->next) {
+        if(!h->method) {any = h; continue;}
+        if(strcmp(h->method, method) == 0) {m->data = h->data; return 1;}
+    }
+    if(any) {m->data = any->data; return 1;}
+    return 0;
+}
+
+/* Literal matches are preferred to parameters which are in turn preferred
+   to wildcards. If the preferred alternative leads to no route the next one
+   is tried. With routes overlapping at many levels the number of such
+   fallbacks could be huge, so it's capped and matching fails once the cap
+   is exceeded. */
+#define HTTPROUTER_MAXFALLBACKS 64
+
+static int httprouter_lookup(struct httprouter_node *node, const char *path,
+      size_t len, const char *method, struct httprouter_match *m,
+      int *fallbacks) {
+    if(len == 0 && httprouter_handler(node, method, m)) return 1;
+    if(len > 0) {
+        struct httprouter_node *child = node->children;
+        while(child && child->prefix[0] != path[0]) child = child->next;
+        if(child && child->prefixlen <= len &&
+              memcmp(child->prefix, path, child->prefixlen) == 0) {
+            if(httprouter_lookup(child, path + child->prefixlen,
+                  len - child->prefixlen, method, m, fallbacks))
+                return 1;
+            if(dsock_slow(--*fallbacks < 0)) return 0;
+        }
+        if(node->param && path[0] != '/' &&
+              m->nparams < DSOCK_HTTPROUTER_MAXPARAMS) {
+            size_t seg = 0;
+            while(seg < len && path[seg] != '/') ++seg;
+            struct httprouter_param *p = &m->params[m->nparams++];
+            p->name = node->paramname;
+            p->value = path;
+            p->len = seg;
+            if(httprouter_lookup(node->param, path + seg, len - seg, method, m,
+                  fallbacks))
+                return 1;
+            m->nparams--;
+            if(dsock_slow(--*fallbacks < 0)) return 0;
+        }
+    }
+    if(node->wildcard && m->nparams < DSOCK_HTTPROUTER_MAXPARAMS) {
+        struct httprouter_param *p = &m->params[m->nparams++];
+        p->name = node->wildcardname;
+        p->value = path;
+        p->len = len;
+        if(httprouter_handler(node->wildcard, method, m)) return 1;
+        m->nparams--;
+    }
+    return 0;
+}
+
+int httprouter_match(int r, const char *method, const char *resource,
+      struct httprouter_match *m) {
+    struct httprouter *obj = hquery(r, httprouter_type);
+    if(dsock_slow(!obj)) return -1;
+    /* Query string is not a part of the path. */
+    size_t len = 0;
+    while(resource[len] && resource[len] != '?') ++len;
+    m->data = NULL;
+    m->nparams = 0;
+    int fallbacks = HTTPROUTER_MAXFALLBACKS;
+    if(dsock_slow(!httprouter_lookup(&obj->root, resource, len, method, m,
+          &fallbacks))) {
+        errno = ENOENT; return -1;}
+    return 0;
+}
+
+int httprouter_recv(int s, int r, struct httprouter_match *m,
+      int64_t deadline) {
+    int rc = http_recvrequest(s, m->command, sizeof(m->command),
+        m->resource, sizeof(m->resource), deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    return httprouter_match(r, m->command, m->resource, m);
+}
+
+static void httprouter_hclose(struct hvfs *hvfs) {
+    struct httprouter *obj = (struct httprouter*)hvfs;
+    httprouter_termnode(&obj->root);
+    free(obj);
+}
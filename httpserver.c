@@ -0,0 +1,428 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <libdillimpl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "dsock.h"
+#include "fd.h"
+#include "utils.h"
+
+dsock_unique_id(httpserver_type);
+dsock_unique_id(httpserver_listener_type);
+dsock_unique_id(httpserver_conn_type);
+
+/******************************************************************************/
+/*  Listener with SO_REUSEPORT                                                */
+/******************************************************************************/
+
+/* libdill's TCP listener can't be shared among threads. This one allows
+   each thread to bind its own listener to the same address and lets the
+   kernel balance the incoming connections among them. */
+
+static void *httpserver_listener_hquery(struct hvfs *hvfs, const void *type);
+static void httpserver_listener_hclose(struct hvfs *hvfs);
+static void *httpserver_conn_hquery(struct hvfs *hvfs, const void *type);
+static void httpserver_conn_hclose(struct hvfs *hvfs);
+static int httpserver_conn_bsendl(struct bsock_vfs *bvfs,
+    struct iolist *first, struct iolist *last, int64_t deadline);
+static int httpserver_conn_brecvl(struct bsock_vfs *bvfs,
+    struct iolist *first, struct iolist *last, int64_t deadline);
+static struct fd_rxbuf *httpserver_conn_fill(struct fd_rxbuf_vfs *rvfs,
+    int64_t deadline);
+
+struct httpserver_listener {
+    struct hvfs hvfs;
+    int fd;
+};
+
+struct httpserver_conn {
+    struct hvfs hvfs;
+    struct bsock_vfs bvfs;
+    struct fd_rxbuf_vfs rvfs;
+    int fd;
+    int err;
+    struct fd_rxbuf rxbuf;
+};
+
+static void *httpserver_listener_hquery(struct hvfs *hvfs, const void *type) {
+    struct httpserver_listener *obj = (struct httpserver_listener*)hvfs;
+    if(type == httpserver_listener_type) return obj;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+int httpserver_listen(struct ipaddr *addr, int backlog) {
+    int err;
+    int fd = socket(ipaddr_family(addr), SOCK_STREAM, 0);
+    if(dsock_slow(fd < 0)) {err = errno; goto error1;}
+    int rc = fd_unblock(fd);
+    if(dsock_slow(rc < 0)) {err = errno; goto error2;}
+#ifdef SO_REUSEPORT
+    int opt = 1;
+    rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    if(dsock_slow(rc < 0)) {err = errno; goto error2;}
+#endif
+    rc = bind(fd, ipaddr_sockaddr(addr), ipaddr_len(addr));
+    if(dsock_slow(rc < 0)) {err = errno; goto error2;}
+    rc = listen(fd, backlog);
+    if(dsock_slow(rc < 0)) {err = errno; goto error2;}
+    struct httpserver_listener *obj =
+        malloc(sizeof(struct httpserver_listener));
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error2;}
+    obj->hvfs.query = httpserver_listener_hquery;
+    obj->hvfs.close = httpserver_listener_hclose;
+    obj->hvfs.done = NULL;
+    obj->fd = fd;
+    int h = hmake(&obj->hvfs);
+    if(dsock_slow(h < 0)) {err = errno; goto error3;}
+    return h;
+error3:
+    free(obj);
+error2:
+    fd_close(fd);
+error1:
+    errno = err;
+    return -1;
+}
+
+static void httpserver_listener_hclose(struct hvfs *hvfs) {
+    struct httpserver_listener *obj = (struct httpserver_listener*)hvfs;
+    int rc = fd_close(obj->fd);
+    dsock_assert(rc == 0);
+    free(obj);
+}
+
+static void *httpserver_conn_hquery(struct hvfs *hvfs, const void *type) {
+    struct httpserver_conn *obj = (struct httpserver_conn*)hvfs;
+    if(type == bsock_type) return &obj->bvfs;
+    if(type == fd_rxbuf_type) return &obj->rvfs;
+    if(type == httpserver_conn_type) return obj;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+/* Accepts a connection either from libdill's TCP listener or from
+   the listener created by httpserver_listen(). */
+static int httpserver_accept(int ls, int64_t deadline) {
+    struct httpserver_listener *lst = hquery(ls, httpserver_listener_type);
+    if(!lst) return tcp_accept(ls, NULL, deadline);
+    int err;
+    int fd = fd_accept(lst->fd, NULL, NULL, deadline);
+    if(dsock_slow(fd < 0)) {err = errno; goto error1;}
+    struct httpserver_conn *obj = malloc(sizeof(struct httpserver_conn));
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error2;}
+    obj->hvfs.query = httpserver_conn_hquery;
+    obj->hvfs.close = httpserver_conn_hclose;
+    obj->hvfs.done = NULL;
+    obj->bvfs.bsendl = httpserver_conn_bsendl;
+    obj->bvfs.brecvl = httpserver_conn_brecvl;
+    obj->rvfs.fill = httpserver_conn_fill;
+    obj->fd = fd;
+    obj->err = 0;
+    fd_initrxbuf(&obj->rxbuf);
+    int h = hmake(&obj->hvfs);
+    if(dsock_slow(h < 0)) {err = errno; goto error3;}
+    return h;
+error3:
+    free(obj);
+error2:
+    fd_close(fd);
+error1:
+    errno = err;
+    return -1;
+}
+
+static int httpserver_conn_bsendl(struct bsock_vfs *bvfs,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    struct httpserver_conn *obj =
+        dsock_cont(bvfs, struct httpserver_conn, bvfs);
+    if(dsock_slow(obj->err)) {errno = obj->err; return -1;}
+    int rc = fd_send(obj->fd, first, last, deadline);
+    if(dsock_slow(rc < 0 && errno != ETIMEDOUT && errno != ECANCELED))
+        obj->err = errno;
+    return rc;
+}
+
+static int httpserver_conn_brecvl(struct bsock_vfs *bvfs,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    struct httpserver_conn *obj =
+        dsock_cont(bvfs, struct httpserver_conn, bvfs);
+    if(dsock_slow(obj->err)) {errno = obj->err; return -1;}
+    int rc = fd_recv(obj->fd, &obj->rxbuf, first, last, deadline);
+    if(dsock_slow(rc < 0 && errno != ETIMEDOUT && errno != ECANCELED))
+        obj->err = errno;
+    return rc;
+}
+
+static struct fd_rxbuf *httpserver_conn_fill(struct fd_rxbuf_vfs *rvfs,
+      int64_t deadline) {
+    struct httpserver_conn *obj =
+        dsock_cont(rvfs, struct httpserver_conn, rvfs);
+    if(dsock_slow(obj->err)) {errno = obj->err; return NULL;}
+    int rc = fd_fill(obj->fd, &obj->rxbuf, deadline);
+    if(dsock_slow(rc < 0)) {
+        if(errno != ETIMEDOUT && errno != ECANCELED) obj->err = errno;
+        return NULL;
+    }
+    return &obj->rxbuf;
+}
+
+static void httpserver_conn_hclose(struct hvfs *hvfs) {
+    struct httpserver_conn *obj = (struct httpserver_conn*)hvfs;
+    int rc = fd_close(obj->fd);
+    dsock_assert(rc == 0);
+    free(obj);
+}
+
+/******************************************************************************/
+/*  Server                                                                    */
+/******************************************************************************/
+
+static void *httpserver_hquery(struct hvfs *hvfs, const void *type);
+static void httpserver_hclose(struct hvfs *hvfs);
+
+struct httpserver {
+    struct hvfs hvfs;
+    int ls;
+    size_t maxconns;
+    int64_t timeout;
+    size_t maxheader;
+    httpserver_handler handler;
+    void *arg;
+    int acceptor;
+    /* Connection coroutines push their slot to the 'done' stack when they
+       finish so that the acceptor can close them. If the acceptor is out of
+       free slots it waits for a wakeup via this channel. */
+    int ch[2];
+    int waiting;
+    /* Handles of the connection coroutines indexed by slot, -1 if free. */
+    int *conns;
+    /* Stack of free slots and stack of slots of finished coroutines. Both
+       live in a single allocation. */
+    size_t *free;
+    size_t nfree;
+    size_t *done;
+    size_t ndone;
+};
+
+static coroutine void httpserver_acceptor(struct httpserver *obj);
+static coroutine void httpserver_worker(struct httpserver *obj, int s,
+    size_t idx);
+
+static void *httpserver_hquery(struct hvfs *hvfs, const void *type) {
+    struct httpserver *obj = (struct httpserver*)hvfs;
+    if(type == httpserver_type) return obj;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+int httpserver_make(int ls, size_t maxconns, int64_t timeout,
+      size_t maxheader, httpserver_handler handler, void *arg) {
+    int err;
+    if(dsock_slow(maxconns == 0 || !handler)) {err = EINVAL; goto error1;}
+    /* Create the object. */
+    struct httpserver *obj = malloc(sizeof(struct httpserver));
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
+    obj->hvfs.query = httpserver_hquery;
+    obj->hvfs.close = httpserver_hclose;
+    obj->hvfs.done = NULL;
+    obj->ls = ls;
+    obj->maxconns = maxconns;
+    obj->timeout = timeout;
+    obj->maxheader = maxheader;
+    obj->handler = handler;
+    obj->arg = arg;
+    obj->conns = malloc(sizeof(int) * maxconns);
+    if(dsock_slow(!obj->conns)) {err = ENOMEM; goto error2;}
+    obj->free = malloc(sizeof(size_t) * maxconns * 2);
+    if(dsock_slow(!obj->free)) {err = ENOMEM; goto error3;}
+    obj->done = obj->free + maxconns;
+    obj->ndone = 0;
+    obj->waiting = 0;
+    size_t i;
+    for(i = 0; i != maxconns; ++i) {
+        obj->conns[i] = -1;
+        obj->free[i] = maxconns - i - 1;
+    }
+    obj->nfree = maxconns;
+    int rc = chmake(obj->ch);
+    if(dsock_slow(rc < 0)) {err = errno; goto error4;}
+    obj->acceptor = go(httpserver_acceptor(obj));
+    if(dsock_slow(obj->acceptor < 0)) {err = errno; goto error5;}
+    /* Create the handle. */
+    int h = hmake(&obj->hvfs);
+    if(dsock_slow(h < 0)) {err = errno; goto error6;}
+    return h;
+error6:
+    rc = hclose(obj->acceptor);
+    dsock_assert(rc == 0);
+error5:
+    rc = hclose(obj->ch[0]);
+    dsock_assert(rc == 0);
+    rc = hclose(obj->ch[1]);
+    dsock_assert(rc == 0);
+error4:
+    free(obj->free);
+error3:
+    free(obj->conns);
+error2:
+    free(obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+static coroutine void httpserver_acceptor(struct httpserver *obj) {
+    while(1) {
+        /* If there are no free slots wait for a connection to finish. */
+        if(!obj->nfree && !obj->ndone) {
+            obj->waiting = 1;
+            int rc = chrecv(obj->ch[1], NULL, 0, -1);
+            obj->waiting = 0;
+            if(rc < 0 && errno == ECANCELED) return;
+        }
+        /* Reclaim the slots of finished connections. */
+        while(obj->ndone) {
+            size_t idx = obj->done[--obj->ndone];
+            int rc = hclose(obj->conns[idx]);
+            dsock_assert(rc == 0);
+            obj->conns[idx] = -1;
+            obj->free[obj->nfree++] = idx;
+        }
+        if(!obj->nfree) continue;
+        int s = httpserver_accept(obj->ls, -1);
+        if(dsock_slow(s < 0 && errno == ECANCELED)) return;
+        if(dsock_slow(s < 0)) {
+            /* E.g. out of file descriptors. Back off for a while. */
+            int rc = msleep(now() + 100);
+            if(rc < 0 && errno == ECANCELED) return;
+            continue;
+        }
+        size_t idx = obj->free[--obj->nfree];
+        obj->conns[idx] = go(httpserver_worker(obj, s, idx));
+        if(dsock_slow(obj->conns[idx] < 0)) {
+            int rc = hclose(s);
+            dsock_assert(rc == 0);
+            obj->free[obj->nfree++] = idx;
+        }
+    }
+}
+
+/* Sends an error response and closes the connection afterwards. */
+static void httpserver_error(int s, int status, const char *reason,
+      int64_t deadline) {
+    int rc = http_startstatus(s, status, reason);
+    if(dsock_slow(rc < 0)) return;
+    rc = http_addfield(s, "Connection", "close");
+    if(dsock_slow(rc < 0)) return;
+    http_sendheader(s, NULL, NULL, deadline);
+}
+
+static coroutine void httpserver_worker(struct httpserver *obj, int s,
+      size_t idx) {
+    int h = http_attach(s);
+    if(dsock_slow(h < 0)) {
+        int rc = hclose(s);
+        dsock_assert(rc == 0);
+        goto done;
+    }
+    if(obj->maxheader) http_setmaxheader(h, obj->maxheader);
+    char command[16];
+    char resource[1024];
+    /* Keep processing requests until the connection breaks, either side
+       asks for it to be closed or the client stays idle for too long. */
+    while(1) {
+        int64_t deadline = obj->timeout < 0 ? -1 : now() + obj->timeout;
+        int rc = http_recvrequest(h, command, sizeof(command),
+            resource, sizeof(resource), deadline);
+        /* Only overflowing resource means the URI is too long. Overflowing
+           command can't be any of the supported methods. */
+        if(dsock_slow(rc < 0 && errno == EMSGSIZE)) {
+            httpserver_error(h, 414, "URI Too Long", deadline);
+            break;
+        }
+        if(dsock_slow(rc < 0 && errno == ENOTSUP)) {
+            httpserver_error(h, 501, "Not Implemented", deadline);
+            break;
+        }
+        if(dsock_slow(rc < 0 && errno == EPROTO)) {
+            httpserver_error(h, 400, "Bad Request", deadline);
+            break;
+        }
+        if(dsock_slow(rc < 0)) break;
+        rc = http_recvfields(h, deadline);
+        if(dsock_slow(rc < 0 && errno == EMSGSIZE)) {
+            httpserver_error(h, 431, "Request Header Fields Too Large",
+                deadline);
+            break;
+        }
+        if(dsock_slow(rc < 0 && errno == EPROTO)) {
+            httpserver_error(h, 400, "Bad Request", deadline);
+            break;
+        }
+        if(dsock_slow(rc < 0)) break;
+        rc = obj->handler(h, command, resource, obj->arg, deadline);
+        if(dsock_slow(rc < 0)) break;
+        /* Skip any part of the request body left unread by the handler. */
+        struct iolist iol = {NULL, 65536, NULL, 0};
+        ssize_t sz;
+        do sz = http_recvbody(h, &iol, &iol, deadline); while(sz > 0);
+        if(dsock_slow(sz < 0)) break;
+        if(http_reusable(h) != 1) break;
+    }
+    int rc = hclose(h);
+    dsock_assert(rc == 0);
+done:
+    /* Hand the slot back without waiting for the acceptor. Wake it up if
+       it's waiting for a free slot. */
+    obj->done[obj->ndone++] = idx;
+    if(obj->waiting) chsend(obj->ch[0], NULL, 0, 0);
+}
+
+static void httpserver_hclose(struct hvfs *hvfs) {
+    struct httpserver *obj = (struct httpserver*)hvfs;
+    int rc = hclose(obj->acceptor);
+    dsock_assert(rc == 0);
+    size_t i;
+    for(i = 0; i != obj->maxconns; ++i) {
+        if(obj->conns[i] >= 0) {
+            rc = hclose(obj->conns[i]);
+            dsock_assert(rc == 0);
+        }
+    }
+    rc = hclose(obj->ch[0]);
+    dsock_assert(rc == 0);
+    rc = hclose(obj->ch[1]);
+    dsock_assert(rc == 0);
+    rc = hclose(obj->ls);
+    dsock_assert(rc == 0);
+    free(obj->free);
+    free(obj->conns);
+    free(obj);
+}
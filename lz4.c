@@ -30,6 +30,7 @@
 #include "lz4/lz4frame.h"
 
 #include "iol.h"
+#include "scratch.h"
 #include "utils.h"
 
 dsock_unique_id(lz4_type);
@@ -45,10 +46,6 @@ struct lz4_sock {
     struct hvfs hvfs;
     struct msock_vfs mvfs;
     int s;
-    uint8_t *outbuf;
-    size_t outlen;
-    uint8_t *inbuf;
-    size_t inlen;
     LZ4F_decompressionContext_t dctx;
 };
 
@@ -72,10 +69,6 @@ int lz4_attach(int s) {
     obj->mvfs.msendl = lz4_msendl;
     obj->mvfs.mrecvl = lz4_mrecvl;
     obj->s = s;
-    obj->outbuf = NULL;
-    obj->outlen = 0;
-    obj->inbuf = NULL;
-    obj->inlen = 0;        
     size_t ec = LZ4F_createDecompressionContext(&obj->dctx, LZ4F_VERSION);
     if(dsock_slow(LZ4F_isError(ec))) {err = EFAULT; goto error2;}
     /* Create the handle. */
@@ -97,8 +90,6 @@ int lz4_detach(int s) {
     if(dsock_slow(!obj)) return -1;
     size_t ec = LZ4F_freeDecompressionContext(obj->dctx);
     dsock_assert(!LZ4F_isError(ec));
-    free(obj->inbuf);
-    free(obj->outbuf);
     int u = obj->s;
     free(obj);
     return u;
@@ -110,88 +101,100 @@ static int lz4_msendl(struct msock_vfs *mvfs,
     size_t len;
     int rc = iol_check(first, last, NULL, &len);
     if(dsock_slow(rc < 0)) return -1;
-    /* Adjust the buffer size as needed. */
+    /* Borrow the buffers. Plaintext has to be gathered into a contiguous
+       buffer unless the message consists of a single piece. */
     size_t maxlen = LZ4F_compressFrameBound(len, NULL);
-    if(obj->outlen < maxlen) {
-        uint8_t *newbuf = realloc(obj->outbuf, maxlen);
-        if(dsock_slow(!newbuf)) {errno = ENOMEM; return -1;}
-        obj->outbuf = newbuf;
-        obj->outlen = maxlen;
+    uint8_t *outbuf = scratch_get(maxlen);
+    if(dsock_slow(!outbuf)) return -1;
+    const uint8_t *src = first->iol_base;
+    uint8_t *buf = NULL;
+    if(first != last) {
+        buf = scratch_get(len);
+        if(dsock_slow(!buf)) {scratch_put(outbuf); return -1;}
+        uint8_t *pos = buf;
+        struct iolist *it;
+        for(it = first; it; it = it->iol_next) {
+            memcpy(pos, it->iol_base, it->iol_len);
+            pos += it->iol_len;
+        }
+        src = buf;
     }
     /* Compress the data. */
-    /* TODO: Avoid the extra allocations and copies. */
-    uint8_t *buf = malloc(len);
-    if(dsock_slow(!buf)) {errno = ENOMEM; return -1;}
-    uint8_t *pos = buf;
-    struct iolist *it;
-    for(it = first; it; it = it->iol_next) {
-        memcpy(pos, it->iol_base, it->iol_len);
-        pos += it->iol_len;
-    }
     LZ4F_preferences_t prefs = {0};
     prefs.frameInfo.contentSize = len;
-    size_t dstlen = LZ4F_compressFrame(obj->outbuf, obj->outlen,
-        buf, len, &prefs);
+    size_t dstlen = LZ4F_compressFrame(outbuf, maxlen, src, len, &prefs);
     dsock_assert(!LZ4F_isError(dstlen));
-    dsock_assert(dstlen <= obj->outlen);
-    free(buf);
+    dsock_assert(dstlen <= maxlen);
+    scratch_put(buf);
     /* Send the compressed frame. */
-    return msend(obj->s, obj->outbuf, dstlen, deadline);
+    rc = msend(obj->s, outbuf, dstlen, deadline);
+    scratch_put(outbuf);
+    return rc;
 }
 
-static ssize_t lz4_mrecvl(struct msock_vfs *mvfs,
-      struct iolist *first, struct iolist *last, int64_t deadline) {
-    struct lz4_sock *obj = dsock_cont(mvfs, struct lz4_sock, mvfs);
-    size_t len;
-    int rc = iol_check(first, last, NULL, &len);
-    if(dsock_slow(rc < 0)) return -1;
-    /* Adjust the buffer size as needed. */
-    size_t maxlen = LZ4F_compressFrameBound(len, NULL);
-    if(obj->inlen < maxlen) {
-        uint8_t *newbuf = realloc(obj->inbuf, maxlen);
-        if(dsock_slow(!newbuf)) {errno = ENOMEM; return -1;}
-        obj->inbuf = newbuf;
-        obj->inlen = maxlen;
-    }
-    /* Get the compressed message. */
-    ssize_t sz = mrecv(obj->s, obj->inbuf, obj->inlen, deadline);
-    if(dsock_slow(sz < 0)) return -1;
+/* Decompresses the frame in 'inbuf' and copies the message into the
+   user's iolist. */
+static ssize_t lz4_decompress(struct lz4_sock *obj, const uint8_t *inbuf,
+      size_t sz, struct iolist *first, struct iolist *last, size_t len) {
     /* Extract size of the uncompressed message from LZ4 frame header. */
     LZ4F_frameInfo_t info;
     size_t infolen = sz;
-    size_t ec = LZ4F_getFrameInfo(obj->dctx, &info, obj->inbuf, &infolen);
+    size_t ec = LZ4F_getFrameInfo(obj->dctx, &info, inbuf, &infolen);
     if(dsock_slow(LZ4F_isError(ec))) {errno = EPROTO; return -1;}
     /* Size is a required field. */
     if(dsock_slow(info.contentSize == 0)) {errno = EPROTO; return -1;}
     /* Decompressed message would exceed the buffer size. */
     if(dsock_slow(info.contentSize > len)) {errno = EMSGSIZE; return -1;}
-    /* Decompress. */
-    /* TODO: Avoid the extra allocations and copies. */
-    uint8_t *buf = malloc(len);
-    if(dsock_slow(!buf)) {errno = ENOMEM; return -1;}
+    /* Decompress. Single-piece message is decompressed directly into the
+       user's buffer. */
+    uint8_t *buf = first->iol_base;
+    if(first != last || !buf) {
+        buf = scratch_get(len);
+        if(dsock_slow(!buf)) return -1;
+    }
+    ssize_t res = -1;
     size_t dstlen = len;
     size_t srclen = sz - infolen;
-    ec = LZ4F_decompress(obj->dctx, buf, &dstlen,
-        obj->inbuf + infolen, &srclen, NULL);
-    if(dsock_slow(LZ4F_isError(ec))) {errno = EPROTO; return -1;}
-    if(dsock_slow(ec != 0)) {errno = EPROTO; return -1;}
+    ec = LZ4F_decompress(obj->dctx, buf, &dstlen, inbuf + infolen, &srclen,
+        NULL);
+    if(dsock_slow(LZ4F_isError(ec) || ec != 0)) {errno = EPROTO; goto done;}
     dsock_assert(srclen == sz - infolen);
-    uint8_t *pos = buf;
-    struct iolist *it;
-    for(it = first; it; it = it->iol_next) {
-        if(it->iol_base) memcpy(it->iol_base, pos, it->iol_len);
-        pos += it->iol_len;
+    if(buf != first->iol_base) {
+        uint8_t *pos = buf;
+        struct iolist *it;
+        for(it = first; it; it = it->iol_next) {
+            if(it->iol_base) memcpy(it->iol_base, pos, it->iol_len);
+            pos += it->iol_len;
+        }
     }
-    free(buf);
-    return dstlen;
+    res = dstlen;
+done:
+    if(buf != first->iol_base) scratch_put(buf);
+    return res;
+}
+
+static ssize_t lz4_mrecvl(struct msock_vfs *mvfs,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    struct lz4_sock *obj = dsock_cont(mvfs, struct lz4_sock, mvfs);
+    size_t len;
+    int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) return -1;
+    /* Borrow the buffer. */
+    size_t maxlen = LZ4F_compressFrameBound(len, NULL);
+    uint8_t *inbuf = scratch_get(maxlen);
+    if(dsock_slow(!inbuf)) return -1;
+    /* Get the compressed message. */
+    ssize_t sz = mrecv(obj->s, inbuf, maxlen, deadline);
+    if(dsock_fast(sz >= 0))
+        sz = lz4_decompress(obj, inbuf, sz, first, last, len);
+    scratch_put(inbuf);
+    return sz;
 }
 
 static void lz4_hclose(struct hvfs *hvfs) {
     struct lz4_sock *obj = (struct lz4_sock*)hvfs;
     size_t ec = LZ4F_freeDecompressionContext(obj->dctx);
     dsock_assert(!LZ4F_isError(ec));
-    free(obj->inbuf);
-    free(obj->outbuf);
     int rc = hclose(obj->s);
     dsock_assert(rc == 0);
     free(obj);
@@ -31,8 +31,13 @@
 
 #include "tweetnacl/tweetnacl.h"
 
+#include "aesgcm.h"
+#include "chacha20.h"
 #include "dsock.h"
 #include "iol.h"
+#include "salsa20.h"
+#include "scratch.h"
+#include "threadpool.h"
 #include "utils.h"
 
 dsock_unique_id(nacl_type);
@@ -44,19 +49,48 @@ static int nacl_msendl(struct msock_vfs *mvfs,
 static ssize_t nacl_mrecvl(struct msock_vfs *mvfs,
     struct iolist *first, struct iolist *last, int64_t deadline);
 
-#define NACL_EXTRABYTES \
-    (crypto_secretbox_ZEROBYTES + crypto_secretbox_NONCEBYTES)
+/* The working buffer holds the message as it appears on the wire, minus
+   the nonce: each chunk of the message is preceded by its authenticator.
+   Unless chunking is enabled, the whole message is a single chunk. */
+#define NACL_TAGBYTES crypto_secretbox_BOXZEROBYTES
+#define NACL_MAXNONCEBYTES crypto_secretbox_NONCEBYTES
+/* Chunk index is bound into the nonce. The top bit marks the last chunk so
+   that the message can't be truncated at a chunk boundary. */
+#define NACL_LASTCHUNK 0x80000000u
+#define NACL_MAXCHUNKS ((size_t)NACL_LASTCHUNK)
+/* In compact framing the message starts with a byte holding the number of
+   low-order nonce bytes that follow. Zero means the full nonce follows. */
+#define NACL_MAXDELTABYTES 8
+#define NACL_MAXHDRBYTES (1 + NACL_MAXNONCEBYTES)
+/* Replay window tracks the low-order bytes of the nonce as a sequence
+   number. */
+#define NACL_SEQBYTES 8
 
 struct nacl_sock {
     struct hvfs hvfs;
     struct msock_vfs mvfs;
     int s;
-    size_t buflen;
-    uint8_t *buf1;
-    uint8_t *buf2;
+    int suite;
+    size_t noncelen;
+    /* Maximum size of a chunk, zero if chunking is disabled. */
+    size_t chunklen;
+    /* Number of low-order nonce bytes sent in compact framing, zero if
+       compact framing is disabled. */
+    size_t deltalen;
+    /* Whether full nonce was already sent and received, respectively. */
+    int ssynced;
+    int rsynced;
+    /* Replay window. Bitmap of recently received messages, indexed by
+       the low-order 8 bytes of the nonce. Zero words if disabled. */
+    size_t nwords;
+    uint64_t *window;
+    uint64_t top;
+    uint8_t whigh[NACL_MAXNONCEBYTES - NACL_SEQBYTES];
     uint8_t key[crypto_secretbox_KEYBYTES];
-    uint8_t send_nonce[crypto_secretbox_NONCEBYTES];
-    uint8_t recv_nonce[crypto_secretbox_NONCEBYTES];
+    /* Expanded key for AES-256-GCM. */
+    struct aesgcm gcm;
+    uint8_t send_nonce[NACL_MAXNONCEBYTES];
+    uint8_t recv_nonce[NACL_MAXNONCEBYTES];
 };
 
 static void *nacl_hquery(struct hvfs *hvfs, const void *type) {
@@ -68,26 +102,50 @@ static void *nacl_hquery(struct hvfs *hvfs, const void *type) {
 }
 
 int nacl_attach(int s, const void *key, size_t keylen, int64_t deadline) {
+    return nacl_attach_suite(s, DSOCK_NACL_XSALSA20_POLY1305, key, keylen,
+        deadline);
+}
+
+int nacl_attach_suite(int s, int suite, const void *key, size_t keylen,
+      int64_t deadline) {
     int err;
+    /* All the suites use 256-bit keys. */
     if(dsock_slow(!key || keylen != crypto_secretbox_KEYBYTES)) {
-        err = EINVAL; goto error2;}
+        err = EINVAL; goto error1;}
+    size_t noncelen;
+    switch(suite) {
+    case DSOCK_NACL_XSALSA20_POLY1305:
+        noncelen = crypto_secretbox_NONCEBYTES;
+        break;
+    case DSOCK_NACL_CHACHA20_POLY1305:
+    case DSOCK_NACL_AES256_GCM:
+        noncelen = 12;
+        break;
+    default:
+        err = EINVAL; goto error1;
+    }
     /* Check whether underlying socket is message-based. */
     if(dsock_slow(!hquery(s, msock_type))) {err = errno; goto error1;}
     /* Create the object. */
     struct nacl_sock *obj = malloc(sizeof(struct nacl_sock));
-    if(dsock_slow(!obj)) {errno = ENOMEM; goto error1;}
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
     obj->hvfs.query = nacl_hquery;
     obj->hvfs.close = nacl_hclose;
     obj->mvfs.msendl = nacl_msendl;
     obj->mvfs.mrecvl = nacl_mrecvl;
     obj->s = s;
-    obj->buflen = 0;
-    obj->buf1 = NULL;
-    obj->buf2 = NULL;
+    obj->suite = suite;
+    obj->noncelen = noncelen;
+    obj->chunklen = 0;
+    obj->deltalen = 0;
+    obj->ssynced = 0;
+    obj->rsynced = 0;
+    obj->nwords = 0;
+    obj->window = NULL;
     memcpy(obj->key, key, crypto_secretbox_KEYBYTES);
+    if(suite == DSOCK_NACL_AES256_GCM) aesgcm_init(&obj->gcm, obj->key);
     /* Generate random nonce for sending. */
-    int rc = dsock_random(obj->send_nonce, crypto_secretbox_NONCEBYTES,
-        deadline); 
+    int rc = dsock_random(obj->send_nonce, noncelen, deadline);
     if(dsock_slow(rc != 0)) {err = errno; goto error2;}
     /* Create the handle. */
     int h = hmake(&obj->hvfs);
@@ -99,8 +157,11 @@ int nacl_attach(int s, const void *key, size_t keylen, int64_t deadline) {
     dsock_assert(rc == 0);
     return h;
 error3:
+    /* Closing the handle deallocates the object. */
     rc = hclose(h);
     dsock_assert(rc == 0);
+    errno = err;
+    return -1;
 error2:
     free(obj);
 error1:
@@ -108,60 +169,447 @@ error1:
     return -1;
 }
 
+int nacl_keypair(void *pk, void *sk, int64_t deadline) {
+    if(dsock_slow(!pk || !sk)) {errno = EINVAL; return -1;}
+    /* Same as crypto_box_keypair() but uses the system's source of
+       randomness. */
+    int rc = dsock_random(sk, crypto_box_SECRETKEYBYTES, deadline);
+    if(dsock_slow(rc != 0)) return -1;
+    crypto_scalarmult_base(pk, sk);
+    return 0;
+}
+
+/* Handshake message: nonce followed by the boxed ephemeral public key
+   (without crypto_box's leading zero bytes). */
+#define NACL_HELLOBYTES (crypto_box_NONCEBYTES + crypto_box_ZEROBYTES - \
+    crypto_box_BOXZEROBYTES + crypto_box_PUBLICKEYBYTES)
+
+int nacl_attach_box(int s, const void *sk, const void *peerpk,
+      int64_t deadline) {
+    int err;
+    if(dsock_slow(!sk || !peerpk)) {err = EINVAL; goto error1;}
+    if(dsock_slow(!hquery(s, msock_type))) {err = errno; goto error1;}
+    /* Long-term shared key. It is used only to authenticate the ephemeral
+       keys, so that the session key is forward secret. */
+    uint8_t authkey[crypto_box_BEFORENMBYTES];
+    crypto_box_beforenm(authkey, peerpk, sk);
+    /* Generate ephemeral key pair. */
+    uint8_t epk[crypto_box_PUBLICKEYBYTES];
+    uint8_t esk[crypto_box_SECRETKEYBYTES];
+    int rc = nacl_keypair(epk, esk, deadline);
+    if(dsock_slow(rc != 0)) {err = errno; goto error2;}
+    /* Send the ephemeral public key boxed with the long-term key. */
+    uint8_t hello[NACL_HELLOBYTES];
+    rc = dsock_random(hello, crypto_box_NONCEBYTES, deadline);
+    if(dsock_slow(rc != 0)) {err = errno; goto error2;}
+    uint8_t plain[crypto_box_ZEROBYTES + crypto_box_PUBLICKEYBYTES];
+    uint8_t boxed[crypto_box_ZEROBYTES + crypto_box_PUBLICKEYBYTES];
+    memset(plain, 0, crypto_box_ZEROBYTES);
+    memcpy(plain + crypto_box_ZEROBYTES, epk, crypto_box_PUBLICKEYBYTES);
+    crypto_box_afternm(boxed, plain, sizeof(plain), hello, authkey);
+    memcpy(hello + crypto_box_NONCEBYTES, boxed + crypto_box_BOXZEROBYTES,
+        sizeof(boxed) - crypto_box_BOXZEROBYTES);
+    rc = msend(s, hello, sizeof(hello), deadline);
+    if(dsock_slow(rc != 0)) {err = errno; goto error2;}
+    /* Receive peer's ephemeral public key. */
+    ssize_t sz = mrecv(s, hello, sizeof(hello), deadline);
+    if(dsock_slow(sz < 0)) {err = errno; goto error2;}
+    if(dsock_slow(sz != sizeof(hello))) {err = EPROTO; goto error2;}
+    memset(boxed, 0, crypto_box_BOXZEROBYTES);
+    memcpy(boxed + crypto_box_BOXZEROBYTES, hello + crypto_box_NONCEBYTES,
+        sizeof(boxed) - crypto_box_BOXZEROBYTES);
+    rc = crypto_box_open_afternm(plain, boxed, sizeof(boxed), hello, authkey);
+    if(dsock_slow(rc != 0)) {err = EACCES; goto error2;}
+    /* Our own message reflected back. */
+    if(dsock_slow(memcmp(plain + crypto_box_ZEROBYTES, epk,
+          crypto_box_PUBLICKEYBYTES) == 0)) {err = EACCES; goto error2;}
+    /* Derive the session key. This is the only scalar multiplication done
+       for the connection, the messages themselves use the secretbox path. */
+    uint8_t key[crypto_box_BEFORENMBYTES];
+    crypto_box_beforenm(key, plain + crypto_box_ZEROBYTES, esk);
+    memset(esk, 0, sizeof(esk));
+    memset(authkey, 0, sizeof(authkey));
+    int h = nacl_attach(s, key, sizeof(key), deadline);
+    err = errno;
+    memset(key, 0, sizeof(key));
+    errno = err;
+    return h;
+error2:
+    memset(esk, 0, sizeof(esk));
+    memset(authkey, 0, sizeof(authkey));
+error1:
+    errno = err;
+    return -1;
+}
+
+/* Wipes the key material and deallocates the object. */
+static void nacl_free(struct nacl_sock *obj) {
+    free(obj->window);
+    memset(obj->key, 0, sizeof(obj->key));
+    aesgcm_term(&obj->gcm);
+    free(obj);
+}
+
 int nacl_detach(int s) {
     struct nacl_sock *obj = hquery(s, nacl_type);
     if(dsock_slow(!obj)) return -1;
-    free(obj->buf1);
-    free(obj->buf2);
     int u = obj->s;
-    free(obj);
+    nacl_free(obj);
     return u;
 }
 
-static int nacl_resizebufs(struct nacl_sock *obj, size_t len) {
-   if(dsock_slow(!obj->buf1 || obj->buflen < len)) {
-        obj->buflen = len;
-        obj->buf1 = realloc(obj->buf1, len);
-        if(dsock_slow(!obj->buf1)) {errno = ENOMEM; return -1;}
-        obj->buf2 = realloc(obj->buf2, len);
-        if(dsock_slow(!obj->buf2)) {errno = ENOMEM; return -1;}
+int nacl_setchunklen(int s, size_t len) {
+    struct nacl_sock *obj = hquery(s, nacl_type);
+    if(dsock_slow(!obj)) return -1;
+    obj->chunklen = len;
+    return 0;
+}
+
+int nacl_setcompact(int s, size_t deltalen) {
+    struct nacl_sock *obj = hquery(s, nacl_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(deltalen > NACL_MAXDELTABYTES ||
+          deltalen >= obj->noncelen || (deltalen && obj->nwords))) {
+        errno = EINVAL; return -1;}
+    obj->deltalen = deltalen;
+    obj->ssynced = 0;
+    obj->rsynced = 0;
+    return 0;
+}
+
+int nacl_setwindow(int s, size_t window) {
+    struct nacl_sock *obj = hquery(s, nacl_type);
+    if(dsock_slow(!obj)) return -1;
+    /* Compact framing requires in-order delivery. */
+    if(dsock_slow(window && obj->deltalen)) {errno = EINVAL; return -1;}
+    /* The word holding the newest message is only partially used, so
+       allocate an extra one. */
+    size_t nwords = window ? (window + 63) / 64 + 1 : 0;
+    uint64_t *bits = NULL;
+    if(nwords) {
+        bits = calloc(nwords, sizeof(uint64_t));
+        if(dsock_slow(!bits)) {errno = ENOMEM; return -1;}
+    }
+    free(obj->window);
+    obj->window = bits;
+    obj->nwords = nwords;
+    obj->rsynced = 0;
+    return 0;
+}
+
+static uint64_t nacl_seq(const uint8_t *nonce) {
+    uint64_t seq = 0;
+    int i;
+    for(i = NACL_SEQBYTES - 1; i >= 0; --i) seq = (seq << 8) | nonce[i];
+    return seq;
+}
+
+/* Checks whether the message is not a replay. Doesn't modify the window
+   so that forged messages, which will fail to authenticate, can't move
+   it. */
+static int nacl_checkwindow(const struct nacl_sock *obj,
+      const uint8_t *nonce) {
+    size_t hilen = obj->noncelen - NACL_SEQBYTES;
+    /* Our own message reflected back. */
+    if(dsock_slow(memcmp(nonce + NACL_SEQBYTES,
+          obj->send_nonce + NACL_SEQBYTES, hilen) == 0)) return -1;
+    if(dsock_slow(!obj->rsynced)) return 0;
+    /* The window follows a single stream of messages. */
+    if(dsock_slow(memcmp(nonce + NACL_SEQBYTES, obj->whigh, hilen) != 0))
+        return -1;
+    uint64_t seq = nacl_seq(nonce);
+    if(seq > obj->top) return 0;
+    if(dsock_slow(obj->top - seq >= (obj->nwords - 1) * 64)) return -1;
+    uint64_t bit = obj->window[(seq / 64) % obj->nwords] &
+        ((uint64_t)1 << (seq % 64));
+    return dsock_slow(bit) ? -1 : 0;
+}
+
+/* Marks authenticated message as received. */
+static void nacl_updatewindow(struct nacl_sock *obj, const uint8_t *nonce) {
+    uint64_t seq = nacl_seq(nonce);
+    if(dsock_slow(!obj->rsynced)) {
+        memcpy(obj->whigh, nonce + NACL_SEQBYTES,
+            obj->noncelen - NACL_SEQBYTES);
+        memset(obj->window, 0, obj->nwords * sizeof(uint64_t));
+        obj->top = seq;
+        obj->rsynced = 1;
+    }
+    else if(seq > obj->top) {
+        /* Slide the window, clearing the words it moves over. */
+        uint64_t w = obj->top / 64;
+        uint64_t neww = seq / 64;
+        if(neww - w >= obj->nwords)
+            memset(obj->window, 0, obj->nwords * sizeof(uint64_t));
+        else
+            for(++w; w <= neww; ++w) obj->window[w % obj->nwords] = 0;
+        obj->top = seq;
+    }
+    obj->window[(seq / 64) % obj->nwords] |= (uint64_t)1 << (seq % 64);
+}
+
+/* Compares two nonces as little-endian numbers. */
+static int nacl_noncecmp(const uint8_t *a, const uint8_t *b, size_t len) {
+    while(len--) {
+        if(a[len] != b[len]) return a[len] < b[len] ? -1 : 1;
     }
     return 0;
 }
 
+/* Reconstructs the full nonce from its 'len' low-order bytes. The result is
+   the smallest nonce greater than the last one received. */
+static void nacl_expandnonce(const struct nacl_sock *obj, uint8_t *dst,
+      const uint8_t *delta, size_t len) {
+    memcpy(dst, obj->recv_nonce, obj->noncelen);
+    memcpy(dst, delta, len);
+    if(nacl_noncecmp(dst, obj->recv_nonce, len) > 0) return;
+    size_t i;
+    for(i = len; i != obj->noncelen; ++i) {
+        dst[i]++;
+        if(dst[i]) break;
+    }
+}
+
+/* Number of chunks a message of size 'len' is split into. */
+static size_t nacl_nchunks(struct nacl_sock *obj, size_t len) {
+    if(!obj->chunklen || !len) return 1;
+    return (len - 1) / obj->chunklen + 1;
+}
+
+/* Nonce of the 'idx'-th chunk of a message. */
+static void nacl_chunknonce(const struct nacl_sock *obj, uint8_t *dst,
+      const uint8_t *nonce, size_t idx, int last) {
+    memcpy(dst, nonce, obj->noncelen);
+    uint32_t val = (uint32_t)idx | (last ? NACL_LASTCHUNK : 0);
+    uint8_t *pos = dst + obj->noncelen - 4;
+    pos[0] ^= (uint8_t)val;
+    pos[1] ^= (uint8_t)(val >> 8);
+    pos[2] ^= (uint8_t)(val >> 16);
+    pos[3] ^= (uint8_t)(val >> 24);
+}
+
+/* Encrypts 'len' bytes of 'data' in place and stores the authenticator
+   to 'tag'. */
+static void nacl_seal(const struct nacl_sock *obj, uint8_t *tag,
+      uint8_t *data, size_t len, const uint8_t *nonce) {
+    switch(obj->suite) {
+    case DSOCK_NACL_CHACHA20_POLY1305:
+        chacha20poly1305_seal(tag, data, data, len, NULL, 0, nonce, obj->key);
+        return;
+    case DSOCK_NACL_AES256_GCM:
+        aesgcm_seal(&obj->gcm, tag, data, data, len, NULL, 0, nonce);
+        return;
+    }
+    xsalsa20poly1305_seal(tag, data, data, len, nonce, obj->key);
+}
+
+/* Checks the authenticator and decrypts 'len' bytes of 'data' in place. */
+static int nacl_open(const struct nacl_sock *obj, const uint8_t *tag,
+      uint8_t *data, size_t len, const uint8_t *nonce) {
+    switch(obj->suite) {
+    case DSOCK_NACL_CHACHA20_POLY1305:
+        return chacha20poly1305_open(data, data, len, tag, NULL, 0, nonce,
+            obj->key);
+    case DSOCK_NACL_AES256_GCM:
+        return aesgcm_open(&obj->gcm, data, data, len, tag, NULL, 0, nonce);
+    }
+    return xsalsa20poly1305_open(data, data, len, tag, nonce, obj->key);
+}
+
+/* Chunks of a single message processed by the worker threads. */
+struct nacl_job {
+    const struct nacl_sock *obj;
+    uint8_t *buf;
+    size_t len;
+    size_t nchunks;
+    const uint8_t *nonce;
+    int failed;
+};
+
+static void nacl_sealchunk(void *arg, size_t i) {
+    struct nacl_job *job = arg;
+    size_t chunklen = job->obj->chunklen;
+    uint8_t *tag = job->buf + i * (NACL_TAGBYTES + chunklen);
+    int last = i == job->nchunks - 1;
+    uint8_t nonce[NACL_MAXNONCEBYTES];
+    nacl_chunknonce(job->obj, nonce, job->nonce, i, last);
+    nacl_seal(job->obj, tag, tag + NACL_TAGBYTES,
+        last ? job->len - i * chunklen : chunklen, nonce);
+}
+
+static void nacl_openchunk(void *arg, size_t i) {
+    struct nacl_job *job = arg;
+    size_t chunklen = job->obj->chunklen;
+    uint8_t *tag = job->buf + i * (NACL_TAGBYTES + chunklen);
+    int last = i == job->nchunks - 1;
+    uint8_t nonce[NACL_MAXNONCEBYTES];
+    nacl_chunknonce(job->obj, nonce, job->nonce, i, last);
+    int rc = nacl_open(job->obj, tag, tag + NACL_TAGBYTES,
+        last ? job->len - i * chunklen : chunklen, nonce);
+    if(dsock_slow(rc != 0))
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+}
+
 static int nacl_msendl(struct msock_vfs *mvfs,
       struct iolist *first, struct iolist *last, int64_t deadline) {
     struct nacl_sock *obj = dsock_cont(mvfs, struct nacl_sock, mvfs);
     size_t len;
     int rc = iol_check(first, last, NULL, &len);
     if(dsock_slow(rc < 0)) return -1;
-    /* If needed, adjust the buffers. */
-    rc = nacl_resizebufs(obj, NACL_EXTRABYTES + len);
-    if(dsock_slow(rc < 0)) return -1;
+    size_t nchunks = nacl_nchunks(obj, len);
+    if(dsock_slow(nchunks > NACL_MAXCHUNKS)) {errno = EMSGSIZE; return -1;}
+    size_t wirelen = nchunks * NACL_TAGBYTES + len;
+    /* Borrow a working buffer. Messages are encrypted in place. */
+    uint8_t *buf = scratch_get(wirelen);
+    if(dsock_slow(!buf)) return -1;
     /* Increase nonce. */
     int i;
-    for(i = 0; i != sizeof(obj->send_nonce); ++i) {
+    for(i = 0; i != obj->noncelen; ++i) {
         obj->send_nonce[i]++;
         if(obj->send_nonce[i]) break;
     }
-    /* Encrypt and authenticate the message. */
-    size_t mlen = len + crypto_secretbox_ZEROBYTES;
-    memset(obj->buf1, 0, crypto_secretbox_ZEROBYTES);
-    uint8_t *pos = obj->buf1 + crypto_secretbox_ZEROBYTES;
+    /* Gather the plaintext into the chunks of the working buffer. */
+    size_t chunklen = obj->chunklen ? obj->chunklen : len;
+    uint8_t *pos = buf + NACL_TAGBYTES;
+    size_t off = 0;
     struct iolist *it;
     for(it = first; it; it = it->iol_next) {
-        memcpy(pos, it->iol_base, it->iol_len);
-        pos += it->iol_len;
+        const uint8_t *src = it->iol_base;
+        size_t rmn = it->iol_len;
+        while(rmn) {
+            size_t tocopy = MIN(rmn, chunklen - off);
+            memcpy(pos, src, tocopy);
+            pos += tocopy;
+            src += tocopy;
+            rmn -= tocopy;
+            off += tocopy;
+            if(off == chunklen) {pos += NACL_TAGBYTES; off = 0;}
+        }
+    }
+    /* Encrypt and authenticate the chunks in place. Multiple chunks are
+       processed in parallel by the worker threads. */
+    if(!obj->chunklen) {
+        nacl_seal(obj, buf, buf + NACL_TAGBYTES, len, obj->send_nonce);
+    }
+    else {
+        struct nacl_job job = {obj, buf, len, nchunks, obj->send_nonce, 0};
+        rc = threadpool_run(nacl_sealchunk, &job, nchunks);
+        if(dsock_slow(rc < 0)) {scratch_put(buf); return -1;}
+    }
+    /* Send the the encrypted message: nonce + authenticated chunks */
+    struct iolist ciol = {buf, wirelen, NULL, 0};
+    struct iolist niol = {obj->send_nonce, obj->noncelen, &ciol, 0};
+    uint8_t hdr[NACL_MAXHDRBYTES];
+    if(obj->deltalen) {
+        /* In compact framing only the low-order bytes of the nonce are
+           sent. Full nonce is sent in the first message and whenever the
+           low-order bytes wrap around, so that the peer can resynchronise
+           even if some messages were lost. */
+        for(i = 0; i != obj->deltalen && !obj->send_nonce[i]; ++i);
+        if(dsock_slow(!obj->ssynced || i == obj->deltalen)) {
+            hdr[0] = 0;
+            memcpy(hdr + 1, obj->send_nonce, obj->noncelen);
+            niol.iol_len = 1 + obj->noncelen;
+            obj->ssynced = 1;
+        }
+        else {
+            hdr[0] = (uint8_t)obj->deltalen;
+            memcpy(hdr + 1, obj->send_nonce, obj->deltalen);
+            niol.iol_len = 1 + obj->deltalen;
+        }
+        niol.iol_base = hdr;
     }
-    crypto_secretbox(obj->buf2, obj->buf1, mlen, obj->send_nonce, obj->key);
-    /* Prepare the message: nonce + ciphertext */
-    memcpy(obj->buf1, obj->send_nonce, crypto_secretbox_NONCEBYTES);
-    memcpy(obj->buf1 + crypto_secretbox_NONCEBYTES,
-        obj->buf2 + crypto_secretbox_BOXZEROBYTES,
-        mlen - crypto_secretbox_BOXZEROBYTES);
-    /* Send the the encrypted message. */
-    return msend(obj->s, obj->buf1, crypto_secretbox_NONCEBYTES + mlen -
-        crypto_secretbox_BOXZEROBYTES , deadline);
+    rc = msendl(obj->s, &niol, &ciol, deadline);
+    scratch_put(buf);
+    return rc;
+}
+
+/* Decrypts the message received into 'buf' and copies it into the user's
+   iolist. */
+static ssize_t nacl_decrypt(struct nacl_sock *obj, uint8_t *buf, size_t sz,
+      struct iolist *first) {
+    uint8_t *base = buf;
+    uint8_t nonce[NACL_MAXNONCEBYTES];
+    const uint8_t *pnonce = obj->recv_nonce;
+    if(!obj->deltalen) {
+        if(dsock_slow(sz < obj->noncelen + NACL_TAGBYTES)) {
+            errno = EPROTO; return -1;}
+        sz -= obj->noncelen;
+    }
+    else {
+        /* Header is of variable size, so the chunks are decrypted wherever
+           they happen to land. */
+        if(dsock_slow(sz < 1)) {errno = EPROTO; return -1;}
+        size_t dlen = buf[0];
+        if(dsock_slow(dlen > NACL_MAXDELTABYTES || dlen >= obj->noncelen ||
+              (dlen && !obj->rsynced))) {errno = EPROTO; return -1;}
+        if(!dlen) dlen = obj->noncelen;
+        if(dsock_slow(sz < 1 + dlen + NACL_TAGBYTES)) {
+            errno = EPROTO; return -1;}
+        if(dlen == obj->noncelen) {
+            memcpy(nonce, buf + 1, obj->noncelen);
+            /* Nonces only ever grow. Anything else is a replay. */
+            if(dsock_slow(obj->rsynced &&
+                  nacl_noncecmp(nonce, obj->recv_nonce, obj->noncelen) <= 0)) {
+                errno = EACCES; return -1;}
+        }
+        else {
+            nacl_expandnonce(obj, nonce, buf + 1, dlen);
+        }
+        pnonce = nonce;
+        base = buf + 1 + dlen;
+        sz -= 1 + dlen;
+    }
+    if(obj->nwords && dsock_slow(nacl_checkwindow(obj, pnonce) < 0)) {
+        errno = EACCES; return -1;}
+    /* Each chunk, including the last one, must be big enough to contain
+       the authenticator. */
+    size_t nchunks = 1;
+    if(obj->chunklen) {
+        size_t stride = NACL_TAGBYTES + obj->chunklen;
+        nchunks = (sz - 1) / stride + 1;
+        if(dsock_slow(sz - (nchunks - 1) * stride < NACL_TAGBYTES ||
+              nchunks > NACL_MAXCHUNKS)) {
+            errno = EPROTO; return -1;}
+    }
+    sz -= nchunks * NACL_TAGBYTES;
+    /* Decrypt and authenticate the chunks in place. */
+    int rc;
+    if(!obj->chunklen) {
+        rc = nacl_open(obj, base, base + NACL_TAGBYTES, sz, pnonce);
+    }
+    else {
+        struct nacl_job job = {obj, base, sz, nchunks, pnonce, 0};
+        rc = threadpool_run(nacl_openchunk, &job, nchunks);
+        if(dsock_slow(rc < 0)) return -1;
+        rc = job.failed ? -1 : 0;
+    }
+    if(dsock_slow(rc < 0)) {errno = EACCES; return -1;}
+    if(obj->deltalen) {
+        memcpy(obj->recv_nonce, nonce, obj->noncelen);
+        obj->rsynced = 1;
+    }
+    if(obj->nwords) nacl_updatewindow(obj, pnonce);
+    /* Copy the message into user's buffer. */
+    size_t chunklen = obj->chunklen ? obj->chunklen : sz;
+    uint8_t *pos = base + NACL_TAGBYTES;
+    size_t off = 0;
+    size_t rmn = sz;
+    struct iolist *it;
+    for(it = first; rmn; it = it->iol_next) {
+        uint8_t *dst = it->iol_base;
+        size_t itrmn = MIN(rmn, it->iol_len);
+        rmn -= itrmn;
+        while(itrmn) {
+            size_t tocopy = MIN(itrmn, chunklen - off);
+            if(dst) {memcpy(dst, pos, tocopy); dst += tocopy;}
+            pos += tocopy;
+            itrmn -= tocopy;
+            off += tocopy;
+            if(off == chunklen) {pos += NACL_TAGBYTES; off = 0;}
+        }
+    }
+    return sz;
 }
 
 static ssize_t nacl_mrecvl(struct msock_vfs *mvfs,
@@ -170,38 +618,26 @@ static ssize_t nacl_mrecvl(struct msock_vfs *mvfs,
     size_t len;
     int rc = iol_check(first, last, NULL, &len);
     if(dsock_slow(rc < 0)) return -1;
-    /* If needed, adjust the buffers. */
-    rc = nacl_resizebufs(obj, NACL_EXTRABYTES + len);
-    /* Read the encrypted message. */
-    ssize_t sz = mrecv(obj->s, obj->buf1, NACL_EXTRABYTES + len, deadline);
-    if(dsock_slow(sz < 0)) return -1;
-    if(sz > NACL_EXTRABYTES + len) {errno = EMSGSIZE; return -1;}
-    /* Store the nonce. */
-    memcpy(obj->recv_nonce, obj->buf1, crypto_secretbox_NONCEBYTES);
-    /* Decrypt and authenticate the message. */
-    size_t clen = crypto_secretbox_BOXZEROBYTES +
-        (sz - crypto_secretbox_NONCEBYTES);
-    memset(obj->buf2, 0, crypto_secretbox_BOXZEROBYTES);
-    memcpy(obj->buf2 + crypto_secretbox_BOXZEROBYTES,
-        obj->buf1 + crypto_secretbox_NONCEBYTES,
-        clen - crypto_secretbox_BOXZEROBYTES);
-    rc = crypto_secretbox_open(obj->buf1, obj->buf2, clen,
-        obj->recv_nonce, obj->key);
-    if(dsock_slow(rc < 0)) {errno = EACCES; return -1;}
-    /* Copy the message into user's buffer. */
-    sz = clen - crypto_secretbox_ZEROBYTES;
-    uint8_t *pos = obj->buf1 + crypto_secretbox_ZEROBYTES;
-    struct iolist *it = first;
-    while(1) {
-        size_t tocopy = sz < it->iol_len ? sz : it->iol_len;
-        if(it->iol_base) memcpy(it->iol_base, pos, tocopy);
-        sz -= tocopy;
-        if(sz == 0) break;
-        pos += it->iol_len;
-        it = it->iol_next;
+    /* Borrow a working buffer. Messages are decrypted in place. */
+    size_t nchunks = nacl_nchunks(obj, len);
+    size_t wirelen = MIN(nchunks, NACL_MAXCHUNKS) * NACL_TAGBYTES + len;
+    size_t hdrlen = obj->deltalen ? NACL_MAXHDRBYTES : 0;
+    uint8_t *buf = scratch_get(hdrlen + wirelen);
+    if(dsock_slow(!buf)) return -1;
+    ssize_t sz;
+    if(!obj->deltalen) {
+        /* Read the nonce and the chunks directly to where they are needed
+           for decryption. */
+        struct iolist ciol = {buf, wirelen, NULL, 0};
+        struct iolist niol = {obj->recv_nonce, obj->noncelen, &ciol, 0};
+        sz = mrecvl(obj->s, &niol, &ciol, deadline);
     }
-
-    return clen - crypto_secretbox_ZEROBYTES;
+    else {
+        sz = mrecv(obj->s, buf, hdrlen + wirelen, deadline);
+    }
+    if(dsock_fast(sz >= 0)) sz = nacl_decrypt(obj, buf, sz, first);
+    scratch_put(buf);
+    return sz;
 }
 
 static void nacl_hclose(struct hvfs *hvfs) {
@@ -210,8 +646,6 @@ static void nacl_hclose(struct hvfs *hvfs) {
         int rc = hclose(obj->s);
         dsock_assert(rc == 0);
     }
-    free(obj->buf1);
-    free(obj->buf2);
-    free(obj);
+    nacl_free(obj);
 }
 
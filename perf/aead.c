@@ -0,0 +1,70 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../aesgcm.h"
+#include "../chacha20.h"
+
+static int64_t nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+    size_t size = argc > 1 ? atol(argv[1]) : 64 * 1024;
+    int count = argc > 2 ? atoi(argv[2]) : 2000;
+    uint8_t key[32], nonce[12], tag[16];
+    size_t i;
+    for(i = 0; i != sizeof(key); ++i) key[i] = (uint8_t)(i * 13 + 1);
+    for(i = 0; i != sizeof(nonce); ++i) nonce[i] = (uint8_t)(i * 29 + 7);
+    struct aesgcm gcm;
+    aesgcm_init(&gcm, key);
+
+    /* Throughput of sealing messages of the given size. */
+    uint8_t *buf = malloc(size);
+    assert(buf);
+    memset(buf, 'x', size);
+    int j;
+    int64_t start = nanos();
+    for(j = 0; j != count; ++j)
+        chacha20poly1305_seal(tag, buf, buf, size, NULL, 0, nonce, key);
+    int64_t chacha = nanos() - start;
+    start = nanos();
+    for(j = 0; j != count; ++j)
+        aesgcm_seal(&gcm, tag, buf, buf, size, NULL, 0, nonce);
+    int64_t aes = nanos() - start;
+    double total = (double)size * count;
+    printf("chacha20-poly1305: %.2f GB/s\n", total / chacha);
+    printf("aes-256-gcm:       %.2f GB/s\n", total / aes);
+    aesgcm_term(&gcm);
+    free(buf);
+    return 0;
+}
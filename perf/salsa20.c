@@ -0,0 +1,72 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../salsa20.h"
+#include "../tweetnacl/tweetnacl.h"
+
+/* tweetnacl needs this to link but it's not used here. */
+void randombytes(uint8_t *buf, uint64_t len) {
+    (void)buf;
+    (void)len;
+    abort();
+}
+
+static int64_t nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+    size_t size = argc > 1 ? atol(argv[1]) : 1024 * 1024;
+    int count = argc > 2 ? atoi(argv[2]) : 100;
+    uint8_t key[32], nonce[24];
+    size_t i;
+    for(i = 0; i != sizeof(key); ++i) key[i] = (uint8_t)(i * 13 + 1);
+    for(i = 0; i != sizeof(nonce); ++i) nonce[i] = (uint8_t)(i * 29 + 7);
+    uint8_t *buf = malloc(size);
+    assert(buf);
+    memset(buf, 'x', size);
+    int j;
+    int refcount = count / 10 ? count / 10 : 1;
+    int64_t start = nanos();
+    for(j = 0; j != refcount; ++j)
+        crypto_stream_xsalsa20_xor(buf, buf, size, nonce, key);
+    int64_t ref = nanos() - start;
+    start = nanos();
+    for(j = 0; j != count; ++j)
+        xsalsa20_xor(buf, buf, size, nonce, 0, key);
+    int64_t opt = nanos() - start;
+    printf("tweetnacl: %.2f GB/s\n", (double)size * refcount / ref);
+    printf("xsalsa20:  %.2f GB/s\n", (double)size * count / opt);
+    free(buf);
+    return 0;
+}
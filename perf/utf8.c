@@ -0,0 +1,177 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../utf8.h"
+
+/* Straightforward decoder used as a reference. */
+static int refvalid(const uint8_t *s, size_t len) {
+    size_t i = 0;
+    while(i < len) {
+        uint32_t c = s[i];
+        size_t n;
+        uint32_t min;
+        if(c < 0x80) {i++; continue;}
+        else if((c & 0xe0) == 0xc0) {n = 1; c &= 0x1f; min = 0x80;}
+        else if((c & 0xf0) == 0xe0) {n = 2; c &= 0x0f; min = 0x800;}
+        else if((c & 0xf8) == 0xf0) {n = 3; c &= 0x07; min = 0x10000;}
+        else return 0;
+        if(i + n >= len) return 0;
+        size_t j;
+        for(j = 1; j <= n; ++j) {
+            if((s[i + j] & 0xc0) != 0x80) return 0;
+            c = (c << 6) | (s[i + j] & 0x3f);
+        }
+        if(c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) return 0;
+        i += n + 1;
+    }
+    return 1;
+}
+
+/* Encodes a random code point, biased towards the edges of the ranges. */
+static size_t randchar(uint8_t *s) {
+    static const uint32_t edges[] = {0x01, 0x7f, 0x80, 0x7ff, 0x800, 0xfff,
+        0x1000, 0xd7ff, 0xe000, 0xffff, 0x10000, 0x3ffff, 0x40000, 0x10ffff};
+    size_t nedges = sizeof(edges) / sizeof(edges[0]);
+    uint32_t c = rand() % 2 ? edges[rand() % nedges] :
+        (uint32_t)rand() % 0x110000;
+    if(c >= 0xd800 && c <= 0xdfff) c = 0xe9;
+    if(c < 0x80) {s[0] = c; return 1;}
+    if(c < 0x800) {
+        s[0] = 0xc0 | (c >> 6);
+        s[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+    if(c < 0x10000) {
+        s[0] = 0xe0 | (c >> 12);
+        s[1] = 0x80 | ((c >> 6) & 0x3f);
+        s[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+    s[0] = 0xf0 | (c >> 18);
+    s[1] = 0x80 | ((c >> 12) & 0x3f);
+    s[2] = 0x80 | ((c >> 6) & 0x3f);
+    s[3] = 0x80 | (c & 0x3f);
+    return 4;
+}
+
+static int valid(const uint8_t *s, size_t len, size_t split) {
+    struct utf8 u;
+    utf8_init(&u);
+    if(utf8_feed(&u, s, split) < 0) return 0;
+    if(utf8_feed(&u, s + split, len - split) < 0) return 0;
+    return utf8_done(&u) == 0;
+}
+
+static int64_t nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+    size_t size = argc > 1 ? atol(argv[1]) : 4 * 1024 * 1024;
+    int count = argc > 2 ? atoi(argv[2]) : 100;
+
+    /* Random byte strings biased towards interesting bytes, placed after
+       an ASCII run so that the vectorized prefix is exercised, checked
+       against the reference with all split points. */
+    static const uint8_t bytes[] = {0x41, 0x7f, 0x80, 0x8f, 0x90, 0x9f, 0xa0,
+        0xbf, 0xc0, 0xc1, 0xc2, 0xdf, 0xe0, 0xe1, 0xec, 0xed, 0xee, 0xef,
+        0xf0, 0xf1, 0xf3, 0xf4, 0xf5, 0xff};
+    uint8_t buf[64];
+    memset(buf, 'a', sizeof(buf));
+    srand(1);
+    int i;
+    for(i = 0; i != 1000000; ++i) {
+        size_t len = 40 + rand() % 8;
+        size_t j;
+        for(j = 40; j != len; ++j)
+            buf[j] = bytes[rand() % sizeof(bytes)];
+        int ref = refvalid(buf, len);
+        size_t split;
+        for(split = 36; split <= len; ++split)
+            assert(valid(buf, len, split) == ref);
+    }
+    /* Longer strings of random characters, half of them with one byte
+       damaged, so that whole blocks of text that is not ASCII are
+       validated. */
+    uint8_t text1[256];
+    for(i = 0; i != 300000; ++i) {
+        size_t len = 0;
+        size_t max = rand() % 240;
+        while(len < max) len += randchar(text1 + len);
+        if(len > 0 && rand() % 2)
+            text1[rand() % len] = bytes[rand() % sizeof(bytes)];
+        int ref = refvalid(text1, len);
+        assert(valid(text1, len, 0) == ref);
+        assert(valid(text1, len, len) == ref);
+        assert(valid(text1, len, rand() % (len + 1)) == ref);
+    }
+
+    uint8_t *text = malloc(size);
+    assert(text);
+    struct utf8 u;
+    int64_t start;
+    /* Plain ASCII. */
+    memset(text, 'x', size);
+    start = nanos();
+    for(i = 0; i != count; ++i) {
+        utf8_init(&u);
+        assert(utf8_feed(&u, text, size) == 0);
+    }
+    printf("ascii: %.2f GB/s\n", (double)size * count / (nanos() - start));
+    /* Mostly ASCII with a two-byte sequence every 64 bytes. */
+    size_t j;
+    for(j = 0; j + 64 <= size; j += 64) {
+        text[j] = 0xc3;
+        text[j + 1] = 0xa9;
+    }
+    start = nanos();
+    for(i = 0; i != count; ++i) {
+        utf8_init(&u);
+        assert(utf8_feed(&u, text, size) == 0);
+    }
+    printf("mixed: %.2f GB/s\n", (double)size * count / (nanos() - start));
+    /* No ASCII at all. Two-, three- and four-byte sequences in turns. */
+    static const uint8_t seq[] = {0xc3, 0xa9, 0xe2, 0x82, 0xac, 0xf0, 0x9f,
+        0x98, 0x80};
+    for(j = 0; j + sizeof(seq) <= size; j += sizeof(seq))
+        memcpy(text + j, seq, sizeof(seq));
+    for(; j != size; ++j) text[j] = 'x';
+    start = nanos();
+    for(i = 0; i != count; ++i) {
+        utf8_init(&u);
+        assert(utf8_feed(&u, text, size) == 0);
+    }
+    printf("non-ascii: %.2f GB/s\n", (double)size * count / (nanos() - start));
+    free(text);
+    return 0;
+}
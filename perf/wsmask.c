@@ -0,0 +1,91 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../wsmask.h"
+
+static void refmask(uint8_t *dst, const uint8_t *src, size_t len,
+      const uint8_t *mask, size_t pos) {
+    size_t i;
+    for(i = 0; i != len; ++i)
+        dst[i] = src[i] ^ mask[(pos + i) % 4];
+}
+
+static int64_t nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+    size_t size = argc > 1 ? atol(argv[1]) : 4 * 1024 * 1024;
+    int count = argc > 2 ? atoi(argv[2]) : 200;
+    const uint8_t mask[4] = {0x12, 0x34, 0x56, 0x78};
+
+    /* Check against the reference implementation with all combinations
+       of alignment, mask offset and tail length. */
+    uint8_t src[300], dst1[300], dst2[300];
+    size_t i, off, pos, len;
+    for(i = 0; i != sizeof(src); ++i) src[i] = (uint8_t)(i * 7 + 3);
+    for(off = 0; off != 32; ++off) {
+        for(pos = 0; pos != 4; ++pos) {
+            for(len = 0; len != 260; ++len) {
+                refmask(dst1 + off, src + off, len, mask, pos);
+                wsmask(dst2 + off, src + off, len, mask, pos);
+                assert(memcmp(dst1 + off, dst2 + off, len) == 0);
+            }
+        }
+    }
+    /* Masking split at arbitrary points gives the same result. */
+    refmask(dst1, src, sizeof(src), mask, 0);
+    memcpy(dst2, src, sizeof(src));
+    wsmask(dst2, dst2, 5, mask, 0);
+    wsmask(dst2 + 5, dst2 + 5, 98, mask, 5);
+    wsmask(dst2 + 103, dst2 + 103, sizeof(src) - 103, mask, 103);
+    assert(memcmp(dst1, dst2, sizeof(src)) == 0);
+
+    uint8_t *buf = malloc(size + 1);
+    assert(buf);
+    memset(buf, 'x', size + 1);
+    int j;
+    int64_t start = nanos();
+    for(j = 0; j != count; ++j)
+        refmask(buf + 1, buf + 1, size, mask, j);
+    int64_t ref = nanos() - start;
+    start = nanos();
+    for(j = 0; j != count; ++j)
+        wsmask(buf + 1, buf + 1, size, mask, j);
+    int64_t opt = nanos() - start;
+    double total = (double)size * count;
+    printf("byte-wise: %.2f GB/s\n", total / ref);
+    printf("wsmask:    %.2f GB/s\n", total / opt);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,342 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <string.h>
+
+#include "poly1305.h"
+#include "utils.h"
+
+static uint32_t poly1305_ld32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void poly1305_st32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+#if defined __SIZEOF_INT128__
+
+typedef unsigned __int128 poly1305_u128;
+
+#define POLY1305_M44 0xfffffffffffULL
+#define POLY1305_M42 0x3ffffffffffULL
+
+static uint64_t poly1305_ld64(const uint8_t *p) {
+    return (uint64_t)poly1305_ld32(p) | ((uint64_t)poly1305_ld32(p + 4) << 32);
+}
+
+static void poly1305_st64(uint8_t *p, uint64_t v) {
+    poly1305_st32(p, (uint32_t)v);
+    poly1305_st32(p + 4, (uint32_t)(v >> 32));
+}
+
+void poly1305_init(struct poly1305 *self, const uint8_t *key) {
+    /* Clamp r and split it into limbs. */
+    uint64_t t0 = poly1305_ld64(key);
+    uint64_t t1 = poly1305_ld64(key + 8);
+    self->r[0] = t0 & 0xffc0fffffffULL;
+    self->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+    self->r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+    self->h[0] = 0;
+    self->h[1] = 0;
+    self->h[2] = 0;
+    self->pad[0] = poly1305_ld64(key + 16);
+    self->pad[1] = poly1305_ld64(key + 24);
+    self->leftover = 0;
+}
+
+/* Processes whole 16-byte blocks. 'hibit' is the bit appended to each
+   block, it's zero only for the padded last block. */
+static void poly1305_blocks(struct poly1305 *self, const uint8_t *m,
+      size_t len, uint64_t hibit) {
+    uint64_t r0 = self->r[0], r1 = self->r[1], r2 = self->r[2];
+    uint64_t h0 = self->h[0], h1 = self->h[1], h2 = self->h[2];
+    /* Reduction modulo 2^130-5 folds the overflowing limbs back
+       multiplied by 5, the extra 4 accounts for limb sizes. */
+    uint64_t s1 = r1 * (5 << 2);
+    uint64_t s2 = r2 * (5 << 2);
+    while(len >= 16) {
+        uint64_t t0 = poly1305_ld64(m);
+        uint64_t t1 = poly1305_ld64(m + 8);
+        h0 += t0 & POLY1305_M44;
+        h1 += ((t0 >> 44) | (t1 << 20)) & POLY1305_M44;
+        h2 += ((t1 >> 24) & POLY1305_M42) | hibit;
+        /* h *= r */
+        poly1305_u128 d0 = (poly1305_u128)h0 * r0 + (poly1305_u128)h1 * s2 +
+            (poly1305_u128)h2 * s1;
+        poly1305_u128 d1 = (poly1305_u128)h0 * r1 + (poly1305_u128)h1 * r0 +
+            (poly1305_u128)h2 * s2;
+        poly1305_u128 d2 = (poly1305_u128)h0 * r2 + (poly1305_u128)h1 * r1 +
+            (poly1305_u128)h2 * r0;
+        /* Partial reduction. */
+        uint64_t c = (uint64_t)(d0 >> 44);
+        h0 = (uint64_t)d0 & POLY1305_M44;
+        d1 += c;
+        c = (uint64_t)(d1 >> 44);
+        h1 = (uint64_t)d1 & POLY1305_M44;
+        d2 += c;
+        c = (uint64_t)(d2 >> 42);
+        h2 = (uint64_t)d2 & POLY1305_M42;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= POLY1305_M44;
+        h1 += c;
+        m += 16;
+        len -= 16;
+    }
+    self->h[0] = h0;
+    self->h[1] = h1;
+    self->h[2] = h2;
+}
+
+#define POLY1305_HIBIT (1ULL << 40)
+
+static void poly1305_final(struct poly1305 *self, uint8_t *tag) {
+    uint64_t h0 = self->h[0], h1 = self->h[1], h2 = self->h[2];
+    /* Full carry. */
+    uint64_t c = h1 >> 44;
+    h1 &= POLY1305_M44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= POLY1305_M42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= POLY1305_M44;
+    h1 += c;
+    c = h1 >> 44;
+    h1 &= POLY1305_M44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= POLY1305_M42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= POLY1305_M44;
+    h1 += c;
+    /* Compute h - p and select it in constant time if h >= p. */
+    uint64_t g0 = h0 + 5;
+    c = g0 >> 44;
+    g0 &= POLY1305_M44;
+    uint64_t g1 = h1 + c;
+    c = g1 >> 44;
+    g1 &= POLY1305_M44;
+    uint64_t g2 = h2 + c - (1ULL << 42);
+    c = (g2 >> 63) - 1;
+    h0 = (h0 & ~c) | (g0 & c);
+    h1 = (h1 & ~c) | (g1 & c);
+    h2 = (h2 & ~c) | (g2 & c);
+    /* h = h + pad */
+    uint64_t t0 = self->pad[0];
+    uint64_t t1 = self->pad[1];
+    h0 += t0 & POLY1305_M44;
+    c = h0 >> 44;
+    h0 &= POLY1305_M44;
+    h1 += (((t0 >> 44) | (t1 << 20)) & POLY1305_M44) + c;
+    c = h1 >> 44;
+    h1 &= POLY1305_M44;
+    h2 += ((t1 >> 24) & POLY1305_M42) + c;
+    h2 &= POLY1305_M42;
+    poly1305_st64(tag, h0 | (h1 << 44));
+    poly1305_st64(tag + 8, (h1 >> 20) | (h2 << 24));
+}
+
+#else
+
+void poly1305_init(struct poly1305 *self, const uint8_t *key) {
+    /* Clamp r and split it into limbs. */
+    self->r[0] = poly1305_ld32(key) & 0x3ffffff;
+    self->r[1] = (poly1305_ld32(key + 3) >> 2) & 0x3ffff03;
+    self->r[2] = (poly1305_ld32(key + 6) >> 4) & 0x3ffc0ff;
+    self->r[3] = (poly1305_ld32(key + 9) >> 6) & 0x3f03fff;
+    self->r[4] = (poly1305_ld32(key + 12) >> 8) & 0x00fffff;
+    int i;
+    for(i = 0; i != 5; ++i) self->h[i] = 0;
+    for(i = 0; i != 4; ++i) self->pad[i] = poly1305_ld32(key + 16 + 4 * i);
+    self->leftover = 0;
+}
+
+/* Processes whole 16-byte blocks. 'hibit' is the bit appended to each
+   block, it's zero only for the padded last block. */
+static void poly1305_blocks(struct poly1305 *self, const uint8_t *m,
+      size_t len, uint32_t hibit) {
+    uint32_t r0 = self->r[0], r1 = self->r[1], r2 = self->r[2],
+        r3 = self->r[3], r4 = self->r[4];
+    uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = self->h[0], h1 = self->h[1], h2 = self->h[2],
+        h3 = self->h[3], h4 = self->h[4];
+    while(len >= 16) {
+        h0 += poly1305_ld32(m) & 0x3ffffff;
+        h1 += (poly1305_ld32(m + 3) >> 2) & 0x3ffffff;
+        h2 += (poly1305_ld32(m + 6) >> 4) & 0x3ffffff;
+        h3 += (poly1305_ld32(m + 9) >> 6) & 0x3ffffff;
+        h4 += (poly1305_ld32(m + 12) >> 8) | hibit;
+        /* h *= r */
+        uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 +
+            (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 +
+            (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 +
+            (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 +
+            (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 +
+            (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+        /* Partial reduction. */
+        uint32_t c = (uint32_t)(d0 >> 26);
+        h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c;
+        c = (uint32_t)(d1 >> 26);
+        h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c;
+        c = (uint32_t)(d2 >> 26);
+        h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c;
+        c = (uint32_t)(d3 >> 26);
+        h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c;
+        c = (uint32_t)(d4 >> 26);
+        h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5;
+        c = h0 >> 26;
+        h0 &= 0x3ffffff;
+        h1 += c;
+        m += 16;
+        len -= 16;
+    }
+    self->h[0] = h0;
+    self->h[1] = h1;
+    self->h[2] = h2;
+    self->h[3] = h3;
+    self->h[4] = h4;
+}
+
+#define POLY1305_HIBIT (1UL << 24)
+
+static void poly1305_final(struct poly1305 *self, uint8_t *tag) {
+    uint32_t h0 = self->h[0], h1 = self->h[1], h2 = self->h[2],
+        h3 = self->h[3], h4 = self->h[4];
+    /* Full carry. */
+    uint32_t c = h1 >> 26;
+    h1 &= 0x3ffffff;
+    h2 += c;
+    c = h2 >> 26;
+    h2 &= 0x3ffffff;
+    h3 += c;
+    c = h3 >> 26;
+    h3 &= 0x3ffffff;
+    h4 += c;
+    c = h4 >> 26;
+    h4 &= 0x3ffffff;
+    h0 += c * 5;
+    c = h0 >> 26;
+    h0 &= 0x3ffffff;
+    h1 += c;
+    /* Compute h - p and select it in constant time if h >= p. */
+    uint32_t g0 = h0 + 5;
+    c = g0 >> 26;
+    g0 &= 0x3ffffff;
+    uint32_t g1 = h1 + c;
+    c = g1 >> 26;
+    g1 &= 0x3ffffff;
+    uint32_t g2 = h2 + c;
+    c = g2 >> 26;
+    g2 &= 0x3ffffff;
+    uint32_t g3 = h3 + c;
+    c = g3 >> 26;
+    g3 &= 0x3ffffff;
+    uint32_t g4 = h4 + c - (1UL << 26);
+    uint32_t mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+    /* Pack into 32-bit words and add pad. */
+    h0 = h0 | (h1 << 26);
+    h1 = (h1 >> 6) | (h2 << 20);
+    h2 = (h2 >> 12) | (h3 << 14);
+    h3 = (h3 >> 18) | (h4 << 8);
+    uint64_t f = (uint64_t)h0 + self->pad[0];
+    poly1305_st32(tag, (uint32_t)f);
+    f = (uint64_t)h1 + self->pad[1] + (f >> 32);
+    poly1305_st32(tag + 4, (uint32_t)f);
+    f = (uint64_t)h2 + self->pad[2] + (f >> 32);
+    poly1305_st32(tag + 8, (uint32_t)f);
+    f = (uint64_t)h3 + self->pad[3] + (f >> 32);
+    poly1305_st32(tag + 12, (uint32_t)f);
+}
+
+#endif
+
+void poly1305_update(struct poly1305 *self, const uint8_t *m, size_t len) {
+    if(!len) return;
+    /* Complete the partial block from the last call, if any. */
+    if(self->leftover) {
+        size_t n = MIN(16 - self->leftover, len);
+        memcpy(self->buf + self->leftover, m, n);
+        self->leftover += n;
+        m += n;
+        len -= n;
+        if(self->leftover < 16) return;
+        poly1305_blocks(self, self->buf, 16, POLY1305_HIBIT);
+        self->leftover = 0;
+    }
+    size_t n = len & ~(size_t)15;
+    poly1305_blocks(self, m, n, POLY1305_HIBIT);
+    /* Store the rest for later. */
+    memcpy(self->buf, m + n, len - n);
+    self->leftover = len - n;
+}
+
+void poly1305_finish(struct poly1305 *self, uint8_t *tag) {
+    /* Last partial block is padded with 1 followed by zeros. */
+    if(self->leftover) {
+        self->buf[self->leftover] = 1;
+        memset(self->buf + self->leftover + 1, 0, 15 - self->leftover);
+        poly1305_blocks(self, self->buf, 16, 0);
+    }
+    poly1305_final(self, tag);
+    memset(self, 0, sizeof(struct poly1305));
+}
+
+void poly1305(uint8_t *tag, const uint8_t *m, size_t len,
+      const uint8_t *key) {
+    struct poly1305 st;
+    poly1305_init(&st, key);
+    poly1305_update(&st, m, len);
+    poly1305_finish(&st, tag);
+}
+
+int poly1305_verify(const uint8_t *tag, const uint8_t *m, size_t len,
+      const uint8_t *key) {
+    uint8_t computed[16];
+    poly1305(computed, m, len, key);
+    uint8_t diff = 0;
+    int i;
+    for(i = 0; i != 16; ++i) diff |= computed[i] ^ tag[i];
+    return diff ? -1 : 0;
+}
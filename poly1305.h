@@ -0,0 +1,63 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef DSOCK_POLY1305_H_INCLUDED
+#define DSOCK_POLY1305_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Poly1305 one-time authenticator. With 128-bit multiplication available
+   the accumulator is kept in three 44-bit limbs, otherwise in five 26-bit
+   limbs. */
+struct poly1305 {
+#if defined __SIZEOF_INT128__
+    uint64_t r[3];
+    uint64_t h[3];
+    uint64_t pad[2];
+#else
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+#endif
+    size_t leftover;
+    uint8_t buf[16];
+};
+
+/* Incremental interface. 'key' is 32 bytes long, 'tag' is 16 bytes long. */
+void poly1305_init(struct poly1305 *self, const uint8_t *key);
+void poly1305_update(struct poly1305 *self, const uint8_t *m, size_t len);
+void poly1305_finish(struct poly1305 *self, uint8_t *tag);
+
+/* Computes the authenticator of the message in one go. */
+void poly1305(uint8_t *tag, const uint8_t *m, size_t len,
+    const uint8_t *key);
+
+/* Returns 0 if the tag matches the message, -1 otherwise. The comparison
+   takes the same time irrespective of where the tags differ. */
+int poly1305_verify(const uint8_t *tag, const uint8_t *m, size_t len,
+    const uint8_t *key);
+
+#endif
+
@@ -0,0 +1,328 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <string.h>
+
+#include "poly1305.h"
+#include "salsa20.h"
+#include "utils.h"
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#define SALSA20_X86 1
+#include <immintrin.h>
+#endif
+
+/* The rounds are written once in terms of ADD, XOR and ROTL so that
+   the same code serves the scalar kernel, where each variable holds one
+   word of one block, and the vector kernels, where each variable holds
+   the same word of several consecutive blocks. */
+
+#define SALSA20_QR(ADD, XOR, ROTL, a, b, c, d) \
+    b = XOR(b, ROTL(ADD(a, d), 7));\
+    c = XOR(c, ROTL(ADD(b, a), 9));\
+    d = XOR(d, ROTL(ADD(c, b), 13));\
+    a = XOR(a, ROTL(ADD(d, c), 18));
+
+#define SALSA20_ROUNDS(ADD, XOR, ROTL, x) \
+    do {\
+        int r_;\
+        for(r_ = 0; r_ != 10; ++r_) {\
+            SALSA20_QR(ADD, XOR, ROTL, x[0], x[4], x[8], x[12])\
+            SALSA20_QR(ADD, XOR, ROTL, x[5], x[9], x[13], x[1])\
+            SALSA20_QR(ADD, XOR, ROTL, x[10], x[14], x[2], x[6])\
+            SALSA20_QR(ADD, XOR, ROTL, x[15], x[3], x[7], x[11])\
+            SALSA20_QR(ADD, XOR, ROTL, x[0], x[1], x[2], x[3])\
+            SALSA20_QR(ADD, XOR, ROTL, x[5], x[6], x[7], x[4])\
+            SALSA20_QR(ADD, XOR, ROTL, x[10], x[11], x[8], x[9])\
+            SALSA20_QR(ADD, XOR, ROTL, x[15], x[12], x[13], x[14])\
+        }\
+    } while(0)
+
+#define SALSA20_ADD(a, b) ((a) + (b))
+#define SALSA20_XOR(a, b) ((a) ^ (b))
+#define SALSA20_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static uint32_t salsa20_ld32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void salsa20_st32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+/* Fills in the initial state. Words 8 and 9 hold the block counter. */
+static void salsa20_init(uint32_t *s, const uint8_t *in, const uint8_t *key) {
+    s[0] = 0x61707865;
+    s[5] = 0x3320646e;
+    s[10] = 0x79622d32;
+    s[15] = 0x6b206574;
+    int i;
+    for(i = 0; i != 4; ++i) {
+        s[1 + i] = salsa20_ld32(key + 4 * i);
+        s[11 + i] = salsa20_ld32(key + 16 + 4 * i);
+        s[6 + i] = salsa20_ld32(in + 4 * i);
+    }
+}
+
+/* Generates one 64-byte keystream block. */
+static void salsa20_block(uint8_t *out, const uint32_t *s) {
+    uint32_t x[16];
+    memcpy(x, s, sizeof(x));
+    SALSA20_ROUNDS(SALSA20_ADD, SALSA20_XOR, SALSA20_ROTL, x);
+    int i;
+    for(i = 0; i != 16; ++i)
+        salsa20_st32(out + 4 * i, x[i] + s[i]);
+}
+
+/* Each vector kernel processes as many groups of blocks as possible,
+   advances the block counter in the state and returns number of bytes
+   processed. */
+
+#if defined SALSA20_X86
+
+#define SALSA20_ADD8(a, b) _mm256_add_epi32(a, b)
+#define SALSA20_XOR8(a, b) _mm256_xor_si256(a, b)
+#define SALSA20_ROTL8(v, n) \
+    _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+
+/* Stores 32 bytes of output at 'off', XORed with the input if any. */
+__attribute__((target("avx2")))
+static void salsa20_out8(uint8_t *dst, const uint8_t *src, size_t off,
+      __m256i v) {
+    if(src) v = _mm256_xor_si256(v,
+        _mm256_loadu_si256((const __m256i*)(src + off)));
+    _mm256_storeu_si256((__m256i*)(dst + off), v);
+}
+
+__attribute__((target("avx2")))
+static size_t salsa20_avx2(uint8_t *dst, const uint8_t *src, size_t len,
+      uint32_t *s) {
+    uint64_t ctr = (uint64_t)s[8] | ((uint64_t)s[9] << 32);
+    size_t pos = 0;
+    for(; pos + 512 <= len; pos += 512, ctr += 8) {
+        __m256i x[16], orig[16];
+        int i;
+        for(i = 0; i != 16; ++i) orig[i] = _mm256_set1_epi32((int)s[i]);
+        orig[8] = _mm256_set_epi32(
+            (int)(ctr + 7), (int)(ctr + 6), (int)(ctr + 5), (int)(ctr + 4),
+            (int)(ctr + 3), (int)(ctr + 2), (int)(ctr + 1), (int)ctr);
+        orig[9] = _mm256_set_epi32(
+            (int)((ctr + 7) >> 32), (int)((ctr + 6) >> 32),
+            (int)((ctr + 5) >> 32), (int)((ctr + 4) >> 32),
+            (int)((ctr + 3) >> 32), (int)((ctr + 2) >> 32),
+            (int)((ctr + 1) >> 32), (int)(ctr >> 32));
+        memcpy(x, orig, sizeof(x));
+        SALSA20_ROUNDS(SALSA20_ADD8, SALSA20_XOR8, SALSA20_ROTL8, x);
+        for(i = 0; i != 16; ++i) x[i] = _mm256_add_epi32(x[i], orig[i]);
+        /* Transpose each group of four words. Low 128-bit half holds
+           blocks 0-3, high half holds blocks 4-7. */
+        __m256i t[16];
+        int g;
+        for(g = 0; g != 4; ++g) {
+            __m256i *a = x + 4 * g;
+            __m256i t0 = _mm256_unpacklo_epi32(a[0], a[1]);
+            __m256i t1 = _mm256_unpacklo_epi32(a[2], a[3]);
+            __m256i t2 = _mm256_unpackhi_epi32(a[0], a[1]);
+            __m256i t3 = _mm256_unpackhi_epi32(a[2], a[3]);
+            t[g] = _mm256_unpacklo_epi64(t0, t1);
+            t[4 + g] = _mm256_unpackhi_epi64(t0, t1);
+            t[8 + g] = _mm256_unpacklo_epi64(t2, t3);
+            t[12 + g] = _mm256_unpackhi_epi64(t2, t3);
+        }
+        /* Combine the halves into 32-byte pieces of the output blocks. */
+        int j;
+        for(j = 0; j != 4; ++j) {
+            __m256i *b = t + 4 * j;
+            salsa20_out8(dst, src, pos + 64 * j,
+                _mm256_permute2x128_si256(b[0], b[1], 0x20));
+            salsa20_out8(dst, src, pos + 64 * j + 32,
+                _mm256_permute2x128_si256(b[2], b[3], 0x20));
+            salsa20_out8(dst, src, pos + 64 * (j + 4),
+                _mm256_permute2x128_si256(b[0], b[1], 0x31));
+            salsa20_out8(dst, src, pos + 64 * (j + 4) + 32,
+                _mm256_permute2x128_si256(b[2], b[3], 0x31));
+        }
+    }
+    s[8] = (uint32_t)ctr;
+    s[9] = (uint32_t)(ctr >> 32);
+    return pos;
+}
+
+static int salsa20_hasavx2(void) {
+    static int avx2 = -1;
+    if(dsock_slow(avx2 < 0)) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return avx2;
+}
+
+#endif
+
+#if defined __SSE2__
+
+#include <emmintrin.h>
+
+#define SALSA20_ADD4(a, b) _mm_add_epi32(a, b)
+#define SALSA20_XOR4(a, b) _mm_xor_si128(a, b)
+#define SALSA20_ROTL4(v, n) \
+    _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+static void salsa20_out4(uint8_t *dst, const uint8_t *src, size_t off,
+      __m128i v) {
+    if(src) v = _mm_xor_si128(v, _mm_loadu_si128((const __m128i*)(src + off)));
+    _mm_storeu_si128((__m128i*)(dst + off), v);
+}
+
+static size_t salsa20_sse2(uint8_t *dst, const uint8_t *src, size_t len,
+      uint32_t *s) {
+    uint64_t ctr = (uint64_t)s[8] | ((uint64_t)s[9] << 32);
+    size_t pos = 0;
+    for(; pos + 256 <= len; pos += 256, ctr += 4) {
+        __m128i x[16], orig[16];
+        int i;
+        for(i = 0; i != 16; ++i) orig[i] = _mm_set1_epi32((int)s[i]);
+        orig[8] = _mm_set_epi32((int)(ctr + 3), (int)(ctr + 2),
+            (int)(ctr + 1), (int)ctr);
+        orig[9] = _mm_set_epi32((int)((ctr + 3) >> 32),
+            (int)((ctr + 2) >> 32), (int)((ctr + 1) >> 32), (int)(ctr >> 32));
+        memcpy(x, orig, sizeof(x));
+        SALSA20_ROUNDS(SALSA20_ADD4, SALSA20_XOR4, SALSA20_ROTL4, x);
+        for(i = 0; i != 16; ++i) x[i] = _mm_add_epi32(x[i], orig[i]);
+        /* Transpose each group of four words into four blocks. */
+        int g;
+        for(g = 0; g != 4; ++g) {
+            __m128i *a = x + 4 * g;
+            __m128i t0 = _mm_unpacklo_epi32(a[0], a[1]);
+            __m128i t1 = _mm_unpacklo_epi32(a[2], a[3]);
+            __m128i t2 = _mm_unpackhi_epi32(a[0], a[1]);
+            __m128i t3 = _mm_unpackhi_epi32(a[2], a[3]);
+            salsa20_out4(dst, src, pos + 16 * g,
+                _mm_unpacklo_epi64(t0, t1));
+            salsa20_out4(dst, src, pos + 64 + 16 * g,
+                _mm_unpackhi_epi64(t0, t1));
+            salsa20_out4(dst, src, pos + 128 + 16 * g,
+                _mm_unpacklo_epi64(t2, t3));
+            salsa20_out4(dst, src, pos + 192 + 16 * g,
+                _mm_unpackhi_epi64(t2, t3));
+        }
+    }
+    s[8] = (uint32_t)ctr;
+    s[9] = (uint32_t)(ctr >> 32);
+    return pos;
+}
+
+#endif
+
+/* Processes the data with state already set up. */
+static void salsa20_run(uint8_t *dst, const uint8_t *src, size_t len,
+      uint32_t *s) {
+    size_t i = 0;
+#if defined SALSA20_X86
+    if(len >= 512 && salsa20_hasavx2())
+        i = salsa20_avx2(dst, src, len, s);
+#endif
+#if defined __SSE2__
+    i += salsa20_sse2(dst + i, src ? src + i : NULL, len - i, s);
+#endif
+    /* Portable block-at-a-time fallback, also used for the tail. */
+    while(i != len) {
+        uint8_t ks[64];
+        salsa20_block(ks, s);
+        if(++s[8] == 0) s[9]++;
+        size_t n = MIN(len - i, 64);
+        size_t j;
+        if(src)
+            for(j = 0; j != n; ++j) dst[i + j] = src[i + j] ^ ks[j];
+        else
+            memcpy(dst + i, ks, n);
+        i += n;
+    }
+}
+
+void salsa20_xor(uint8_t *dst, const uint8_t *src, size_t len,
+      const uint8_t *nonce, uint64_t ic, const uint8_t *key) {
+    uint8_t in[16];
+    memcpy(in, nonce, 8);
+    salsa20_st32(in + 8, (uint32_t)ic);
+    salsa20_st32(in + 12, (uint32_t)(ic >> 32));
+    uint32_t s[16];
+    salsa20_init(s, in, key);
+    salsa20_run(dst, src, len, s);
+}
+
+void hsalsa20(uint8_t *out, const uint8_t *in, const uint8_t *key) {
+    uint32_t x[16];
+    salsa20_init(x, in, key);
+    SALSA20_ROUNDS(SALSA20_ADD, SALSA20_XOR, SALSA20_ROTL, x);
+    /* Unlike the keystream block, the input is not added back. */
+    static const int idx[8] = {0, 5, 10, 15, 6, 7, 8, 9};
+    int i;
+    for(i = 0; i != 8; ++i)
+        salsa20_st32(out + 4 * i, x[idx[i]]);
+}
+
+void xsalsa20_xor(uint8_t *dst, const uint8_t *src, size_t len,
+      const uint8_t *nonce, uint64_t ic, const uint8_t *key) {
+    uint8_t subkey[32];
+    hsalsa20(subkey, nonce, key);
+    salsa20_xor(dst, src, len, nonce + 16, ic, subkey);
+}
+
+/* First 32 bytes of the keystream are used as the one-time authenticator
+   key, the rest encrypts the message. */
+static void xsalsa20poly1305_xor(uint8_t *dst, const uint8_t *src,
+      size_t len, const uint8_t *block, const uint8_t *nonce,
+      const uint8_t *subkey) {
+    size_t head = MIN(len, 32);
+    size_t i;
+    for(i = 0; i != head; ++i) dst[i] = src[i] ^ block[32 + i];
+    if(len > 32)
+        salsa20_xor(dst + 32, src + 32, len - 32, nonce + 16, 1, subkey);
+}
+
+void xsalsa20poly1305_seal(uint8_t *tag, uint8_t *dst, const uint8_t *src,
+      size_t len, const uint8_t *nonce, const uint8_t *key) {
+    uint8_t subkey[32];
+    hsalsa20(subkey, nonce, key);
+    uint8_t block[64];
+    salsa20_xor(block, NULL, sizeof(block), nonce + 16, 0, subkey);
+    xsalsa20poly1305_xor(dst, src, len, block, nonce, subkey);
+    poly1305(tag, dst, len, block);
+}
+
+int xsalsa20poly1305_open(uint8_t *dst, const uint8_t *src, size_t len,
+      const uint8_t *tag, const uint8_t *nonce, const uint8_t *key) {
+    uint8_t subkey[32];
+    hsalsa20(subkey, nonce, key);
+    uint8_t block[64];
+    salsa20_xor(block, NULL, sizeof(block), nonce + 16, 0, subkey);
+    if(dsock_slow(poly1305_verify(tag, src, len, block) != 0)) return -1;
+    xsalsa20poly1305_xor(dst, src, len, block, nonce, subkey);
+    return 0;
+}
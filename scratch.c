@@ -0,0 +1,141 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "dsock.h"
+#include "scratch.h"
+#include "utils.h"
+
+/* Total size of idle buffers kept by a thread unless changed by
+   dsock_scratchlimit(). */
+#define SCRATCH_DEFLIMIT (1024 * 1024)
+
+/* Maximum number of idle buffers kept by a thread. */
+#define SCRATCH_MAXIDLE 8
+
+/* Allocations are rounded up to this size so that buffers can be reused
+   for messages of slightly different sizes. */
+#define SCRATCH_GRANULARITY 4096
+
+struct scratch_hdr {
+    struct scratch_hdr *next;
+    size_t len;
+};
+
+struct scratch_pool {
+    /* Idle buffers, sorted by size, smallest first. */
+    struct scratch_hdr *idle;
+    size_t nidle;
+    size_t idlelen;
+    size_t limit;
+    int registered;
+};
+
+static __thread struct scratch_pool scratch_pool = {
+    NULL, 0, 0, SCRATCH_DEFLIMIT, 0};
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+/* Releases buffers from the end of the idle list until the pool fits
+   within its limits. Those are the biggest ones. */
+static void scratch_trim(struct scratch_pool *pool, size_t limit,
+      size_t maxidle) {
+    while(pool->idlelen > limit || pool->nidle > maxidle) {
+        struct scratch_hdr **it = &pool->idle;
+        while((*it)->next) it = &(*it)->next;
+        pool->idlelen -= (*it)->len;
+        pool->nidle--;
+        free(*it);
+        *it = NULL;
+    }
+}
+
+/* Idle buffers are released when the thread exits. */
+static void scratch_destroy(void *arg) {
+    scratch_trim(arg, 0, 0);
+}
+
+static void scratch_init(void) {
+    int rc = pthread_key_create(&scratch_key, scratch_destroy);
+    dsock_assert(rc == 0);
+}
+
+void *scratch_get(size_t len) {
+    struct scratch_pool *pool = &scratch_pool;
+    /* Smallest idle buffer that is big enough. */
+    struct scratch_hdr **it;
+    for(it = &pool->idle; *it; it = &(*it)->next) {
+        if((*it)->len >= len) {
+            struct scratch_hdr *hdr = *it;
+            *it = hdr->next;
+            pool->idlelen -= hdr->len;
+            pool->nidle--;
+            return hdr + 1;
+        }
+    }
+    /* None available. Allocate a new one. */
+    size_t alloclen = len + SCRATCH_GRANULARITY - 1;
+    if(dsock_slow(alloclen < len)) {errno = ENOMEM; return NULL;}
+    alloclen -= alloclen % SCRATCH_GRANULARITY;
+    if(dsock_slow(alloclen > SIZE_MAX - sizeof(struct scratch_hdr))) {
+        errno = ENOMEM; return NULL;}
+    struct scratch_hdr *hdr = malloc(sizeof(struct scratch_hdr) + alloclen);
+    if(dsock_slow(!hdr)) {errno = ENOMEM; return NULL;}
+    hdr->len = alloclen;
+    return hdr + 1;
+}
+
+void scratch_put(void *buf) {
+    if(!buf) return;
+    int err = errno;
+    struct scratch_pool *pool = &scratch_pool;
+    struct scratch_hdr *hdr = (struct scratch_hdr*)buf - 1;
+    /* Buffers bigger than the limit are not worth keeping. */
+    if(dsock_slow(hdr->len > pool->limit)) {free(hdr); goto done;}
+    if(dsock_slow(!pool->registered)) {
+        pthread_once(&scratch_once, scratch_init);
+        int rc = pthread_setspecific(scratch_key, pool);
+        if(dsock_slow(rc != 0)) {free(hdr); goto done;}
+        pool->registered = 1;
+    }
+    struct scratch_hdr **it = &pool->idle;
+    while(*it && (*it)->len < hdr->len) it = &(*it)->next;
+    hdr->next = *it;
+    *it = hdr;
+    pool->idlelen += hdr->len;
+    pool->nidle++;
+    scratch_trim(pool, pool->limit, SCRATCH_MAXIDLE);
+done:
+    errno = err;
+}
+
+void dsock_scratchlimit(size_t limit) {
+    struct scratch_pool *pool = &scratch_pool;
+    pool->limit = limit;
+    scratch_trim(pool, pool->limit, SCRATCH_MAXIDLE);
+}
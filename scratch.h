@@ -0,0 +1,42 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef DSOCK_SCRATCH_H_INCLUDED
+#define DSOCK_SCRATCH_H_INCLUDED
+
+#include <stddef.h>
+
+/* Scratch buffers are shared by all the sockets in the thread. A socket
+   borrows a buffer for the duration of a single operation and returns it
+   afterwards, even if the operation blocks in between. Returned buffers
+   are kept for reuse as long as their total size doesn't exceed the limit
+   set by dsock_scratchlimit(), bigger ones are released to the system. */
+
+/* Returns a buffer of at least 'len' bytes. Fails with ENOMEM. */
+void *scratch_get(size_t len);
+
+/* Returns the buffer to the pool. NULL is ignored. Doesn't modify errno. */
+void scratch_put(void *buf);
+
+#endif
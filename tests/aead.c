@@ -0,0 +1,168 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../aesgcm.h"
+#include "../chacha20.h"
+
+static size_t unhex(uint8_t *dst, const char *src) {
+    size_t n = 0;
+    while(src[0] && src[1]) {
+        unsigned v;
+        sscanf(src, "%2x", &v);
+        dst[n++] = (uint8_t)v;
+        src += 2;
+    }
+    return n;
+}
+
+static void aesgcm_check(const char *k, const char *iv, const char *p,
+      const char *a, const char *c, const char *t) {
+    uint8_t key[32], nonce[12], pt[64], aad[32], ct[64], exp[64], tag[16];
+    uint8_t exptag[16];
+    unhex(key, k);
+    unhex(nonce, iv);
+    size_t len = unhex(pt, p);
+    size_t aadlen = unhex(aad, a);
+    assert(unhex(exp, c) == len);
+    unhex(exptag, t);
+    struct aesgcm gcm;
+    aesgcm_init(&gcm, key);
+    aesgcm_seal(&gcm, tag, ct, pt, len, aad, aadlen, nonce);
+    assert(memcmp(ct, exp, len) == 0 && memcmp(tag, exptag, 16) == 0);
+    assert(aesgcm_open(&gcm, ct, ct, len, tag, aad, aadlen, nonce) == 0);
+    assert(memcmp(ct, pt, len) == 0);
+    tag[15] ^= 0x80;
+    memcpy(ct, exp, len);
+    assert(aesgcm_open(&gcm, pt, ct, len, tag, aad, aadlen, nonce) == -1);
+    aesgcm_term(&gcm);
+}
+
+int main() {
+    uint8_t key[32], nonce[12], aad[32], pt[128], ct[128], exp[128];
+    uint8_t tag[16], exptag[16];
+    size_t i;
+
+    /* ChaCha20 encryption, RFC 8439, section 2.4.2. */
+    const char *sunscreen = "Ladies and Gentlemen of the class of '99: "
+        "If I could offer you only one tip for the future, sunscreen would "
+        "be it.";
+    size_t len = strlen(sunscreen);
+    for(i = 0; i != 32; ++i) key[i] = (uint8_t)i;
+    unhex(nonce, "000000000000004a00000000");
+    assert(unhex(exp, "6e2e359a2568f98041ba0728dd0d6981"
+        "e97e7aec1d4360c20a27afccfd9fae0b"
+        "f91b65c5524733ab8f593dabcd62b357"
+        "1639d624e65152ab8f530c359f0861d8"
+        "07ca0dbf500d6a6156a38e088a22b65e"
+        "52bc514d16ccf806818ce91ab7793736"
+        "5af90bbf74a35be6b40b8eedf2785e42"
+        "874d") == len);
+    chacha20_xor(ct, (const uint8_t*)sunscreen, len, nonce, 1, key);
+    assert(memcmp(ct, exp, len) == 0);
+
+    /* ChaCha20-Poly1305 AEAD, RFC 8439, section 2.8.2. */
+    for(i = 0; i != 32; ++i) key[i] = (uint8_t)(0x80 + i);
+    unhex(nonce, "070000004041424344454647");
+    size_t aadlen = unhex(aad, "50515253c0c1c2c3c4c5c6c7");
+    assert(unhex(exp, "d31a8d34648e60db7b86afbc53ef7ec2"
+        "a4aded51296e08fea9e2b5a736ee62d6"
+        "3dbea45e8ca9671282fafb69da92728b"
+        "1a71de0a9e060b2905d6a5b67ecd3b36"
+        "92ddbd7f2d778b8c9803aee328091b58"
+        "fab324e4fad675945585808b4831d7bc"
+        "3ff4def08e4b7a9de576d26586cec64b"
+        "6116") == len);
+    unhex(exptag, "1ae10b594f09e26a7e902ecbd0600691");
+    chacha20poly1305_seal(tag, ct, (const uint8_t*)sunscreen, len,
+        aad, aadlen, nonce, key);
+    assert(memcmp(ct, exp, len) == 0 && memcmp(tag, exptag, 16) == 0);
+    assert(chacha20poly1305_open(pt, ct, len, tag, aad, aadlen,
+        nonce, key) == 0);
+    assert(memcmp(pt, sunscreen, len) == 0);
+    ct[len - 1] ^= 1;
+    assert(chacha20poly1305_open(pt, ct, len, tag, aad, aadlen,
+        nonce, key) == -1);
+    ct[len - 1] ^= 1;
+    aad[0] ^= 1;
+    assert(chacha20poly1305_open(pt, ct, len, tag, aad, aadlen,
+        nonce, key) == -1);
+
+    /* AES-256-GCM, test cases 13 to 16 from the GCM specification. */
+    const char *zero = "0000000000000000000000000000000000000000000000000000"
+        "000000000000";
+    aesgcm_check(zero, "000000000000000000000000", "", "", "",
+        "530f8afbc74536b9a963b4f1c4cb738b");
+    aesgcm_check(zero, "000000000000000000000000",
+        "00000000000000000000000000000000", "",
+        "cea7403d4d606b6e074ec5d3baf39d18",
+        "d0d1c8a799996bf0265b98b5d48ab919");
+    const char *k = "feffe9928665731c6d6a8f9467308308"
+        "feffe9928665731c6d6a8f9467308308";
+    aesgcm_check(k, "cafebabefacedbaddecaf888",
+        "d9313225f88406e5a55909c5aff5269a"
+        "86a7a9531534f7da2e4c303d8a318a72"
+        "1c3c0c95956809532fcf0e2449a6b525"
+        "b16aedf5aa0de657ba637b391aafd255", "",
+        "522dc1f099567d07f47f37a32a84427d"
+        "643a8cdcbfe5c0c97598a2bd2555d1aa"
+        "8cb08e48590dbb3da7b08b1056828838"
+        "c5f61e6393ba7a0abcc9f662898015ad",
+        "b094dac5d93471bdec1a502270e3cc6c");
+    aesgcm_check(k, "cafebabefacedbaddecaf888",
+        "d9313225f88406e5a55909c5aff5269a"
+        "86a7a9531534f7da2e4c303d8a318a72"
+        "1c3c0c95956809532fcf0e2449a6b525"
+        "b16aedf5aa0de657ba637b39",
+        "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+        "522dc1f099567d07f47f37a32a84427d"
+        "643a8cdcbfe5c0c97598a2bd2555d1aa"
+        "8cb08e48590dbb3da7b08b1056828838"
+        "c5f61e6393ba7a0abcc9f662",
+        "76fc6ece0f4e1768cddf8853bb2d551b");
+
+    /* Chain tags over messages of all lengths up to 600 bytes. The result
+       is the same whether AES-NI is used or not (see tests/aead_sw). */
+    static uint8_t m[600], c[600];
+    for(i = 0; i != sizeof(m); ++i) m[i] = (uint8_t)(i * 7 + 3);
+    struct aesgcm gcm;
+    unhex(key, k);
+    aesgcm_init(&gcm, key);
+    memset(tag, 0, sizeof(tag));
+    for(len = 0; len != sizeof(m); ++len) {
+        memcpy(nonce, tag, sizeof(nonce));
+        memcpy(aad, tag, sizeof(tag));
+        aesgcm_seal(&gcm, tag, c, m, len, aad, len % 17, nonce);
+        assert(aesgcm_open(&gcm, c, c, len, tag, aad, len % 17, nonce) == 0);
+        assert(memcmp(c, m, len) == 0);
+    }
+    unhex(exptag, "8b05722ccc94e5664bf75f1690739bff");
+    assert(memcmp(tag, exptag, 16) == 0);
+    aesgcm_term(&gcm);
+
+    return 0;
+}
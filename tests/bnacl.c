@@ -0,0 +1,155 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <string.h>
+
+#include "../dsock.h"
+
+coroutine void sender(int s) {
+    char buf[1000];
+    memset(buf, 'x', sizeof(buf));
+    int rc = bsend(s, buf, sizeof(buf), -1);
+    assert(rc == -1 && errno == ECANCELED);
+}
+
+int main() {
+
+    const char key[] = "01234567890123456789012345678901";
+    const char badkey[] = "X1234567890123456789012345678901";
+
+    /* Test data spanning multiple records. */
+    int s[2];
+    int rc = ipc_pair(s);
+    assert(rc == 0);
+    int b0 = bnacl_attach(s[0], key, 32, 8, -1, -1);
+    assert(b0 >= 0);
+    int b1 = bnacl_attach(s[1], key, 32, 8, -1, -1);
+    assert(b1 >= 0);
+    rc = bsend(b0, "0123456789ABCDEFGHIJ", 20, -1);
+    assert(rc == 0);
+    rc = bnacl_flush(b0, -1);
+    assert(rc == 0);
+    char buf[20];
+    rc = brecv(b1, buf, 3, -1);
+    assert(rc == 0);
+    assert(memcmp(buf, "012", 3) == 0);
+    rc = brecv(b1, buf, 17, -1);
+    assert(rc == 0);
+    assert(memcmp(buf, "3456789ABCDEFGHIJ", 17) == 0);
+    rc = bsend(b1, "KLM", 3, -1);
+    assert(rc == 0);
+    rc = bnacl_flush(b1, -1);
+    assert(rc == 0);
+    rc = brecv(b0, buf, 3, -1);
+    assert(rc == 0);
+    assert(memcmp(buf, "KLM", 3) == 0);
+    /* Detaching marks the end of the stream. */
+    int u = bnacl_detach(b0, -1);
+    assert(u >= 0);
+    rc = hclose(u);
+    assert(rc == 0);
+    rc = brecv(b1, buf, 1, -1);
+    assert(rc == -1 && errno == EPIPE);
+    rc = hclose(b1);
+    assert(rc == 0);
+
+    /* Test that partial record is not sent without a timeout. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    b0 = bnacl_attach(s[0], key, 32, 8, -1, -1);
+    assert(b0 >= 0);
+    b1 = bnacl_attach(s[1], key, 32, 8, -1, -1);
+    assert(b1 >= 0);
+    rc = bsend(b0, "ABC", 3, -1);
+    assert(rc == 0);
+    rc = brecv(b1, buf, 3, now() + 100);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    rc = hclose(b1);
+    assert(rc == 0);
+    rc = hclose(b0);
+    assert(rc == 0);
+
+    /* Test that partial record is flushed once the interval expires. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    b0 = bnacl_attach(s[0], key, 32, 8, 50, -1);
+    assert(b0 >= 0);
+    b1 = bnacl_attach(s[1], key, 32, 8, 50, -1);
+    assert(b1 >= 0);
+    rc = bsend(b0, "ABC", 3, -1);
+    assert(rc == 0);
+    rc = brecv(b1, buf, 3, -1);
+    assert(rc == 0);
+    assert(memcmp(buf, "ABC", 3) == 0);
+    /* Closing without detaching may be a truncation attack. */
+    rc = hclose(b0);
+    assert(rc == 0);
+    rc = brecv(b1, buf, 1, -1);
+    assert(rc == -1 && errno == ECONNRESET);
+    rc = hclose(b1);
+    assert(rc == 0);
+
+    /* Test that canceled send breaks the outbound stream. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    int t0 = bthrottler_attach(s[0], 100, 100, 0, 0);
+    assert(t0 >= 0);
+    b0 = bnacl_attach(t0, key, 32, 8, -1, -1);
+    assert(b0 >= 0);
+    int cr = go(sender(b0));
+    assert(cr >= 0);
+    rc = msleep(now() + 50);
+    assert(rc == 0);
+    rc = hclose(cr);
+    assert(rc == 0);
+    rc = bsend(b0, "ABC", 3, -1);
+    assert(rc == -1 && errno == ECONNRESET);
+    rc = bnacl_flush(b0, -1);
+    assert(rc == -1 && errno == ECONNRESET);
+    rc = hclose(b0);
+    assert(rc == 0);
+    rc = hclose(s[1]);
+    assert(rc == 0);
+
+    /* Test communication with wrong key. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    b0 = bnacl_attach(s[0], key, 32, 8, -1, -1);
+    assert(b0 >= 0);
+    b1 = bnacl_attach(s[1], badkey, 32, 8, -1, -1);
+    assert(b1 >= 0);
+    rc = bsend(b0, "ABC", 3, -1);
+    assert(rc == 0);
+    rc = bnacl_flush(b0, -1);
+    assert(rc == 0);
+    rc = brecv(b1, buf, 3, -1);
+    assert(rc == -1 && errno == EACCES);
+    rc = hclose(b1);
+    assert(rc == 0);
+    rc = hclose(b0);
+    assert(rc == 0);
+
+    return 0;
+}
@@ -125,6 +125,409 @@ int main() {
     assert(rc == 0);
     rc = hclose(h[0]);
     assert(rc == 0);
+
+    /* Test header table. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s0 = http_attach(h[0]);
+    assert(s0 >= 0);
+    s1 = http_attach(h[1]);
+    assert(s1 >= 0);
+    rc = http_sendrequest(s0, "GET", "/", -1);
+    assert(rc == 0);
+    rc = http_sendfield(s0, "Host", "www.example.org", -1);
+    assert(rc == 0);
+    rc = http_sendfield(s0, "X-Foo", "  a b  ", -1);
+    assert(rc == 0);
+    rc = http_sendfield(s0, "content-length", "0", -1);
+    assert(rc == 0);
+    rc = http_sendfield(s0, "x-foo", "dup", -1);
+    assert(rc == 0);
+    rc = hdone(s0, -1);
+    assert(rc == 0);
+    rc = http_recvrequest(s1, cmd, sizeof(cmd), url, sizeof(url), -1);
+    assert(rc == 0);
+    rc = http_recvfields(s1, -1);
+    assert(rc == 4);
+    const char *fld = http_field(s1, "HOST");
+    assert(fld && strcmp(fld, "www.example.org") == 0);
+    fld = http_field(s1, "x-foo");
+    assert(fld && strcmp(fld, "a b") == 0);
+    fld = http_field(s1, "Nonexistent");
+    assert(!fld && errno == ENOENT);
+    fld = http_knownfield(s1, DSOCK_HTTP_CONTENT_LENGTH);
+    assert(fld && strcmp(fld, "0") == 0);
+    fld = http_knownfield(s1, DSOCK_HTTP_CONNECTION);
+    assert(!fld && errno == ENOENT);
+    const char *fldname;
+    rc = http_fieldat(s1, 3, &fldname, &fld);
+    assert(rc == 0);
+    assert(strcmp(fldname, "x-foo") == 0 && strcmp(fld, "dup") == 0);
+    rc = http_fieldat(s1, 4, &fldname, &fld);
+    assert(rc < 0 && errno == ENOENT);
+
+    /* Test coalesced header. */
+    rc = http_addfield(s1, "Server", "dsock");
+    assert(rc < 0 && errno == EINVAL);
+    rc = http_startstatus(s1, 404, "Not Found");
+    assert(rc == 0);
+    rc = http_addfield(s1, "Server", "dsock");
+    assert(rc == 0);
+    rc = http_addfield(s1, "invalid field name ", "bar");
+    assert(rc < 0 && errno == EPROTO);
+    rc = http_addfield(s1, "Connection", " close ");
+    assert(rc == 0);
+    rc = http_sendheader(s1, NULL, NULL, -1);
+    assert(rc == 0);
+    rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+    assert(rc == 404);
+    assert(strcmp(reason, "Not Found") == 0);
+    rc = http_recvfields(s0, -1);
+    assert(rc == 2);
+    fld = http_knownfield(s0, DSOCK_HTTP_CONNECTION);
+    assert(fld && strcmp(fld, "close") == 0);
+
+    /* Test message bodies. */
+    rc = http_startrequest(s0, "POST", "/a");
+    assert(rc == 0);
+    rc = http_addfield(s0, "Content-Length", "11");
+    assert(rc == 0);
+    struct iolist body = {(void*)"hello world", 11, NULL, 0};
+    rc = http_sendheader(s0, &body, &body, -1);
+    assert(rc == 0);
+    rc = http_startrequest(s0, "POST", "/b");
+    assert(rc == 0);
+    rc = http_addfield(s0, "Transfer-Encoding", "chunked");
+    assert(rc == 0);
+    rc = http_sendheader(s0, NULL, NULL, -1);
+    assert(rc == 0);
+    struct iolist chunk2 = {(void*)"defghijklm", 10, NULL, 0};
+    struct iolist chunk1 = {(void*)"abc", 3, NULL, 0};
+    rc = http_sendchunk(s0, &chunk1, &chunk1, -1);
+    assert(rc == 0);
+    chunk1.iol_next = &chunk2;
+    rc = http_sendchunk(s0, &chunk1, &chunk2, -1);
+    assert(rc == 0);
+    rc = http_sendchunk(s0, NULL, NULL, -1);
+    assert(rc == 0);
+    rc = http_sendrequest(s0, "GET", "/c", -1);
+    assert(rc == 0);
+    rc = hdone(s0, -1);
+    assert(rc == 0);
+    char bodybuf[32];
+    struct iolist iol = {bodybuf, 8, NULL, 0};
+    rc = http_recvrequest(s1, cmd, sizeof(cmd), url, sizeof(url), -1);
+    assert(rc == 0);
+    assert(strcmp(url, "/a") == 0);
+    ssize_t sz = http_recvbody(s1, &iol, &iol, -1);
+    assert(sz < 0 && errno == EINVAL);
+    rc = http_recvfields(s1, -1);
+    assert(rc == 1);
+    sz = http_recvbody(s1, &iol, &iol, -1);
+    assert(sz == 8 && memcmp(bodybuf, "hello wo", 8) == 0);
+    sz = http_recvbody(s1, &iol, &iol, -1);
+    assert(sz == 3 && memcmp(bodybuf, "rld", 3) == 0);
+    sz = http_recvbody(s1, &iol, &iol, -1);
+    assert(sz == 0);
+    rc = http_recvrequest(s1, cmd, sizeof(cmd), url, sizeof(url), -1);
+    assert(rc == 0);
+    assert(strcmp(url, "/b") == 0);
+    rc = http_recvfields(s1, -1);
+    assert(rc == 1);
+    iol.iol_len = sizeof(bodybuf);
+    sz = http_recvbody(s1, &iol, &iol, -1);
+    assert(sz == 3 && memcmp(bodybuf, "abc", 3) == 0);
+    /* Unread part of the body is skipped. */
+    rc = http_recvrequest(s1, cmd, sizeof(cmd), url, sizeof(url), -1);
+    assert(rc == 0);
+    assert(strcmp(url, "/c") == 0);
+    rc = http_recvfields(s1, -1);
+    assert(rc == 0);
+    sz = http_recvbody(s1, &iol, &iol, -1);
+    assert(sz == 0);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(s0);
+    assert(rc == 0);
+
+    /* Test pipelining. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s0 = http_attach(h[0]);
+    assert(s0 >= 0);
+    s1 = http_attach(h[1]);
+    assert(s1 >= 0);
+    rc = http_reusable(s0);
+    assert(rc == 1);
+    rc = http_startrequest(s0, "HEAD", "/x");
+    assert(rc == 0);
+    rc = http_sendheader(s0, NULL, NULL, -1);
+    assert(rc == 0);
+    rc = http_sendrequest(s0, "GET", "/y", -1);
+    assert(rc == 0);
+    rc = hdone(s0, -1);
+    assert(rc == 0);
+    rc = http_pending(s0);
+    assert(rc == 2);
+    rc = http_reusable(s0);
+    assert(rc == 0);
+    rc = http_recvrequest(s1, cmd, sizeof(cmd), url, sizeof(url), -1);
+    assert(rc == 0);
+    assert(strcmp(cmd, "HEAD") == 0);
+    rc = http_startstatus(s1, 200, "OK");
+    assert(rc == 0);
+    rc = http_addfield(s1, "Content-Length", "5");
+    assert(rc == 0);
+    rc = http_sendheader(s1, NULL, NULL, -1);
+    assert(rc == 0);
+    rc = http_recvrequest(s1, cmd, sizeof(cmd), url, sizeof(url), -1);
+    assert(rc == 0);
+    assert(strcmp(url, "/y") == 0);
+    rc = http_startstatus(s1, 200, "OK");
+    assert(rc == 0);
+    rc = http_addfield(s1, "Content-Length", "5");
+    assert(rc == 0);
+    body.iol_base = (void*)"hello";
+    body.iol_len = 5;
+    rc = http_sendheader(s1, &body, &body, -1);
+    assert(rc == 0);
+    rc = http_startstatus(s1, 200, "OK");
+    assert(rc == 0);
+    rc = http_addfield(s1, "Connection", "keep-alive, close");
+    assert(rc == 0);
+    rc = http_sendheader(s1, NULL, NULL, -1);
+    assert(rc == 0);
+    /* Response to HEAD has no body even though it has Content-Length. */
+    rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+    assert(rc == 200);
+    rc = http_recvfields(s0, -1);
+    assert(rc == 1);
+    sz = http_recvbody(s0, &iol, &iol, -1);
+    assert(sz == 0);
+    rc = http_pending(s0);
+    assert(rc == 1);
+    rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+    assert(rc == 200);
+    rc = http_recvfields(s0, -1);
+    assert(rc == 1);
+    sz = http_recvbody(s0, &iol, &iol, -1);
+    assert(sz == 5 && memcmp(bodybuf, "hello", 5) == 0);
+    sz = http_recvbody(s0, &iol, &iol, -1);
+    assert(sz == 0);
+    rc = http_pending(s0);
+    assert(rc == 0);
+    rc = http_reusable(s0);
+    assert(rc == 1);
+    /* Peer asks for the connection to be closed. */
+    rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+    assert(rc == 200);
+    rc = http_recvfields(s0, -1);
+    assert(rc == 1);
+    rc = http_reusable(s0);
+    assert(rc == 0);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(s0);
+    assert(rc == 0);
+
+    /* Request that doesn't fit into the pipeline is not sent. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s0 = http_attach(h[0]);
+    assert(s0 >= 0);
+    s1 = http_attach(h[1]);
+    assert(s1 >= 0);
+    int i;
+    for(i = 0; i != 64; ++i) {
+        rc = http_sendrequest(s0, "GET", "/a", -1);
+        assert(rc == 0);
+        rc = hdone(s0, -1);
+        assert(rc == 0);
+    }
+    rc = http_sendrequest(s0, "GET", "/b", -1);
+    assert(rc < 0 && errno == ENOBUFS);
+    rc = http_startrequest(s0, "GET", "/c");
+    assert(rc == 0);
+    rc = http_sendheader(s0, NULL, NULL, -1);
+    assert(rc < 0 && errno == ENOBUFS);
+    rc = http_recvrequest(s1, cmd, sizeof(cmd), url, sizeof(url), -1);
+    assert(rc == 0);
+    rc = http_recvfields(s1, -1);
+    assert(rc == 0);
+    rc = http_startstatus(s1, 204, "No Content");
+    assert(rc == 0);
+    rc = http_sendheader(s1, NULL, NULL, -1);
+    assert(rc == 0);
+    rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+    assert(rc == 204);
+    rc = http_recvfields(s0, -1);
+    assert(rc == 0);
+    rc = http_pending(s0);
+    assert(rc == 63);
+    rc = http_sendrequest(s0, "GET", "/d", -1);
+    assert(rc == 0);
+    rc = hdone(s0, -1);
+    assert(rc == 0);
+    for(i = 0; i != 64; ++i) {
+        rc = http_recvrequest(s1, cmd, sizeof(cmd), url, sizeof(url), -1);
+        assert(rc == 0);
+        assert(strcmp(url, i == 63 ? "/d" : "/a") == 0);
+        rc = http_recvfields(s1, -1);
+        assert(rc == 0);
+    }
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(s0);
+    assert(rc == 0);
+
+    /* Header lines terminated by bare LF that fill the header buffer up
+       to the last byte. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s1 = http_attach(h[1]);
+    assert(s1 >= 0);
+    rc = http_setmaxheader(s1, 16);
+    assert(rc == 0);
+    rc = bsend(h[0], "GET / HTTP/1.1\nA: 12345\nB: 123\nC: 1\n\n", 37, -1);
+    assert(rc == 0);
+    rc = http_recvrequest(s1, cmd, sizeof(cmd), url, sizeof(url), -1);
+    assert(rc == 0);
+    rc = http_recvfields(s1, -1);
+    assert(rc < 0 && errno == EMSGSIZE);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(h[0]);
+    assert(rc == 0);
+
+    /* Only the last transfer coding determines the framing. Body of
+       a response that is neither chunked nor has Content-Length runs until
+       the connection is closed. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s0 = http_attach(h[0]);
+    assert(s0 >= 0);
+    rc = http_sendrequest(s0, "GET", "/a", -1);
+    assert(rc == 0);
+    rc = http_sendrequest(s0, "GET", "/b", -1);
+    assert(rc == 0);
+    const char *rsp = "HTTP/1.1 200 OK\r\n"
+        "Transfer-Encoding: gzip, chunked\r\n\r\n3\r\nabc\r\n0\r\n\r\n"
+        "HTTP/1.1 200 OK\r\n"
+        "Transfer-Encoding: chunked, gzip\r\nContent-Length: 2\r\n\r\n"
+        "hello";
+    rc = bsend(h[1], rsp, strlen(rsp), -1);
+    assert(rc == 0);
+    iol.iol_len = 8;
+    rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+    assert(rc == 200);
+    rc = http_recvfields(s0, -1);
+    assert(rc == 1);
+    sz = http_recvbody(s0, &iol, &iol, -1);
+    assert(sz == 3 && memcmp(bodybuf, "abc", 3) == 0);
+    sz = http_recvbody(s0, &iol, &iol, -1);
+    assert(sz == 0);
+    rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+    assert(rc == 200);
+    rc = http_recvfields(s0, -1);
+    assert(rc == 2);
+    rc = http_reusable(s0);
+    assert(rc == 0);
+    sz = http_recvbody(s0, &iol, &iol, -1);
+    assert(sz == 5 && memcmp(bodybuf, "hello", 5) == 0);
+    sz = http_recvbody(s0, &iol, &iol, -1);
+    assert(sz == 0);
+    rc = http_reusable(s0);
+    assert(rc == 0);
+    rc = hclose(s0);
+    assert(rc == 0);
+    rc = hclose(h[1]);
+    assert(rc == 0);
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s0 = http_attach(h[0]);
+    assert(s0 >= 0);
+    rc = http_sendrequest(s0, "GET", "/a", -1);
+    assert(rc == 0);
+    rsp = "HTTP/1.1 200 OK\r\nTransfer-Encoding: notchunked\r\n\r\nworld";
+    rc = bsend(h[1], rsp, strlen(rsp), -1);
+    assert(rc == 0);
+    rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+    assert(rc == 200);
+    rc = http_recvfields(s0, -1);
+    assert(rc == 1);
+    iol.iol_len = 3;
+    sz = http_recvbody(s0, &iol, &iol, -1);
+    assert(sz == 3 && memcmp(bodybuf, "wor", 3) == 0);
+    sz = http_recvbody(s0, &iol, &iol, -1);
+    assert(sz == 2 && memcmp(bodybuf, "ld", 2) == 0);
+    sz = http_recvbody(s0, &iol, &iol, -1);
+    assert(sz == 0);
+    rc = http_reusable(s0);
+    assert(rc == 0);
+    rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+    assert(rc < 0 && errno == EPIPE);
+    rc = hclose(s0);
+    assert(rc == 0);
+    rc = hclose(h[1]);
+    assert(rc == 0);
+    /* Length of a request body with other than chunked coding is unknown. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s1 = http_attach(h[1]);
+    assert(s1 >= 0);
+    rsp = "POST / HTTP/1.1\r\nTransfer-Encoding: chunked, gzip\r\n\r\n";
+    rc = bsend(h[0], rsp, strlen(rsp), -1);
+    assert(rc == 0);
+    rc = http_recvrequest(s1, cmd, sizeof(cmd), url, sizeof(url), -1);
+    assert(rc == 0);
+    rc = http_recvfields(s1, -1);
+    assert(rc < 0 && errno == EPROTO);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(h[0]);
+    assert(rc == 0);
+
+    /* Test header templates. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s0 = http_attach(h[0]);
+    assert(s0 >= 0);
+    s1 = http_attach(h[1]);
+    assert(s1 >= 0);
+    int t = http_mktemplate(600, "Bad");
+    assert(t < 0 && errno == EINVAL);
+    t = http_mktemplate(200, "OK");
+    assert(t >= 0);
+    rc = http_templatefield(t, "Server", "dsock");
+    assert(rc == 0);
+    rc = http_templatefield(t, "invalid field name ", "bar");
+    assert(rc < 0 && errno == EPROTO);
+    for(i = 0; i != 2; ++i) {
+        rc = http_starttemplate(s1, t);
+        assert(rc == 0);
+        rc = http_adddate(s1);
+        assert(rc == 0);
+        rc = http_addfield(s1, "Content-Length", "0");
+        assert(rc == 0);
+        rc = http_sendheader(s1, NULL, NULL, -1);
+        assert(rc == 0);
+        rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+        assert(rc == 200);
+        assert(strcmp(reason, "OK") == 0);
+        rc = http_recvfields(s0, -1);
+        assert(rc == 3);
+        fld = http_field(s0, "Server");
+        assert(fld && strcmp(fld, "dsock") == 0);
+        fld = http_field(s0, "Date");
+        assert(fld && strlen(fld) == 29 && strcmp(fld + 25, " GMT") == 0);
+    }
+    rc = hclose(t);
+    assert(rc == 0);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(s0);
+    assert(rc == 0);
+
     return 0;
 }
 
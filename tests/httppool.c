@@ -0,0 +1,174 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <string.h>
+
+#include "../dsock.h"
+
+static int closed = 0;
+
+coroutine void server(int ls) {
+    while(1) {
+        int s = tcp_accept(ls, NULL, -1);
+        if(s < 0) return;
+        s = http_attach(s);
+        assert(s >= 0);
+        char cmd[16];
+        char url[16];
+        while(1) {
+            int rc = http_recvrequest(s, cmd, sizeof(cmd), url, sizeof(url),
+                -1);
+            if(rc < 0) break;
+            rc = http_recvfields(s, -1);
+            assert(rc >= 0);
+            rc = http_startstatus(s, 200, "OK");
+            assert(rc == 0);
+            rc = http_addfield(s, "Content-Length", "0");
+            assert(rc == 0);
+            if(strcmp(url, "/close") == 0) {
+                rc = http_addfield(s, "Connection", "close");
+                assert(rc == 0);
+            }
+            rc = http_sendheader(s, NULL, NULL, -1);
+            assert(rc == 0);
+        }
+        int rc = hclose(s);
+        assert(rc == 0);
+        closed++;
+    }
+}
+
+coroutine void waiter(int p, int *err) {
+    int s = httppool_get(p, "127.0.0.1", 5555, -1);
+    assert(s < 0);
+    *err = errno;
+}
+
+static void request(int s, const char *url) {
+    int rc = http_sendrequest(s, "GET", url, -1);
+    assert(rc == 0);
+    rc = hdone(s, -1);
+    assert(rc == 0);
+    char reason[16];
+    rc = http_recvstatus(s, reason, sizeof(reason), -1);
+    assert(rc == 200);
+    rc = http_recvfields(s, -1);
+    assert(rc >= 0);
+}
+
+int main() {
+    struct ipaddr addr;
+    int rc = ipaddr_local(&addr, "127.0.0.1", 5555, 0);
+    assert(rc == 0);
+    int ls = tcp_listen(&addr, 10);
+    assert(ls >= 0);
+    int srv = go(server(ls));
+    assert(srv >= 0);
+
+    int p = httppool_make(1, 1000);
+    assert(p >= 0);
+    /* Connection is reused. */
+    int s1 = httppool_get(p, "127.0.0.1", 5555, -1);
+    assert(s1 >= 0);
+    request(s1, "/a");
+    rc = httppool_put(p, s1);
+    assert(rc == 0);
+    int s2 = httppool_get(p, "127.0.0.1", 5555, -1);
+    assert(s2 == s1);
+    /* Limit of connections per host is reached. */
+    int s3 = httppool_get(p, "127.0.0.1", 5555, now() + 50);
+    assert(s3 < 0 && errno == ETIMEDOUT);
+    /* Connection that was asked to be closed is not reused. */
+    request(s2, "/close");
+    rc = httppool_put(p, s2);
+    assert(rc == 0);
+    rc = httppool_put(p, s2);
+    assert(rc < 0 && errno == EINVAL);
+    s3 = httppool_get(p, "127.0.0.1", 5555, -1);
+    assert(s3 >= 0);
+    request(s3, "/b");
+    rc = httppool_put(p, s3);
+    assert(rc == 0);
+    rc = hclose(p);
+    assert(rc == 0);
+
+    /* Stale connections are closed even if their host is not used again. */
+    rc = ipaddr_local(&addr, "127.0.0.1", 5556, 0);
+    assert(rc == 0);
+    int ls2 = tcp_listen(&addr, 10);
+    assert(ls2 >= 0);
+    int srv2 = go(server(ls2));
+    assert(srv2 >= 0);
+    p = httppool_make(1, 50);
+    assert(p >= 0);
+    s1 = httppool_get(p, "127.0.0.1", 5555, -1);
+    assert(s1 >= 0);
+    request(s1, "/a");
+    rc = httppool_put(p, s1);
+    assert(rc == 0);
+    rc = msleep(now() + 100);
+    assert(rc == 0);
+    int nclosed = closed;
+    s2 = httppool_get(p, "127.0.0.1", 5556, -1);
+    assert(s2 >= 0);
+    request(s2, "/a");
+    rc = msleep(now() + 50);
+    assert(rc == 0);
+    assert(closed == nclosed + 1);
+    rc = httppool_put(p, s2);
+    assert(rc == 0);
+    rc = hclose(p);
+    assert(rc == 0);
+    rc = hclose(srv2);
+    assert(rc == 0);
+    rc = hclose(ls2);
+    assert(rc == 0);
+
+    /* Closing the pool wakes up the coroutines waiting for a connection. */
+    p = httppool_make(1, -1);
+    assert(p >= 0);
+    s1 = httppool_get(p, "127.0.0.1", 5555, -1);
+    assert(s1 >= 0);
+    int err = 0;
+    int cr = go(waiter(p, &err));
+    assert(cr >= 0);
+    rc = msleep(now() + 20);
+    assert(rc == 0);
+    rc = hclose(p);
+    assert(rc == 0);
+    rc = msleep(now() + 20);
+    assert(rc == 0);
+    assert(err == ECANCELED);
+    rc = hclose(cr);
+    assert(rc == 0);
+    rc = hclose(s1);
+    assert(rc == 0);
+
+    rc = hclose(srv);
+    assert(rc == 0);
+    rc = hclose(ls);
+    assert(rc == 0);
+    return 0;
+}
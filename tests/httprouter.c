@@ -0,0 +1,154 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../dsock.h"
+
+static int param(struct httprouter_match *m, size_t idx, const char *name,
+      const char *value) {
+    return idx < m->nparams && strcmp(m->params[idx].name, name) == 0 &&
+        m->params[idx].len == strlen(value) &&
+        memcmp(m->params[idx].value, value, m->params[idx].len) == 0;
+}
+
+int main() {
+    int r = httprouter_make();
+    assert(r >= 0);
+    int rc = httprouter_add(r, "GET", "/", "root");
+    assert(rc == 0);
+    rc = httprouter_add(r, "GET", "/users", "users");
+    assert(rc == 0);
+    rc = httprouter_add(r, "POST", "/users", "newuser");
+    assert(rc == 0);
+    rc = httprouter_add(r, "GET", "/users/new", "form");
+    assert(rc == 0);
+    rc = httprouter_add(r, "GET", "/users/:id", "user");
+    assert(rc == 0);
+    rc = httprouter_add(r, "GET", "/users/:id/posts/:post", "post");
+    assert(rc == 0);
+    rc = httprouter_add(r, NULL, "/static/*file", "static");
+    assert(rc == 0);
+    rc = httprouter_add(r, "GET", "/user", "user1");
+    assert(rc == 0);
+    /* Invalid patterns. */
+    rc = httprouter_add(r, "GET", "/users", "dup");
+    assert(rc < 0 && errno == EEXIST);
+    rc = httprouter_add(r, "GET", "/users/:name/x", "conflict");
+    assert(rc < 0 && errno == EINVAL);
+    rc = httprouter_add(r, "GET", "/static/*file/x", "notlast");
+    assert(rc < 0 && errno == EINVAL);
+    rc = httprouter_add(r, "GET", "relative", "relative");
+    assert(rc < 0 && errno == EINVAL);
+
+    struct httprouter_match m;
+    rc = httprouter_match(r, "GET", "/", &m);
+    assert(rc == 0 && strcmp(m.data, "root") == 0 && m.nparams == 0);
+    rc = httprouter_match(r, "GET", "/users?limit=10", &m);
+    assert(rc == 0 && strcmp(m.data, "users") == 0);
+    rc = httprouter_match(r, "POST", "/users", &m);
+    assert(rc == 0 && strcmp(m.data, "newuser") == 0);
+    rc = httprouter_match(r, "GET", "/user", &m);
+    assert(rc == 0 && strcmp(m.data, "user1") == 0);
+    rc = httprouter_match(r, "GET", "/users/new", &m);
+    assert(rc == 0 && strcmp(m.data, "form") == 0);
+    rc = httprouter_match(r, "GET", "/users/newer", &m);
+    assert(rc == 0 && strcmp(m.data, "user") == 0);
+    assert(m.nparams == 1 && param(&m, 0, "id", "newer"));
+    rc = httprouter_match(r, "GET", "/users/42/posts/7", &m);
+    assert(rc == 0 && strcmp(m.data, "post") == 0);
+    assert(m.nparams == 2 && param(&m, 0, "id", "42") &&
+        param(&m, 1, "post", "7"));
+    rc = httprouter_match(r, "DELETE", "/static/css/main.css", &m);
+    assert(rc == 0 && strcmp(m.data, "static") == 0);
+    assert(m.nparams == 1 && param(&m, 0, "file", "css/main.css"));
+    rc = httprouter_match(r, "GET", "/users/", &m);
+    assert(rc < 0 && errno == ENOENT);
+    rc = httprouter_match(r, "PUT", "/users", &m);
+    assert(rc < 0 && errno == ENOENT);
+    rc = httprouter_match(r, "GET", "/users/42/posts", &m);
+    assert(rc < 0 && errno == ENOENT);
+
+    /* Routes overlapping at every level. The number of fallbacks is capped
+       so a route that needs too many of them is not found. */
+    int r2 = httprouter_make();
+    assert(r2 >= 0);
+    int i, j;
+    for(i = 0; i != 256; ++i) {
+        char pattern[64];
+        char *pos = pattern;
+        for(j = 0; j != 8; ++j)
+            pos += i & (1 << j) ? sprintf(pos, "/:p%d", j) : sprintf(pos, "/a");
+        strcpy(pos, "/x");
+        rc = httprouter_add(r2, "GET", pattern, "x");
+        assert(rc == 0);
+    }
+    rc = httprouter_add(r2, "GET", "/a/a/a/a/a/a/a/:p7/y", "near");
+    assert(rc == 0);
+    rc = httprouter_add(r2, "GET", "/:p0/:p1/:p2/:p3/:p4/:p5/:p6/:p7/y", "far");
+    assert(rc == 0);
+    rc = httprouter_match(r2, "GET", "/a/a/a/a/a/a/a/a/x", &m);
+    assert(rc == 0 && strcmp(m.data, "x") == 0 && m.nparams == 0);
+    rc = httprouter_match(r2, "GET", "/a/a/b/a/a/a/a/a/x", &m);
+    assert(rc == 0 && strcmp(m.data, "x") == 0);
+    assert(m.nparams == 1 && param(&m, 0, "p2", "b"));
+    rc = httprouter_match(r2, "GET", "/a/a/a/a/a/a/a/b/y", &m);
+    assert(rc == 0 && strcmp(m.data, "near") == 0);
+    rc = httprouter_match(r2, "GET", "/a/a/a/a/a/a/a/a/y", &m);
+    assert(rc == 0 && strcmp(m.data, "near") == 0);
+    rc = httprouter_match(r2, "GET", "/b/b/b/b/b/b/b/b/y", &m);
+    assert(rc == 0 && strcmp(m.data, "far") == 0 && m.nparams == 8);
+    rc = httprouter_match(r2, "GET", "/a/a/a/a/a/a/a/a/z", &m);
+    assert(rc < 0 && errno == ENOENT);
+    rc = httprouter_match(r2, "GET", "/a/b/a/a/a/a/a/a/y", &m);
+    assert(rc < 0 && errno == ENOENT);
+    rc = hclose(r2);
+    assert(rc == 0);
+
+    /* Dispatch directly from the request line. */
+    int h[2];
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    int s0 = http_attach(h[0]);
+    assert(s0 >= 0);
+    int s1 = http_attach(h[1]);
+    assert(s1 >= 0);
+    rc = http_sendrequest(s0, "GET", "/users/5", -1);
+    assert(rc == 0);
+    rc = hdone(s0, -1);
+    assert(rc == 0);
+    rc = httprouter_recv(s1, r, &m, -1);
+    assert(rc == 0 && strcmp(m.data, "user") == 0);
+    assert(param(&m, 0, "id", "5"));
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(s0);
+    assert(rc == 0);
+
+    rc = hclose(r);
+    assert(rc == 0);
+    return 0;
+}
@@ -0,0 +1,170 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <string.h>
+
+#include "../dsock.h"
+
+static int handler(int s, const char *command, const char *resource,
+      void *arg, int64_t deadline) {
+    int *count = arg;
+    ++*count;
+    int rc = http_startstatus(s, 200, "OK");
+    assert(rc == 0);
+    rc = http_addfield(s, "Content-Length", "5");
+    assert(rc == 0);
+    struct iolist body = {(void*)resource + 1, 5, NULL, 0};
+    return http_sendheader(s, &body, &body, deadline);
+}
+
+static void request(int s, const char *url) {
+    int rc = http_startrequest(s, "GET", url);
+    assert(rc == 0);
+    rc = http_addfield(s, "Content-Length", "3");
+    assert(rc == 0);
+    /* Body is not read by the handler. */
+    struct iolist body = {(void*)"abc", 3, NULL, 0};
+    rc = http_sendheader(s, &body, &body, -1);
+    assert(rc == 0);
+}
+
+/* Sends a raw request line and returns the status of the response. */
+static int rawrequest(struct ipaddr *addr, const char *line) {
+    int s = tcp_connect(addr, -1);
+    assert(s >= 0);
+    int rc = bsend(s, line, strlen(line), -1);
+    assert(rc == 0);
+    rc = bsend(s, "\r\n\r\n", 4, -1);
+    assert(rc == 0);
+    s = http_attach(s);
+    assert(s >= 0);
+    char reason[32];
+    int status = http_recvstatus(s, reason, sizeof(reason), -1);
+    rc = hclose(s);
+    assert(rc == 0);
+    return status;
+}
+
+int main() {
+    int count = 0;
+    struct ipaddr addr;
+    int rc = ipaddr_local(&addr, "127.0.0.1", 5556, 0);
+    assert(rc == 0);
+    int ls = httpserver_listen(&addr, 10);
+    assert(ls >= 0);
+    int srv = httpserver_make(ls, 2, 1000, 256, handler, &count);
+    assert(srv >= 0);
+
+    int s = tcp_connect(&addr, -1);
+    assert(s >= 0);
+    s = http_attach(s);
+    assert(s >= 0);
+    /* Several requests are processed on the same connection. */
+    char reason[32];
+    char buf[5];
+    struct iolist iol = {buf, sizeof(buf), NULL, 0};
+    int i;
+    for(i = 0; i != 3; ++i) {
+        request(s, "/hello");
+        rc = http_recvstatus(s, reason, sizeof(reason), -1);
+        assert(rc == 200);
+        rc = http_recvfields(s, -1);
+        assert(rc == 1);
+        ssize_t sz = http_recvbody(s, &iol, &iol, -1);
+        assert(sz == 5 && memcmp(buf, "hello", 5) == 0);
+    }
+    assert(count == 3);
+    /* Header that's too large is rejected. */
+    char value[300];
+    memset(value, 'x', sizeof(value) - 1);
+    value[sizeof(value) - 1] = 0;
+    rc = http_sendrequest(s, "GET", "/hello", -1);
+    assert(rc == 0);
+    rc = http_sendfield(s, "X-Large", value, -1);
+    assert(rc == 0);
+    rc = hdone(s, -1);
+    assert(rc == 0);
+    rc = http_recvstatus(s, reason, sizeof(reason), -1);
+    assert(rc == 431);
+    assert(count == 3);
+    rc = hclose(s);
+    assert(rc == 0);
+    /* Request line is too long because of the resource. */
+    char line[2048];
+    memcpy(line, "GET /", 5);
+    memset(line + 5, 'x', 1500);
+    strcpy(line + 1505, " HTTP/1.1");
+    rc = rawrequest(&addr, line);
+    assert(rc == 414);
+    /* Command is longer than any supported one. */
+    rc = rawrequest(&addr, "GETGETGETGETGETGETGET / HTTP/1.1");
+    assert(rc == 501);
+    memset(line, 'G', 1500);
+    strcpy(line + 1500, " / HTTP/1.1");
+    rc = rawrequest(&addr, line);
+    assert(rc == 501);
+    /* Malformed request line. */
+    rc = rawrequest(&addr, "GET / HTTP/1.1 x");
+    assert(rc == 400);
+    assert(count == 3);
+
+    /* Once all the slots are taken, the next connection is served as soon
+       as one of them is freed. */
+    int s1 = tcp_connect(&addr, -1);
+    assert(s1 >= 0);
+    s1 = http_attach(s1);
+    assert(s1 >= 0);
+    int s2 = tcp_connect(&addr, -1);
+    assert(s2 >= 0);
+    s2 = http_attach(s2);
+    assert(s2 >= 0);
+    int s3 = tcp_connect(&addr, -1);
+    assert(s3 >= 0);
+    s3 = http_attach(s3);
+    assert(s3 >= 0);
+    request(s1, "/hello");
+    request(s2, "/hello");
+    request(s3, "/world");
+    rc = msleep(now() + 50);
+    assert(rc == 0);
+    assert(count == 5);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = http_recvstatus(s3, reason, sizeof(reason), now() + 500);
+    assert(rc == 200);
+    rc = http_recvfields(s3, -1);
+    assert(rc == 1);
+    ssize_t sz = http_recvbody(s3, &iol, &iol, -1);
+    assert(sz == 5 && memcmp(buf, "world", 5) == 0);
+    assert(count == 6);
+    rc = hclose(s2);
+    assert(rc == 0);
+    rc = hclose(s3);
+    assert(rc == 0);
+
+    rc = hclose(srv);
+    assert(rc == 0);
+    return 0;
+}
@@ -52,6 +52,27 @@ int main() {
     assert(sz == 30);
     assert(memcmp(buf, "123456789012345678901234567890", 30) == 0);
 
+    /* Scattered messages. */
+    struct iolist iol2 = {(void*)"67890", 5, NULL, 0};
+    struct iolist iol1 = {(void*)"12345", 5, &iol2, 0};
+    rc = msendl(lz0, &iol1, &iol2, -1);
+    assert(rc == 0);
+    uint8_t buf2[5];
+    struct iolist iol4 = {buf2, sizeof(buf2), NULL, 0};
+    struct iolist iol3 = {buf, 5, &iol4, 0};
+    sz = mrecvl(lz1, &iol3, &iol4, -1);
+    assert(sz == 10);
+    assert(memcmp(buf, "12345", 5) == 0);
+    assert(memcmp(buf2, "67890", 5) == 0);
+
+    /* No scratch buffers are kept. */
+    dsock_scratchlimit(0);
+    rc = msend(lz0, "ABCDEFGHIJ", 10, -1);
+    assert(rc == 0);
+    sz = mrecv(lz1, buf, 30, -1);
+    assert(sz == 10);
+    assert(memcmp(buf, "ABCDEFGHIJ", 10) == 0);
+
     rc = hclose(lz1);
     assert(rc == 0);
     rc = hclose(lz0);
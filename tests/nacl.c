@@ -23,9 +23,29 @@
 */
 
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "../dsock.h"
 
+coroutine void box_peer(int s, const void *sk, const void *peerpk) {
+    int h = nacl_attach_box(s, sk, peerpk, -1);
+    if(h < 0) {
+        assert(errno == EACCES);
+        int rc = hclose(s);
+        assert(rc == 0);
+        return;
+    }
+    char buf[10];
+    ssize_t sz = mrecv(h, buf, sizeof(buf), -1);
+    assert(sz >= 0);
+    int rc = msend(h, buf, sz, -1);
+    assert(rc == 0);
+    rc = hclose(h);
+    assert(rc == 0);
+}
+
 int main() {
 
     const char key[] = "01234567890123456789012345678901";
@@ -63,6 +83,17 @@ int main() {
     sz = mrecv(nacl0, buf, sizeof(buf), -1);
     assert(sz == 3);
     assert(buf[0] == 'H' && buf[1] == 'I' && buf[2] == 'J');
+    /* Message scattered over multiple buffers. */
+    struct iolist iol2 = {"MNOP", 4, NULL, 0};
+    struct iolist iol1 = {"KL", 2, &iol2, 0};
+    rc = msendl(nacl0, &iol1, &iol2, -1);
+    assert(rc == 0);
+    char rbuf1[3], rbuf2[10];
+    struct iolist riol2 = {rbuf2, sizeof(rbuf2), NULL, 0};
+    struct iolist riol1 = {rbuf1, sizeof(rbuf1), &riol2, 0};
+    sz = mrecvl(nacl1, &riol1, &riol2, -1);
+    assert(sz == 6);
+    assert(memcmp(rbuf1, "KLM", 3) == 0 && memcmp(rbuf2, "NOP", 3) == 0);
     rc = hclose(nacl1);
     assert(rc == 0);
     rc = hclose(nacl0);
@@ -92,6 +123,272 @@ int main() {
     rc = hclose(nacl0);
     assert(rc == 0);
 
+    /* Test alternative cipher suites. */
+    int suites[] = {DSOCK_NACL_CHACHA20_POLY1305, DSOCK_NACL_AES256_GCM};
+    int i;
+    for(i = 0; i != 2; ++i) {
+        rc = ipc_pair(s);
+        assert(rc == 0);
+        pfx0 = pfx_attach(s[0]);
+        assert(pfx0 >= 0);
+        pfx1 = pfx_attach(s[1]);
+        assert(pfx1 >= 0);
+        nacl0 = nacl_attach_suite(pfx0, suites[i], key, 32, -1);
+        assert(nacl0 >= 0);
+        nacl1 = nacl_attach_suite(pfx1, suites[i], key, 32, -1);
+        assert(nacl1 >= 0);
+        rc = msend(nacl0, "ABC", 3, -1);
+        assert(rc == 0);
+        rc = msend(nacl0, "", 0, -1);
+        assert(rc == 0);
+        sz = mrecv(nacl1, buf, sizeof(buf), -1);
+        assert(sz == 3);
+        assert(buf[0] == 'A' && buf[1] == 'B' && buf[2] == 'C');
+        sz = mrecv(nacl1, buf, sizeof(buf), -1);
+        assert(sz == 0);
+        rc = msend(nacl1, "DEFG", 4, -1);
+        assert(rc == 0);
+        sz = mrecv(nacl0, buf, sizeof(buf), -1);
+        assert(sz == 4);
+        assert(buf[0] == 'D' && buf[1] == 'E' && buf[2] == 'F' &&
+            buf[3] == 'G');
+        rc = hclose(nacl1);
+        assert(rc == 0);
+        rc = hclose(nacl0);
+        assert(rc == 0);
+    }
+
+    /* Test mismatched cipher suites. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    pfx0 = pfx_attach(s[0]);
+    assert(pfx0 >= 0);
+    pfx1 = pfx_attach(s[1]);
+    assert(pfx1 >= 0);
+    nacl0 = nacl_attach_suite(pfx0, DSOCK_NACL_AES256_GCM, key, 32, -1);
+    assert(nacl0 >= 0);
+    nacl1 = nacl_attach_suite(pfx1, DSOCK_NACL_CHACHA20_POLY1305, key, 32, -1);
+    assert(nacl1 >= 0);
+    rc = msend(nacl0, "ABC", 3, -1);
+    assert(rc == 0);
+    sz = mrecv(nacl1, buf, sizeof(buf), -1);
+    assert(sz == -1 && errno == EACCES);
+    rc = hclose(nacl1);
+    assert(rc == 0);
+    rc = hclose(nacl0);
+    assert(rc == 0);
+    rc = nacl_attach_suite(s[0], 100, key, 32, -1);
+    assert(rc < 0 && errno == EINVAL);
+
+    /* Test chunked messages. */
+    static uint8_t big[10000], rbig[10000];
+    size_t j;
+    for(j = 0; j != sizeof(big); ++j) big[j] = (uint8_t)j;
+    int allsuites[] = {DSOCK_NACL_XSALSA20_POLY1305,
+        DSOCK_NACL_CHACHA20_POLY1305, DSOCK_NACL_AES256_GCM};
+    for(i = 0; i != 3; ++i) {
+        rc = ipc_pair(s);
+        assert(rc == 0);
+        pfx0 = pfx_attach(s[0]);
+        assert(pfx0 >= 0);
+        pfx1 = pfx_attach(s[1]);
+        assert(pfx1 >= 0);
+        nacl0 = nacl_attach_suite(pfx0, allsuites[i], key, 32, -1);
+        assert(nacl0 >= 0);
+        nacl1 = nacl_attach_suite(pfx1, allsuites[i], key, 32, -1);
+        assert(nacl1 >= 0);
+        rc = nacl_setchunklen(nacl0, 1000);
+        assert(rc == 0);
+        rc = nacl_setchunklen(nacl1, 1000);
+        assert(rc == 0);
+        size_t sizes[] = {sizeof(big), 3000, 999, 0};
+        for(j = 0; j != 4; ++j) {
+            rc = msend(nacl0, big, sizes[j], -1);
+            assert(rc == 0);
+            memset(rbig, 0, sizeof(rbig));
+            sz = mrecv(nacl1, rbig, sizeof(rbig), -1);
+            assert(sz == sizes[j]);
+            assert(memcmp(rbig, big, sizes[j]) == 0);
+        }
+        rc = hclose(nacl1);
+        assert(rc == 0);
+        rc = hclose(nacl0);
+        assert(rc == 0);
+    }
+
+    /* Message bigger than the scratch buffer limit followed by a small one.
+       Scratch buffer used for the big message is not kept in the pool. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    pfx0 = pfx_attach(s[0]);
+    assert(pfx0 >= 0);
+    pfx1 = pfx_attach(s[1]);
+    assert(pfx1 >= 0);
+    nacl0 = nacl_attach(pfx0, key, 32, -1);
+    assert(nacl0 >= 0);
+    nacl1 = nacl_attach(pfx1, key, 32, -1);
+    assert(nacl1 >= 0);
+    size_t largesz = 1536 * 1024;
+    uint8_t *large = malloc(largesz);
+    assert(large);
+    uint8_t *rlarge = malloc(largesz + 1);
+    assert(rlarge);
+    for(j = 0; j != largesz; ++j) large[j] = (uint8_t)j;
+    rc = msend(nacl0, large, largesz, -1);
+    assert(rc == 0);
+    sz = mrecv(nacl1, rlarge, largesz + 1, -1);
+    assert(sz == (ssize_t)largesz);
+    assert(memcmp(large, rlarge, largesz) == 0);
+    rc = msend(nacl0, "QRS", 3, -1);
+    assert(rc == 0);
+    sz = mrecv(nacl1, buf, sizeof(buf), -1);
+    assert(sz == 3);
+    assert(memcmp(buf, "QRS", 3) == 0);
+    free(rlarge);
+    free(large);
+    rc = hclose(nacl1);
+    assert(rc == 0);
+    rc = hclose(nacl0);
+    assert(rc == 0);
+
+    /* Test compact framing, including wrap-around of the short nonce. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    pfx0 = pfx_attach(s[0]);
+    assert(pfx0 >= 0);
+    pfx1 = pfx_attach(s[1]);
+    assert(pfx1 >= 0);
+    nacl0 = nacl_attach(pfx0, key, 32, -1);
+    assert(nacl0 >= 0);
+    nacl1 = nacl_attach(pfx1, key, 32, -1);
+    assert(nacl1 >= 0);
+    rc = nacl_setcompact(nacl0, 1);
+    assert(rc == 0);
+    rc = nacl_setcompact(nacl1, 1);
+    assert(rc == 0);
+    for(j = 0; j != 600; ++j) {
+        rc = msend(nacl0, &j, sizeof(j), -1);
+        assert(rc == 0);
+        size_t val;
+        sz = mrecv(nacl1, &val, sizeof(val), -1);
+        assert(sz == sizeof(val));
+        assert(val == j);
+    }
+    rc = nacl_setcompact(nacl0, 9);
+    assert(rc == -1 && errno == EINVAL);
+    rc = hclose(nacl1);
+    assert(rc == 0);
+    rc = hclose(nacl0);
+    assert(rc == 0);
+
+    /* Test replay window. Messages are captured on the wire and delivered
+       out of order, some of them twice. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    pfx0 = pfx_attach(s[0]);
+    assert(pfx0 >= 0);
+    pfx1 = pfx_attach(s[1]);
+    assert(pfx1 >= 0);
+    int t[2];
+    rc = ipc_pair(t);
+    assert(rc == 0);
+    int fwd = pfx_attach(t[0]);
+    assert(fwd >= 0);
+    int pfx2 = pfx_attach(t[1]);
+    assert(pfx2 >= 0);
+    nacl0 = nacl_attach(pfx0, key, 32, -1);
+    assert(nacl0 >= 0);
+    nacl1 = nacl_attach(pfx2, key, 32, -1);
+    assert(nacl1 >= 0);
+    rc = nacl_setwindow(nacl1, 64);
+    assert(rc == 0);
+    rc = nacl_setcompact(nacl1, 1);
+    assert(rc == -1 && errno == EINVAL);
+    uint8_t wire[200][64];
+    ssize_t wiresz[200];
+    for(j = 0; j != 200; ++j) {
+        rc = msend(nacl0, &j, sizeof(j), -1);
+        assert(rc == 0);
+        wiresz[j] = mrecv(pfx1, wire[j], sizeof(wire[j]), -1);
+        assert(wiresz[j] > 0);
+    }
+    size_t order[] = {1, 0, 3, 3, 2, 1, 100, 60, 61, 100, 36, 37, 199, 150};
+    int ok[] = {1, 1, 1, 0, 1, 0, 1, 1, 1, 0, 0, 1, 1, 1};
+    for(j = 0; j != sizeof(order) / sizeof(order[0]); ++j) {
+        rc = msend(fwd, wire[order[j]], wiresz[order[j]], -1);
+        assert(rc == 0);
+        size_t val;
+        sz = mrecv(nacl1, &val, sizeof(val), -1);
+        if(ok[j]) {
+            assert(sz == sizeof(val));
+            assert(val == order[j]);
+        }
+        else {
+            assert(sz == -1 && errno == EACCES);
+        }
+    }
+    /* Message sent by the receiver itself is rejected. */
+    rc = msend(nacl1, "ABC", 3, -1);
+    assert(rc == 0);
+    sz = mrecv(fwd, wire[0], sizeof(wire[0]), -1);
+    assert(sz > 0);
+    rc = msend(fwd, wire[0], sz, -1);
+    assert(rc == 0);
+    sz = mrecv(nacl1, buf, sizeof(buf), -1);
+    assert(sz == -1 && errno == EACCES);
+    rc = hclose(nacl1);
+    assert(rc == 0);
+    rc = hclose(nacl0);
+    assert(rc == 0);
+    rc = hclose(fwd);
+    assert(rc == 0);
+    rc = hclose(pfx1);
+    assert(rc == 0);
+
+    /* Test public-key handshake. */
+    uint8_t pk0[32], sk0[32], pk1[32], sk1[32], pk2[32], sk2[32];
+    rc = nacl_keypair(pk0, sk0, -1);
+    assert(rc == 0);
+    rc = nacl_keypair(pk1, sk1, -1);
+    assert(rc == 0);
+    rc = nacl_keypair(pk2, sk2, -1);
+    assert(rc == 0);
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    pfx0 = pfx_attach(s[0]);
+    assert(pfx0 >= 0);
+    pfx1 = pfx_attach(s[1]);
+    assert(pfx1 >= 0);
+    int cr = go(box_peer(pfx1, sk1, pk0));
+    assert(cr >= 0);
+    nacl0 = nacl_attach_box(pfx0, sk0, pk1, -1);
+    assert(nacl0 >= 0);
+    rc = msend(nacl0, "ABC", 3, -1);
+    assert(rc == 0);
+    sz = mrecv(nacl0, buf, sizeof(buf), -1);
+    assert(sz == 3);
+    assert(buf[0] == 'A' && buf[1] == 'B' && buf[2] == 'C');
+    rc = hclose(nacl0);
+    assert(rc == 0);
+    rc = hclose(cr);
+    assert(rc == 0);
+
+    /* Test public-key handshake with an unexpected peer. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    pfx0 = pfx_attach(s[0]);
+    assert(pfx0 >= 0);
+    pfx1 = pfx_attach(s[1]);
+    assert(pfx1 >= 0);
+    cr = go(box_peer(pfx1, sk2, pk0));
+    assert(cr >= 0);
+    rc = nacl_attach_box(pfx0, sk0, pk1, -1);
+    assert(rc < 0 && errno == EACCES);
+    rc = hclose(pfx0);
+    assert(rc == 0);
+    rc = hclose(cr);
+    assert(rc == 0);
+
     return 0;
 }
 
@@ -0,0 +1,95 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../poly1305.h"
+#include "../tweetnacl/tweetnacl.h"
+
+/* tweetnacl needs this to link but it's not used here. */
+void randombytes(uint8_t *buf, uint64_t len) {
+    (void)buf;
+    (void)len;
+    abort();
+}
+
+int main() {
+    /* Test vector from RFC 8439, section 2.5.2. */
+    static const uint8_t key1[32] = {
+        0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33,
+        0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+        0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd,
+        0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b};
+    static const uint8_t tag1[16] = {
+        0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6,
+        0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9};
+    const char *msg1 = "Cryptographic Forum Research Group";
+    uint8_t tag[16];
+    poly1305(tag, (const uint8_t*)msg1, strlen(msg1), key1);
+    assert(memcmp(tag, tag1, 16) == 0);
+    assert(poly1305_verify(tag1, (const uint8_t*)msg1, strlen(msg1),
+        key1) == 0);
+    /* Accumulator exceeds p before the final reduction (RFC 8439,
+       appendix A.3, test vector #6). */
+    static const uint8_t key2[32] = {2};
+    uint8_t msg2[16];
+    memset(msg2, 0xff, sizeof(msg2));
+    static const uint8_t tag2[16] = {3};
+    poly1305(tag, msg2, sizeof(msg2), key2);
+    assert(memcmp(tag, tag2, 16) == 0);
+
+    /* Check against the reference implementation with various lengths
+       and keys, and with the message fed in arbitrary pieces. */
+    static uint8_t m[1100];
+    uint8_t key[32], tag3[16];
+    size_t i, len;
+    for(i = 0; i != sizeof(m); ++i) m[i] = (uint8_t)(i * 7 + 3);
+    for(len = 0; len != sizeof(m); ++len) {
+        for(i = 0; i != sizeof(key); ++i)
+            key[i] = (uint8_t)(i * 31 + len * 17);
+        if(len % 3 == 0) memset(key, 0xff, 16);
+        crypto_onetimeauth(tag, m, len, key);
+        poly1305(tag3, m, len, key);
+        assert(memcmp(tag, tag3, 16) == 0);
+        struct poly1305 st;
+        poly1305_init(&st, key);
+        size_t pos = 0, step = 1;
+        while(pos != len) {
+            size_t n = step < len - pos ? step : len - pos;
+            poly1305_update(&st, m + pos, n);
+            pos += n;
+            step = step * 3 % 37 + 1;
+        }
+        poly1305_finish(&st, tag3);
+        assert(memcmp(tag, tag3, 16) == 0);
+        assert(poly1305_verify(tag, m, len, key) == 0);
+        tag[len % 16] ^= 0x40;
+        assert(poly1305_verify(tag, m, len, key) == -1);
+    }
+
+    return 0;
+}
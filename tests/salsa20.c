@@ -0,0 +1,87 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../salsa20.h"
+#include "../tweetnacl/tweetnacl.h"
+
+/* tweetnacl needs this to link but it's not used here. */
+void randombytes(uint8_t *buf, uint64_t len) {
+    (void)buf;
+    (void)len;
+    abort();
+}
+
+int main() {
+    uint8_t key[32], nonce[24];
+    size_t i;
+    for(i = 0; i != sizeof(key); ++i) key[i] = (uint8_t)(i * 13 + 1);
+    for(i = 0; i != sizeof(nonce); ++i) nonce[i] = (uint8_t)(i * 29 + 7);
+
+    /* HSalsa20 matches the reference. */
+    static const uint8_t sigma[16] = "expand 32-byte k";
+    uint8_t sub1[32], sub2[32];
+    crypto_core_hsalsa20(sub1, nonce, key, sigma);
+    hsalsa20(sub2, nonce, key);
+    assert(memcmp(sub1, sub2, 32) == 0);
+
+    /* Check against the reference implementation with various lengths
+       and alignments, both XORing the data and producing raw keystream.
+       Lengths cover the vector kernels as well as the tails. */
+    static uint8_t src[2100], dst1[2100], dst2[2100];
+    for(i = 0; i != sizeof(src); ++i) src[i] = (uint8_t)(i * 7 + 3);
+    size_t off, len;
+    for(off = 0; off != 4; ++off) {
+        for(len = 0; len <= 2048; len += (len < 600 ? 1 : 61)) {
+            crypto_stream_xsalsa20_xor(dst1, src + off, len, nonce, key);
+            xsalsa20_xor(dst2 + off, src + off, len, nonce, 0, key);
+            assert(memcmp(dst1, dst2 + off, len) == 0);
+            crypto_stream_salsa20_xor(dst1, src + off, len, nonce, key);
+            salsa20_xor(dst2 + off, src + off, len, nonce, 0, key);
+            assert(memcmp(dst1, dst2 + off, len) == 0);
+            if(len) {
+                crypto_stream_xsalsa20(dst1, len, nonce, key);
+                xsalsa20_xor(dst2 + off, NULL, len, nonce, 0, key);
+                assert(memcmp(dst1, dst2 + off, len) == 0);
+            }
+        }
+    }
+    /* Keystream can be started at any block. */
+    crypto_stream_salsa20(dst1, sizeof(dst1), nonce, key);
+    for(i = 0; i != 20; ++i) {
+        salsa20_xor(dst2, NULL, sizeof(dst2) - 64 * i, nonce, i, key);
+        assert(memcmp(dst1 + 64 * i, dst2, sizeof(dst2) - 64 * i) == 0);
+    }
+    /* In-place operation. */
+    memcpy(dst2, src, sizeof(src));
+    crypto_stream_xsalsa20_xor(dst1, src, sizeof(src), nonce, key);
+    xsalsa20_xor(dst2, dst2, sizeof(src), nonce, 0, key);
+    assert(memcmp(dst1, dst2, sizeof(src)) == 0);
+
+    return 0;
+}
@@ -23,10 +23,23 @@
 */
 
 #include <assert.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "../dsock.h"
 
+coroutine void sender(int s, const void *buf, size_t len) {
+    int rc = msend(s, buf, len, -1);
+    assert(rc == 0);
+}
+
+coroutine void receiver(int s, int64_t *when) {
+    char buf[16];
+    ssize_t sz = mrecv(s, buf, sizeof(buf), -1);
+    assert(sz == 6 && memcmp(buf, "ABCDEF", 6) == 0);
+    *when = now();
+}
+
 int main() {
     int h[2];
     int rc = ipc_pair(h);
@@ -45,10 +58,360 @@ int main() {
     sz = mrecv(s0, buf, sizeof(buf), -1);
     assert(sz == 3 && memcmp(buf, "DEF", 3) == 0);
 
+    /* Masked message spanning multiple unaligned buffers. */
+    static char msg[5000];
+    static char rbuf[5000];
+    size_t i;
+    for(i = 0; i != sizeof(msg); ++i) msg[i] = (char)(i * 31);
+    struct iolist iol3 = {msg + 1003, sizeof(msg) - 1003, NULL, 0};
+    struct iolist iol2 = {msg + 3, 1000, &iol3, 0};
+    struct iolist iol1 = {msg, 3, &iol2, 0};
+    rc = msendl(s0, &iol1, &iol3, -1);
+    assert(rc == 0);
+    struct iolist riol2 = {rbuf + 7, sizeof(rbuf) - 7, NULL, 0};
+    struct iolist riol1 = {rbuf, 7, &riol2, 0};
+    sz = mrecvl(s1, &riol1, &riol2, -1);
+    assert(sz == sizeof(msg) && memcmp(rbuf, msg, sizeof(msg)) == 0);
+
+    /* Pings are answered automatically. */
+    rc = websock_rtt(s1);
+    assert(rc < 0 && errno == EAGAIN);
+    rc = websock_ping(s1, -1);
+    assert(rc == 0);
+    rc = msend(s1, "GHI", 3, -1);
+    assert(rc == 0);
+    rc = websock_ping(s0, -1);
+    assert(rc == 0);
+    sz = mrecv(s0, buf, sizeof(buf), -1);
+    assert(sz == 3 && memcmp(buf, "GHI", 3) == 0);
+    rc = msend(s0, "JKL", 3, -1);
+    assert(rc == 0);
+    sz = mrecv(s1, buf, sizeof(buf), -1);
+    assert(sz == 3 && memcmp(buf, "JKL", 3) == 0);
+    int64_t rtt = websock_rtt(s1);
+    assert(rtt >= 0);
+    rc = msend(s1, "MNO", 3, -1);
+    assert(rc == 0);
+    sz = mrecv(s0, buf, sizeof(buf), -1);
+    assert(sz == 3 && memcmp(buf, "MNO", 3) == 0);
+    rtt = websock_rtt(s0);
+    assert(rtt >= 0);
+
+    /* Streamed message. */
+    rc = websock_setfragment(s0, 4);
+    assert(rc == 0);
+    rc = websock_append(s0, &iol1, &iol1, -1);
+    assert(rc < 0 && errno == EINVAL);
+    rc = websock_begin(s0);
+    assert(rc == 0);
+    rc = msend(s0, "ABC", 3, -1);
+    assert(rc < 0 && errno == EBUSY);
+    struct iolist siol = {(void*)"abcdefghij", 10, NULL, 0};
+    rc = websock_append(s0, &siol, &siol, -1);
+    assert(rc == 0);
+    rc = websock_ping(s0, -1);
+    assert(rc == 0);
+    siol.iol_base = (void*)"kl";
+    siol.iol_len = 2;
+    rc = websock_append(s0, &siol, &siol, -1);
+    assert(rc == 0);
+    rc = websock_end(s0, -1);
+    assert(rc == 0);
+    sz = mrecv(s1, buf, sizeof(buf), -1);
+    assert(sz == 12 && memcmp(buf, "abcdefghijkl", 12) == 0);
+    rc = websock_begin(s1);
+    assert(rc == 0);
+    rc = websock_end(s1, -1);
+    assert(rc == 0);
+    sz = mrecv(s0, buf, sizeof(buf), -1);
+    assert(sz == 0);
+
+    /* Partial delivery. */
+    rc = msendl(s0, &iol1, &iol3, -1);
+    assert(rc == 0);
+    memset(rbuf, 0, sizeof(rbuf));
+    size_t total = 0;
+    int eom = 0;
+    while(!eom) {
+        struct iolist piol = {rbuf + total, 1000, NULL, 0};
+        sz = websock_recvpart(s1, &piol, &piol, &eom, -1);
+        assert(sz >= 0 && sz <= 1000);
+        total += sz;
+    }
+    assert(total == sizeof(msg) && memcmp(rbuf, msg, sizeof(msg)) == 0);
+    rc = websock_begin(s0);
+    assert(rc == 0);
+    siol.iol_base = (void*)"abcdef";
+    siol.iol_len = 6;
+    rc = websock_append(s0, &siol, &siol, -1);
+    assert(rc == 0);
+    struct iolist piol = {buf, 3, NULL, 0};
+    sz = websock_recvpart(s1, &piol, &piol, &eom, -1);
+    assert(sz == 3 && eom == 0 && memcmp(buf, "abc", 3) == 0);
+    sz = mrecv(s1, buf, sizeof(buf), -1);
+    assert(sz < 0 && errno == EBUSY);
+    piol.iol_len = sizeof(buf);
+    sz = websock_recvpart(s1, &piol, &piol, &eom, -1);
+    assert(sz == 1 && eom == 0 && memcmp(buf, "d", 1) == 0);
+    sz = websock_recvpart(s1, &piol, &piol, &eom, -1);
+    assert(sz == 2 && eom == 0 && memcmp(buf, "ef", 2) == 0);
+    rc = websock_end(s0, -1);
+    assert(rc == 0);
+    sz = websock_recvpart(s1, &piol, &piol, &eom, -1);
+    assert(sz == 0 && eom == 1);
+
+    /* Small staging buffer splits the message into multiple writes. */
+    rc = websock_setbuf(s0, 100);
+    assert(rc == 0);
+    rc = msendl(s0, &iol1, &iol3, -1);
+    assert(rc == 0);
+    memset(rbuf, 0, sizeof(rbuf));
+    sz = mrecvl(s1, &riol1, &riol2, -1);
+    assert(sz == sizeof(msg) && memcmp(rbuf, msg, sizeof(msg)) == 0);
+
+    /* In-place masking. */
+    static char copy[5000];
+    memcpy(copy, msg, sizeof(msg));
+    rc = websock_setinplace(s0, 1);
+    assert(rc == 0);
+    rc = msendl(s0, &iol1, &iol3, -1);
+    assert(rc == 0);
+    memset(rbuf, 0, sizeof(rbuf));
+    sz = mrecvl(s1, &riol1, &riol2, -1);
+    assert(sz == sizeof(msg) && memcmp(rbuf, copy, sizeof(msg)) == 0);
+
+    /* Broadcast of a pre-encoded frame. */
+    int h2[2];
+    rc = ipc_pair(h2);
+    assert(rc == 0);
+    int s2 = websock_attach(h2[0], 1);
+    assert(s2 >= 0);
+    int s3 = websock_attach(h2[1], 0);
+    assert(s3 >= 0);
+    struct iolist biol2 = {(void*)"DEF", 3, NULL, 0};
+    struct iolist biol1 = {(void*)"ABC", 3, &biol2, 0};
+    int f = websock_mkframe(&biol1, &biol2, 0);
+    assert(f >= 0);
+    int hs[] = {s1, s0, s3};
+    int errs[3];
+    rc = websock_broadcast(f, hs, errs, 3, -1);
+    assert(rc == 2);
+    assert(errs[0] == 0 && errs[1] == EINVAL && errs[2] == 0);
+    rc = websock_broadcast(f, NULL, NULL, 0, -1);
+    assert(rc == 0);
+    rc = hclose(f);
+    assert(rc == 0);
+    sz = mrecv(s0, buf, sizeof(buf), -1);
+    assert(sz == 6 && memcmp(buf, "ABCDEF", 6) == 0);
+    sz = mrecv(s2, buf, sizeof(buf), -1);
+    assert(sz == 6 && memcmp(buf, "ABCDEF", 6) == 0);
+    rc = hclose(s2);
+    assert(rc == 0);
+    rc = hclose(s3);
+    assert(rc == 0);
+
+    /* Slow connection doesn't hold up the broadcast to the others. */
+    int h3[2];
+    rc = ipc_pair(h3);
+    assert(rc == 0);
+    int t4 = bthrottler_attach(h3[1], 10, 100, 0, 0);
+    assert(t4 >= 0);
+    int s4 = websock_attach(t4, 0);
+    assert(s4 >= 0);
+    rc = ipc_pair(h2);
+    assert(rc == 0);
+    s2 = websock_attach(h2[0], 1);
+    assert(s2 >= 0);
+    s3 = websock_attach(h2[1], 0);
+    assert(s3 >= 0);
+    int64_t when = -1;
+    int cr = go(receiver(s2, &when));
+    assert(cr >= 0);
+    f = websock_mkframe(&biol1, &biol2, 0);
+    assert(f >= 0);
+    int hs2[] = {s4, s3};
+    int64_t start = now();
+    rc = websock_broadcast(f, hs2, errs, 2, -1);
+    assert(rc == 2);
+    assert(errs[0] == 0 && errs[1] == 0);
+    assert(now() - start >= 500);
+    assert(when >= 0 && when - start < 100);
+    rc = hclose(f);
+    assert(rc == 0);
+    rc = hclose(cr);
+    assert(rc == 0);
+    rc = hclose(s2);
+    assert(rc == 0);
+    rc = hclose(s3);
+    assert(rc == 0);
+    rc = hclose(s4);
+    assert(rc == 0);
+    rc = hclose(h3[0]);
+    assert(rc == 0);
+
     rc = hclose(s0);
     assert(rc == 0);
     rc = hclose(s1);
     assert(rc == 0);
+
+    /* Fragmented message with a different mask in each fragment. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s1 = websock_attach(h[1], 0);
+    assert(s1 >= 0);
+    uint8_t frame1[] = {0x02, 0x85, 1, 2, 3, 4,
+        'a' ^ 1, 'b' ^ 2, 'c' ^ 3, 'd' ^ 4, 'e' ^ 1};
+    uint8_t frame2[] = {0x80, 0x83, 5, 6, 7, 8, 'f' ^ 5, 'g' ^ 6, 'h' ^ 7};
+    rc = bsend(h[0], frame1, sizeof(frame1), -1);
+    assert(rc == 0);
+    rc = bsend(h[0], frame2, sizeof(frame2), -1);
+    assert(rc == 0);
+    /* Fragments don't align with the receive buffers. */
+    memset(rbuf, 0, sizeof(rbuf));
+    riol2.iol_base = rbuf + 3;
+    riol2.iol_len = 2;
+    struct iolist riol3 = {rbuf + 5, 10, NULL, 0};
+    riol1.iol_len = 3;
+    riol2.iol_next = &riol3;
+    sz = mrecvl(s1, &riol1, &riol3, -1);
+    assert(sz == 8 && memcmp(rbuf, "abcdefgh", 8) == 0);
+
+    /* Close frame. */
+    uint8_t frame3[] = {0x88, 0x82, 1, 2, 3, 4, 0x03 ^ 1, 0xe8 ^ 2};
+    rc = bsend(h[0], frame3, sizeof(frame3), -1);
+    assert(rc == 0);
+    sz = mrecv(s1, buf, sizeof(buf), -1);
+    assert(sz < 0 && errno == EPIPE);
+    uint8_t reply[4];
+    rc = brecv(h[0], reply, sizeof(reply), -1);
+    assert(rc == 0);
+    assert(reply[0] == 0x88 && reply[1] == 2 && reply[2] == 0x03 &&
+        reply[3] == 0xe8);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(h[0]);
+    assert(rc == 0);
+
+    /* Control frames are not interleaved with a frame being sent. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    int t1 = bthrottler_attach(h[1], 1000, 10, 0, 0);
+    assert(t1 >= 0);
+    s1 = websock_attach(t1, 0);
+    assert(s1 >= 0);
+    memset(msg, 'x', 100);
+    cr = go(sender(s1, msg, 100));
+    assert(cr >= 0);
+    rc = msleep(now() + 20);
+    assert(rc == 0);
+    uint8_t pingframe[] = {0x89, 0x84, 1, 2, 3, 4,
+        'p' ^ 1, 'i' ^ 2, 'n' ^ 3, 'g' ^ 4};
+    rc = bsend(h[0], pingframe, sizeof(pingframe), -1);
+    assert(rc == 0);
+    rc = bsend(h[0], frame3, sizeof(frame3), -1);
+    assert(rc == 0);
+    sz = mrecv(s1, buf, sizeof(buf), -1);
+    assert(sz < 0 && errno == EPIPE);
+    /* Pong and the echoed close follow the message. */
+    rc = brecv(h[0], rbuf, 112, -1);
+    assert(rc == 0);
+    assert((uint8_t)rbuf[0] == 0x82 && rbuf[1] == 100);
+    assert(memcmp(rbuf + 2, msg, 100) == 0);
+    assert(memcmp(rbuf + 102, "\x8a\x04ping\x88\x02\x03\xe8", 10) == 0);
+    rc = hclose(cr);
+    assert(rc == 0);
+    rc = msend(s1, "ABC", 3, -1);
+    assert(rc < 0 && errno == EPIPE);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(h[0]);
+    assert(rc == 0);
+
+    /* Writers wait for the frame being sent rather than failing. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    t1 = bthrottler_attach(h[1], 1000, 10, 0, 0);
+    assert(t1 >= 0);
+    s1 = websock_attach(t1, 0);
+    assert(s1 >= 0);
+    cr = go(sender(s1, msg, 100));
+    assert(cr >= 0);
+    rc = msleep(now() + 20);
+    assert(rc == 0);
+    rc = websock_ping(s1, -1);
+    assert(rc == 0);
+    rc = msend(s1, "ABC", 3, -1);
+    assert(rc == 0);
+    rc = brecv(h[0], rbuf, 117, -1);
+    assert(rc == 0);
+    assert((uint8_t)rbuf[0] == 0x82 && rbuf[1] == 100);
+    assert((uint8_t)rbuf[102] == 0x89 && rbuf[103] == 8);
+    assert(memcmp(rbuf + 112, "\x82\x03" "ABC", 5) == 0);
+    rc = hclose(cr);
+    assert(rc == 0);
+    /* The same applies to the automatic pong. */
+    uint8_t bigping[106] = {0x89, 0x80 | 100, 0, 0, 0, 0};
+    memset(bigping + 6, 'y', 100);
+    rc = bsend(h[0], bigping, sizeof(bigping), -1);
+    assert(rc == 0);
+    uint8_t frame8[] = {0x82, 0x86, 0, 0, 0, 0, 'A', 'B', 'C', 'D', 'E', 'F'};
+    rc = bsend(h[0], frame8, sizeof(frame8), -1);
+    assert(rc == 0);
+    cr = go(receiver(s1, &when));
+    assert(cr >= 0);
+    rc = msleep(now() + 20);
+    assert(rc == 0);
+    rc = msend(s1, "GHI", 3, -1);
+    assert(rc == 0);
+    rc = brecv(h[0], rbuf, 107, -1);
+    assert(rc == 0);
+    assert((uint8_t)rbuf[0] == 0x8a && rbuf[1] == 100 && rbuf[101] == 'y');
+    assert(memcmp(rbuf + 102, "\x82\x03" "GHI", 5) == 0);
+    rc = hclose(cr);
+    assert(rc == 0);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(h[0]);
+    assert(rc == 0);
+
+    /* Text message with a UTF-8 sequence split between fragments. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s1 = websock_attach(h[1], 0);
+    assert(s1 >= 0);
+    uint8_t frame4[] = {0x01, 0x83, 0, 0, 0, 0, 'a', 0xe2, 0x82};
+    uint8_t frame5[] = {0x80, 0x82, 0, 0, 0, 0, 0xac, 'b'};
+    rc = bsend(h[0], frame4, sizeof(frame4), -1);
+    assert(rc == 0);
+    rc = bsend(h[0], frame5, sizeof(frame5), -1);
+    assert(rc == 0);
+    sz = mrecv(s1, buf, sizeof(buf), -1);
+    assert(sz == 5 && memcmp(buf, "a\xe2\x82\xac" "b", 5) == 0);
+    /* Truncated sequence at the end of the message. */
+    uint8_t frame6[] = {0x81, 0x82, 0, 0, 0, 0, 'a', 0xc3};
+    rc = bsend(h[0], frame6, sizeof(frame6), -1);
+    assert(rc == 0);
+    sz = mrecv(s1, buf, sizeof(buf), -1);
+    assert(sz < 0 && errno == EPROTO);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(h[0]);
+    assert(rc == 0);
+
+    /* Invalid UTF-8 (encoded surrogate) in a text message. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s1 = websock_attach(h[1], 0);
+    assert(s1 >= 0);
+    uint8_t frame7[] = {0x81, 0x83, 0, 0, 0, 0, 0xed, 0xa0, 0x80};
+    rc = bsend(h[0], frame7, sizeof(frame7), -1);
+    assert(rc == 0);
+    sz = mrecv(s1, buf, sizeof(buf), -1);
+    assert(sz < 0 && errno == EPROTO);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(h[0]);
+    assert(rc == 0);
     return 0;
 }
 
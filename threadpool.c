@@ -0,0 +1,142 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <libdill.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "threadpool.h"
+#include "utils.h"
+
+#define THREADPOOL_MAXTHREADS 64
+
+struct threadpool_job {
+    struct threadpool_job *next;
+    void (*fn)(void *arg, size_t i);
+    void *arg;
+    size_t n;
+    /* Index of the next call to hand out to a worker. */
+    size_t started;
+    /* Number of calls that have finished. */
+    size_t done;
+    /* Worker that finishes the last call writes a byte here. */
+    int fds[2];
+};
+
+/* Queue of jobs that still have calls to hand out. */
+static pthread_mutex_t threadpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t threadpool_cond = PTHREAD_COND_INITIALIZER;
+static struct threadpool_job *threadpool_first = NULL;
+static struct threadpool_job *threadpool_last = NULL;
+static pthread_once_t threadpool_once = PTHREAD_ONCE_INIT;
+static int threadpool_nthreads = 0;
+
+static void *threadpool_worker(void *arg) {
+    pthread_mutex_lock(&threadpool_lock);
+    while(1) {
+        while(!threadpool_first)
+            pthread_cond_wait(&threadpool_cond, &threadpool_lock);
+        struct threadpool_job *job = threadpool_first;
+        size_t i = job->started++;
+        if(job->started == job->n) {
+            threadpool_first = job->next;
+            if(!threadpool_first) threadpool_last = NULL;
+        }
+        pthread_mutex_unlock(&threadpool_lock);
+        job->fn(job->arg, i);
+        pthread_mutex_lock(&threadpool_lock);
+        if(++job->done == job->n) {
+            /* The job may be deallocated as soon as the byte is written. */
+            int fd = job->fds[1];
+            pthread_mutex_unlock(&threadpool_lock);
+            ssize_t sz = write(fd, "", 1);
+            dsock_assert(sz == 1);
+            pthread_mutex_lock(&threadpool_lock);
+        }
+    }
+    return NULL;
+}
+
+static void threadpool_init(void) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(ncpus < 1) ncpus = 1;
+    if(ncpus > THREADPOOL_MAXTHREADS) ncpus = THREADPOOL_MAXTHREADS;
+    pthread_attr_t attr;
+    int rc = pthread_attr_init(&attr);
+    if(dsock_slow(rc != 0)) return;
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int i;
+    for(i = 0; i != ncpus; ++i) {
+        pthread_t thread;
+        rc = pthread_create(&thread, &attr, threadpool_worker, NULL);
+        if(dsock_slow(rc != 0)) break;
+        threadpool_nthreads++;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+int threadpool_run(void (*fn)(void *arg, size_t i), void *arg, size_t n) {
+    if(dsock_slow(!n)) return 0;
+    pthread_once(&threadpool_once, threadpool_init);
+    struct threadpool_job job;
+    /* With no workers or a single call there's nothing to gain. */
+    if(dsock_slow(threadpool_nthreads == 0 || n == 1 ||
+          pipe(job.fds) != 0)) {
+        size_t i;
+        for(i = 0; i != n; ++i) fn(arg, i);
+        return 0;
+    }
+    job.next = NULL;
+    job.fn = fn;
+    job.arg = arg;
+    job.n = n;
+    job.started = 0;
+    job.done = 0;
+    pthread_mutex_lock(&threadpool_lock);
+    if(threadpool_last) threadpool_last->next = &job;
+    else threadpool_first = &job;
+    threadpool_last = &job;
+    pthread_cond_broadcast(&threadpool_cond);
+    pthread_mutex_unlock(&threadpool_lock);
+    /* Let other coroutines run while the workers are busy. */
+    int err = 0;
+    int rc = fdin(job.fds[0], -1);
+    /* If canceled, the job lives on the stack, so wait for the workers
+       anyway. The pipe is blocking, so this blocks the thread, but the
+       remaining work is bounded. */
+    if(dsock_slow(rc < 0)) err = errno;
+    char c;
+    ssize_t sz;
+    do {
+        sz = read(job.fds[0], &c, 1);
+    } while(sz < 0 && errno == EINTR);
+    dsock_assert(sz == 1);
+    fdclean(job.fds[0]);
+    close(job.fds[0]);
+    close(job.fds[1]);
+    if(dsock_slow(err)) {errno = err; return -1;}
+    return 0;
+}
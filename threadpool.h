@@ -0,0 +1,38 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef DSOCK_THREADPOOL_H_INCLUDED
+#define DSOCK_THREADPOOL_H_INCLUDED
+
+#include <stddef.h>
+
+/* Calls fn(arg, i) for each i in [0, n) on a shared pool of worker threads.
+   The calling coroutine is suspended, but other coroutines keep running,
+   until all the calls are done. If the pool can't be used, the calls are
+   executed in the calling thread. 'fn' must not use libdill.
+   Fails with ECANCELED if the coroutine is canceled. Even then it returns
+   only after all the calls are done, so that 'arg' can be safely freed. */
+int threadpool_run(void (*fn)(void *arg, size_t i), void *arg, size_t n);
+
+#endif
@@ -0,0 +1,314 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <string.h>
+#include <sys/types.h>
+
+#include "utf8.h"
+#include "utils.h"
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#define UTF8_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+void utf8_init(struct utf8 *self) {
+    self->need = 0;
+    self->lo = 0x80;
+    self->hi = 0xbf;
+}
+
+/* Length of the ASCII-only prefix of the data, rounded down to whole
+   blocks. Most of the text on the wire is ASCII so the full validation
+   is done only for the remaining bytes. */
+
+#if defined UTF8_X86
+
+__attribute__((target("avx2")))
+static size_t utf8_ascii_avx2(const uint8_t *data, size_t len) {
+    size_t i;
+    for(i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        if(_mm256_movemask_epi8(v)) break;
+    }
+    return i;
+}
+
+static int utf8_hasavx2(void) {
+    static int avx2 = -1;
+    if(dsock_slow(avx2 < 0)) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return avx2;
+}
+
+static int utf8_hasssse3(void) {
+    static int ssse3 = -1;
+    if(dsock_slow(ssse3 < 0)) {
+        __builtin_cpu_init();
+        ssse3 = __builtin_cpu_supports("ssse3") ? 1 : 0;
+    }
+    return ssse3;
+}
+
+/* Vectorized validation of text that is not ASCII, as described in Keiser
+   and Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte".
+   Each byte is classified by looking up the high and the low nibble of the
+   preceding byte and the high nibble of the byte itself in the tables
+   below. Each bit stands for one kind of error and the byte is invalid if
+   all three lookups have the bit set. Second continuation byte following
+   a three- or four-byte lead and the third one following a four-byte lead
+   are told apart from stray continuation bytes by looking two and three
+   bytes back. */
+
+#define UTF8_TOO_SHORT 0x01
+#define UTF8_TOO_LONG 0x02
+#define UTF8_OVERLONG_3 0x04
+#define UTF8_TOO_LARGE 0x08
+#define UTF8_SURROGATE 0x10
+#define UTF8_OVERLONG_2 0x20
+#define UTF8_TOO_LARGE_1000 0x40
+#define UTF8_OVERLONG_4 0x40
+#define UTF8_TWO_CONTS 0x80
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+static const uint8_t utf8_byte1high[16] = {
+    /* 0xxx: ASCII. */
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    /* 10xx: Continuation. */
+    UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+    /* 110x: Two-byte lead. */
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+    UTF8_TOO_SHORT,
+    /* 1110: Three-byte lead. */
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+    /* 1111: Four-byte lead. */
+    UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+
+static const uint8_t utf8_byte1low[16] = {
+    UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+    UTF8_CARRY | UTF8_OVERLONG_2,
+    UTF8_CARRY,
+    UTF8_CARRY,
+    UTF8_CARRY | UTF8_TOO_LARGE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+
+static const uint8_t utf8_byte2high[16] = {
+    /* 0xxx: ASCII. */
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    /* 1000 */
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+        UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+    /* 1001 */
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+        UTF8_TOO_LARGE,
+    /* 101x */
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+        UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+        UTF8_TOO_LARGE,
+    /* 11xx: Lead byte. */
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+/* Sequence at the end of the validated blocks may continue beyond them.
+   Returns the position of its lead byte so that it can be validated
+   along with the rest of the sequence. */
+static size_t utf8_boundary(const uint8_t *data, size_t end) {
+    if(end >= 1 && data[end - 1] >= 0xc0) return end - 1;
+    if(end >= 2 && data[end - 2] >= 0xe0) return end - 2;
+    if(end >= 3 && data[end - 3] >= 0xf0) return end - 3;
+    return end;
+}
+
+/* Validate whole blocks from the beginning of the data, which must be at
+   a character boundary. Return the number of bytes validated or -1 if the
+   data is invalid. */
+
+__attribute__((target("avx2")))
+static ssize_t utf8_valid_avx2(const uint8_t *data, size_t len) {
+    const __m256i byte1high = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i*)utf8_byte1high));
+    const __m256i byte1low = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i*)utf8_byte1low));
+    const __m256i byte2high = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i*)utf8_byte2high));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i prev = _mm256_setzero_si256();
+    __m256i err = _mm256_setzero_si256();
+    size_t i;
+    for(i = 0; i + 32 <= len; i += 32) {
+        __m256i in = _mm256_loadu_si256((const __m256i*)(data + i));
+        /* Shifting by bytes across the two lanes needs the upper lane of
+           the previous block next to the lower lane of this one. */
+        __m256i carry = _mm256_permute2x128_si256(prev, in, 0x21);
+        __m256i prev1 = _mm256_alignr_epi8(in, carry, 15);
+        __m256i prev2 = _mm256_alignr_epi8(in, carry, 14);
+        __m256i prev3 = _mm256_alignr_epi8(in, carry, 13);
+        __m256i sc = _mm256_and_si256(_mm256_and_si256(
+            _mm256_shuffle_epi8(byte1high,
+                _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+            _mm256_shuffle_epi8(byte1low, _mm256_and_si256(prev1, nibble))),
+            _mm256_shuffle_epi8(byte2high,
+                _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+        __m256i must23 = _mm256_or_si256(
+            _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80)),
+            _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80)));
+        must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+        err = _mm256_or_si256(err, _mm256_xor_si256(must23, sc));
+        prev = in;
+    }
+    if(dsock_slow(!_mm256_testz_si256(err, err))) return -1;
+    return utf8_boundary(data, i);
+}
+
+__attribute__((target("ssse3")))
+static ssize_t utf8_valid_ssse3(const uint8_t *data, size_t len) {
+    const __m128i byte1high = _mm_loadu_si128((const __m128i*)utf8_byte1high);
+    const __m128i byte1low = _mm_loadu_si128((const __m128i*)utf8_byte1low);
+    const __m128i byte2high = _mm_loadu_si128((const __m128i*)utf8_byte2high);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i prev = _mm_setzero_si128();
+    __m128i err = _mm_setzero_si128();
+    size_t i;
+    for(i = 0; i + 16 <= len; i += 16) {
+        __m128i in = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i prev1 = _mm_alignr_epi8(in, prev, 15);
+        __m128i prev2 = _mm_alignr_epi8(in, prev, 14);
+        __m128i prev3 = _mm_alignr_epi8(in, prev, 13);
+        __m128i sc = _mm_and_si128(_mm_and_si128(
+            _mm_shuffle_epi8(byte1high,
+                _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+            _mm_shuffle_epi8(byte1low, _mm_and_si128(prev1, nibble))),
+            _mm_shuffle_epi8(byte2high,
+                _mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+        __m128i must23 = _mm_or_si128(
+            _mm_subs_epu8(prev2, _mm_set1_epi8(0xe0 - 0x80)),
+            _mm_subs_epu8(prev3, _mm_set1_epi8(0xf0 - 0x80)));
+        must23 = _mm_and_si128(must23, _mm_set1_epi8((char)0x80));
+        err = _mm_or_si128(err, _mm_xor_si128(must23, sc));
+        prev = in;
+    }
+    if(dsock_slow(_mm_movemask_epi8(_mm_cmpeq_epi8(err,
+          _mm_setzero_si128())) != 0xffff))
+        return -1;
+    return utf8_boundary(data, i);
+}
+
+#endif
+
+static size_t utf8_ascii(const uint8_t *data, size_t len) {
+    size_t i = 0;
+#if defined UTF8_X86
+    if(len >= 64 && utf8_hasavx2()) {
+        i = utf8_ascii_avx2(data, len);
+        if(i + 32 <= len) return i;
+    }
+#endif
+#if defined __SSE2__
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        if(_mm_movemask_epi8(v)) return i;
+    }
+#endif
+    for(; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        if(v & 0x8080808080808080ull) return i;
+    }
+    return i;
+}
+
+int utf8_feed(struct utf8 *self, const uint8_t *data, size_t len) {
+    size_t i = 0;
+    while(i < len) {
+        if(self->need == 0) {
+            i += utf8_ascii(data + i, len - i);
+            if(i == len) break;
+#if defined UTF8_X86
+            ssize_t sz = 0;
+            if(len - i >= 64 && utf8_hasavx2())
+                sz = utf8_valid_avx2(data + i, len - i);
+            else if(len - i >= 32 && utf8_hasssse3())
+                sz = utf8_valid_ssse3(data + i, len - i);
+            if(dsock_slow(sz < 0)) return -1;
+            i += sz;
+#endif
+        }
+        /* Validate the following block byte by byte. Bounds of the first
+           continuation byte exclude overlong forms, surrogates and code
+           points above U+10FFFF. */
+        size_t end = MIN(len, i + 16);
+        for(; i != end; ++i) {
+            uint8_t c = data[i];
+            if(self->need) {
+                if(dsock_slow(c < self->lo || c > self->hi)) return -1;
+                self->lo = 0x80;
+                self->hi = 0xbf;
+                self->need--;
+                continue;
+            }
+            if(c < 0x80) continue;
+            if(dsock_slow(c < 0xc2 || c > 0xf4)) return -1;
+            if(c < 0xe0) {
+                self->need = 1;
+            }
+            else if(c < 0xf0) {
+                self->need = 2;
+                if(c == 0xe0) self->lo = 0xa0;
+                if(c == 0xed) self->hi = 0x9f;
+            }
+            else {
+                self->need = 3;
+                if(c == 0xf0) self->lo = 0x90;
+                if(c == 0xf4) self->hi = 0x8f;
+            }
+        }
+    }
+    return 0;
+}
+
+int utf8_done(struct utf8 *self) {
+    return self->need ? -1 : 0;
+}
+
@@ -0,0 +1,50 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef DSOCK_UTF8_H_INCLUDED
+#define DSOCK_UTF8_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Incremental UTF-8 validator. Text can be fed in arbitrary pieces,
+   multi-byte sequences may be split between them. */
+struct utf8 {
+    /* Number of continuation bytes still expected. */
+    int need;
+    /* Allowed range of the next continuation byte. */
+    uint8_t lo;
+    uint8_t hi;
+};
+
+void utf8_init(struct utf8 *self);
+
+/* Returns 0 if the data is valid so far, -1 otherwise. */
+int utf8_feed(struct utf8 *self, const uint8_t *data, size_t len);
+
+/* Returns 0 if the text doesn't end in the middle of a sequence. */
+int utf8_done(struct utf8 *self);
+
+#endif
+
@@ -30,7 +30,9 @@
 
 #include "dsock.h"
 #include "iol.h"
+#include "utf8.h"
 #include "utils.h"
+#include "wsmask.h"
 
 dsock_unique_id(websock_type);
 
@@ -48,9 +50,59 @@ struct websock_sock {
     int txerr;
     int rxerr;
     int client;
-    uint8_t txbuf[2048];
+    /* If set, client masks user's buffers in place rather than copying
+       them to txbuf. */
+    int inplace;
+    /* Staging buffer for masked data. Frame header is sent together with
+       the first batch of data. */
+    size_t txbufsz;
+    uint8_t *txbuf;
+    /* Set while a frame, including a control frame, is being sent. Other
+       frames can't be sent at that time as they would be interleaved with
+       it. Writers that find it set wait on txch till the frame is done. */
+    int txbusy;
+    int txch[2];
+    size_t txwaiters;
+    /* State of the message being sent by websock_append(). */
+    int txstream;
+    size_t fragsize;
+    /* Pong and echoed close to be sent once the frame being sent is
+       done. */
+    int pongpending;
+    size_t ponglen;
+    uint8_t pong[125];
+    int closepending;
+    size_t closelen;
+    uint8_t close[2];
+    /* Timestamp carried by the last ping sent and smoothed round-trip time
+       in milliseconds, -1 if not available. */
+    int64_t pingts;
+    int64_t srtt;
+    /* State of the frame being received. */
+    int rxinmsg;
+    int rxfin;
+    uint64_t rxleft;
+    size_t rxoff;
+    uint8_t rxmask[4];
+    /* Text messages are validated as they arrive. */
+    int rxtext;
+    struct utf8 rxutf8;
 };
 
+#define WEBSOCK_TXBUFSZ 16384
+
+#define WEBSOCK_STREAM_NONE 0
+#define WEBSOCK_STREAM_STARTED 1
+#define WEBSOCK_STREAM_SENDING 2
+
+#define WEBSOCK_FRAGSIZE 65536
+
+/* Server unmasks received data in batches of this size. */
+#define WEBSOCK_RXBATCH 65536
+
+/* Maximum number of coroutines writing a broadcast frame at once. */
+#define WEBSOCK_BCASTWORKERS 64
+
 static void *websock_hquery(struct hvfs *hvfs, const void *type) {
     struct websock_sock *obj = (struct websock_sock*)hvfs;
     if(type == msock_type) return &obj->mvfs;
@@ -60,11 +112,12 @@ static void *websock_hquery(struct hvfs *hvfs, const void *type) {
 }
 
 int websock_attach(int s, int client) {
+    int err;
     /* Check whether underlying socket is a bytestream. */
-    if(dsock_slow(!hquery(s, bsock_type))) return -1;
+    if(dsock_slow(!hquery(s, bsock_type))) {err = errno; goto error1;}
     /* Create the object. */
     struct websock_sock *obj = malloc(sizeof(struct websock_sock));
-    if(dsock_slow(!obj)) {errno = ENOMEM; return -1;}
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
     obj->hvfs.query = websock_hquery;
     obj->hvfs.close = websock_hclose;
     obj->mvfs.msendl = websock_msendl;
@@ -73,15 +126,68 @@ int websock_attach(int s, int client) {
     obj->txerr = 0;
     obj->rxerr = 0;
     obj->client = client;
+    obj->inplace = 0;
+    obj->txbufsz = 0;
+    obj->txbuf = NULL;
+    obj->txbusy = 0;
+    obj->txwaiters = 0;
+    obj->txstream = WEBSOCK_STREAM_NONE;
+    obj->fragsize = WEBSOCK_FRAGSIZE;
+    obj->pongpending = 0;
+    obj->ponglen = 0;
+    obj->closepending = 0;
+    obj->closelen = 0;
+    obj->pingts = -1;
+    obj->srtt = -1;
+    obj->rxinmsg = 0;
+    obj->rxfin = 0;
+    obj->rxleft = 0;
+    obj->rxoff = 0;
+    obj->rxtext = 0;
+    /* Only client needs the staging buffer. */
+    if(client) {
+        obj->txbuf = malloc(WEBSOCK_TXBUFSZ);
+        if(dsock_slow(!obj->txbuf)) {err = ENOMEM; goto error2;}
+        obj->txbufsz = WEBSOCK_TXBUFSZ;
+    }
+    int rc = chmake(obj->txch);
+    if(dsock_slow(rc < 0)) {err = errno; goto error3;}
     /* Create the handle. */
     int h = hmake(&obj->hvfs);
-    if(dsock_slow(h < 0)) {
-        int err = errno;
-        free(obj);
-        errno = err;
-        return -1;
-    }
+    if(dsock_slow(h < 0)) {err = errno; goto error4;}
     return h;
+error4:
+    rc = hclose(obj->txch[0]);
+    dsock_assert(rc == 0);
+    rc = hclose(obj->txch[1]);
+    dsock_assert(rc == 0);
+error3:
+    free(obj->txbuf);
+error2:
+    free(obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+int websock_setbuf(int s, size_t len) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    /* The buffer must fit at least the largest frame header. */
+    if(dsock_slow(len < 64)) {errno = EINVAL; return -1;}
+    if(!obj->client) return 0;
+    uint8_t *buf = realloc(obj->txbuf, len);
+    if(dsock_slow(!buf)) {errno = ENOMEM; return -1;}
+    obj->txbuf = buf;
+    obj->txbufsz = len;
+    return 0;
+}
+
+int websock_setinplace(int s, int inplace) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    obj->inplace = inplace;
+    return 0;
 }
 
 int websock_detach(int s, int64_t deadline) {
@@ -91,35 +197,202 @@ int websock_detach(int s, int64_t deadline) {
     dsock_assert(0);
 }
 
+/* Writes a control frame. Payload must be at most 125 bytes long. */
+static int websock_writecontrol(struct websock_sock *obj, int opcode,
+      const uint8_t *data, size_t len, int64_t deadline) {
+    dsock_assert(len <= 125);
+    uint8_t buf[6 + 125];
+    size_t sz = 2;
+    buf[0] = 0x80 | opcode;
+    buf[1] = (uint8_t)len;
+    if(obj->client) {
+        int rc = dsock_random(buf + 2, 4, deadline);
+        if(dsock_slow(rc < 0)) return -1;
+        buf[1] |= 0x80;
+        wsmask(buf + 6, data, len, buf + 2, 0);
+        sz = 6;
+    }
+    else {
+        memcpy(buf + 2, data, len);
+    }
+    int rc = bsend(obj->s, buf, sz + len, deadline);
+    if(dsock_slow(rc < 0)) {obj->txerr = errno; return -1;}
+    return 0;
+}
+
+/* Waits till no frame is being sent. This way frames from concurrent
+   writers, including the automatic replies to control frames, are sent one
+   after another. */
+static int websock_waittx(struct websock_sock *obj, int64_t deadline) {
+    while(obj->txbusy) {
+        obj->txwaiters++;
+        int rc = chrecv(obj->txch[1], NULL, 0, deadline);
+        obj->txwaiters--;
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    if(dsock_slow(obj->txerr)) {errno = obj->txerr; return -1;}
+    return 0;
+}
+
+/* Marks the frame as sent and wakes up the writers waiting for it. Leaves
+   errno intact so that the caller can still report the send's error. */
+static void websock_txdone(struct websock_sock *obj) {
+    obj->txbusy = 0;
+    if(dsock_fast(!obj->txwaiters)) return;
+    int err = errno;
+    size_t n = obj->txwaiters;
+    while(n--) chsend(obj->txch[0], NULL, 0, 0);
+    errno = err;
+}
+
+static int websock_sendframe(struct websock_sock *obj, uint8_t hdr0,
+    struct iolist *first, struct iolist *last, int64_t deadline);
+static int websock_sendcontrol(struct websock_sock *obj, int opcode,
+    const uint8_t *data, size_t len, int64_t deadline);
+
+/* Sends the control frames that were deferred while another frame was
+   being sent, if any. Once the close is echoed nothing more can be sent. */
+static int websock_flushcontrol(struct websock_sock *obj, int64_t deadline) {
+    int rc;
+    if(dsock_slow(obj->pongpending)) {
+        obj->pongpending = 0;
+        rc = websock_sendcontrol(obj, 10, obj->pong, obj->ponglen, deadline);
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    if(dsock_slow(obj->closepending)) {
+        obj->closepending = 0;
+        rc = websock_sendcontrol(obj, 8, obj->close, obj->closelen,
+            deadline);
+        if(dsock_slow(rc < 0)) return -1;
+        obj->txerr = EPIPE;
+    }
+    return 0;
+}
+
+/* Sends a control frame and then the control frames that were deferred in
+   the meantime, if any. */
+static int websock_sendcontrol(struct websock_sock *obj, int opcode,
+      const uint8_t *data, size_t len, int64_t deadline) {
+    dsock_assert(!obj->txbusy);
+    obj->txbusy = 1;
+    int rc = websock_writecontrol(obj, opcode, data, len, deadline);
+    websock_txdone(obj);
+    if(dsock_slow(rc < 0)) return -1;
+    return websock_flushcontrol(obj, deadline);
+}
+
+/* Sends a frame and then the control frames that were deferred while the
+   frame was being sent, if any. */
+static int websock_send(struct websock_sock *obj, uint8_t hdr0,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    obj->txbusy = 1;
+    int rc = websock_sendframe(obj, hdr0, first, last, deadline);
+    websock_txdone(obj);
+    if(dsock_slow(rc < 0)) return -1;
+    return websock_flushcontrol(obj, deadline);
+}
+
 static int websock_msendl(struct msock_vfs *mvfs,
       struct iolist *first, struct iolist *last, int64_t deadline) {
     struct websock_sock *obj = dsock_cont(mvfs, struct websock_sock, mvfs);
     if(dsock_slow(obj->txerr)) {errno = obj->txerr; return -1;}
+    int rc = websock_waittx(obj, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    if(dsock_slow(obj->txstream)) {errno = EBUSY; return -1;}
+    return websock_send(obj, 0x82, first, last, deadline);
+}
+
+int websock_setfragment(int s, size_t len) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(len == 0)) {errno = EINVAL; return -1;}
+    obj->fragsize = len;
+    return 0;
+}
+
+int websock_begin(int s) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(obj->txerr)) {errno = obj->txerr; return -1;}
+    if(dsock_slow(obj->txstream)) {errno = EBUSY; return -1;}
+    obj->txstream = WEBSOCK_STREAM_STARTED;
+    return 0;
+}
+
+int websock_append(int s, struct iolist *first, struct iolist *last,
+      int64_t deadline) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(obj->txerr)) {errno = obj->txerr; return -1;}
+    if(dsock_slow(!obj->txstream)) {errno = EINVAL; return -1;}
     size_t len;
     int rc = iol_check(first, last, NULL, &len);
     if(dsock_slow(rc < 0)) return -1;
-    /* Construct message header. */
-    uint8_t buf[12];
-    size_t sz;
-    buf[0] = 0x82;
+    rc = websock_waittx(obj, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    /* Data is sent straight away, split into frames of at most fragsize
+       bytes. First frame carries the opcode, the rest are continuations. */
+    size_t off = 0;
+    while(off < len) {
+        size_t n = MIN(len - off, obj->fragsize);
+        struct iol_slice slc;
+        iol_slice_init(&slc, first, last, off, n);
+        rc = websock_send(obj,
+            obj->txstream == WEBSOCK_STREAM_STARTED ? 0x02 : 0x00,
+            &slc.first, slc.last, deadline);
+        iol_slice_term(&slc);
+        if(dsock_slow(rc < 0)) return -1;
+        obj->txstream = WEBSOCK_STREAM_SENDING;
+        off += n;
+    }
+    return 0;
+}
+
+int websock_end(int s, int64_t deadline) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(obj->txerr)) {errno = obj->txerr; return -1;}
+    if(dsock_slow(!obj->txstream)) {errno = EINVAL; return -1;}
+    int rc = websock_waittx(obj, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    /* Empty final frame terminates the message. */
+    struct iolist iol = {NULL, 0, NULL, 0};
+    rc = websock_send(obj,
+        obj->txstream == WEBSOCK_STREAM_STARTED ? 0x82 : 0x80,
+        &iol, &iol, deadline);
+    obj->txstream = WEBSOCK_STREAM_NONE;
+    return rc;
+}
+
+/* Writes unmasked frame header to buf. Returns size of the header. */
+static size_t websock_encodehdr(uint8_t *buf, uint8_t hdr0, size_t len) {
+    buf[0] = hdr0;
     if(len > 0xffff) {
         buf[1] = 127;
         dsock_putll(buf + 2, len);
-        sz = 10;
+        return 10;
     }
-    else if(len > 125) {
+    if(len > 125) {
         buf[1] = 126;
         dsock_puts(buf + 2, len);
-        sz = 4;
-    }
-    else {
-        buf[1] = (uint8_t)len;
-        sz = 2;
+        return 4;
     }
+    buf[1] = (uint8_t)len;
+    return 2;
+}
+
+static int websock_sendframe(struct websock_sock *obj, uint8_t hdr0,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    size_t len;
+    int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) return -1;
+    /* Construct message header. */
+    uint8_t buf[14];
+    size_t sz = websock_encodehdr(buf, hdr0, len);
     /* Server sends unmasked message. */
     if(!obj->client) {
-        struct iolist hdr = {buf, sz, first};
-        int rc = bsendl(obj->s, &hdr, last, deadline);
+        struct iolist hdr = {buf, sz, first, 0};
+        int rc = bsendl(obj->s, &hdr, last ? last : &hdr, deadline);
         if(dsock_slow(rc < 0)) {obj->txerr = errno; return -1;}
         return 0;
     }
@@ -130,76 +403,309 @@ static int websock_msendl(struct msock_vfs *mvfs,
     buf[1] |= 0x80;
     memcpy(buf + sz, mask, 4);
     sz += 4;
-    /* TODO: It should be worth sending the header together with the first
-       batch of data. */
-    rc = bsend(obj->s, buf, sz, deadline);
-    if(dsock_slow(rc < 0)) {obj->txerr = errno; return -1;}
-    struct iolist *it = first;
-    size_t srcoff = 0;
-    size_t dstoff = 0;
-    int pos = 0;
-    while(it) {
-        size_t srcrmn = it->iol_len - srcoff;
-        size_t dstrmn = sizeof(obj->txbuf) - dstoff;
-        if(srcrmn < dstrmn) {
-            memcpy(obj->txbuf + dstoff, it->iol_base + srcoff, srcrmn);
-            dstoff += srcrmn;
-            it = it->iol_next;
-            srcoff = 0;
-            if(it) continue;
+    /* If allowed, mask user's buffers in place and send the whole frame
+       in a single vectored write. */
+    struct iolist *it;
+    if(obj->inplace) {
+        size_t pos = 0;
+        for(it = first; it; it = it->iol_next) {
+            wsmask(it->iol_base, it->iol_base, it->iol_len, mask, pos);
+            pos += it->iol_len;
         }
-        else {
-            memcpy(obj->txbuf + dstoff, it->iol_base + srcoff, dstrmn);
-            srcoff += dstrmn;
-            dstoff += dstrmn;
+        struct iolist hdr = {buf, sz, first, 0};
+        rc = bsendl(obj->s, &hdr, last ? last : &hdr, deadline);
+        if(dsock_slow(rc < 0)) {obj->txerr = errno; return -1;}
+        return 0;
+    }
+    /* Otherwise, copy the data to txbuf, masking it on the way. Header goes
+       out together with the first batch of data. */
+    memcpy(obj->txbuf, buf, sz);
+    size_t dstoff = sz;
+    size_t srcoff = 0;
+    size_t pos = 0;
+    it = first;
+    while(1) {
+        while(it && dstoff < obj->txbufsz) {
+            size_t n = MIN(it->iol_len - srcoff, obj->txbufsz - dstoff);
+            wsmask(obj->txbuf + dstoff, (uint8_t*)it->iol_base + srcoff, n,
+                mask, pos);
+            dstoff += n;
+            srcoff += n;
+            pos += n;
+            if(srcoff == it->iol_len) {
+                it = it->iol_next;
+                srcoff = 0;
+            }
         }
         /* Either txbuf is full or there's no more data to send. */
-        int i;
-        for(i = 0; i != dstoff; ++i, ++pos)
-            obj->txbuf[i] ^= mask[pos % 4];
         rc = bsend(obj->s, obj->txbuf, dstoff, deadline);
         if(dsock_slow(rc < 0)) {obj->txerr = errno; return -1;}
-        dstoff = 0; 
+        if(!it) break;
+        dstoff = 0;
     }
     return 0;
 }
 
-static ssize_t websock_mrecvl(struct msock_vfs *mvfs,
-      struct iolist *first, struct iolist *last, int64_t deadline) {
-    struct websock_sock *obj = dsock_cont(mvfs, struct websock_sock, mvfs);
-    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
+/******************************************************************************/
+/*  Pre-encoded frames                                                        */
+/******************************************************************************/
+
+dsock_unique_id(websock_frame_type);
+
+struct websock_frame {
+    struct hvfs hvfs;
+    /* The frame is freed once the handle is closed and no send that uses
+       it is in progress. */
+    int refs;
+    size_t len;
+    uint8_t data[];
+};
+
+static void websock_frame_unref(struct websock_frame *obj) {
+    if(--obj->refs == 0) free(obj);
+}
+
+static void *websock_frame_hquery(struct hvfs *hvfs, const void *type) {
+    struct websock_frame *obj = (struct websock_frame*)hvfs;
+    if(type == websock_frame_type) return obj;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+static void websock_frame_hclose(struct hvfs *hvfs) {
+    websock_frame_unref((struct websock_frame*)hvfs);
+}
+
+int websock_mkframe(struct iolist *first, struct iolist *last, int text) {
+    int err;
     size_t len;
     int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) {err = errno; goto error1;}
+    /* Header and payload are stored in a single contiguous buffer. */
+    struct websock_frame *obj = malloc(sizeof(struct websock_frame) +
+        10 + len);
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
+    obj->hvfs.query = websock_frame_hquery;
+    obj->hvfs.close = websock_frame_hclose;
+    obj->hvfs.done = NULL;
+    obj->refs = 1;
+    obj->len = websock_encodehdr(obj->data, text ? 0x81 : 0x82, len);
+    struct iolist *it;
+    for(it = first; it; it = it->iol_next) {
+        memcpy(obj->data + obj->len, it->iol_base, it->iol_len);
+        obj->len += it->iol_len;
+    }
+    int h = hmake(&obj->hvfs);
+    if(dsock_slow(h < 0)) {err = errno; goto error2;}
+    return h;
+error2:
+    free(obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+/* Writes pre-encoded frame to the connection. */
+static int websock_sendencoded(int s, struct websock_frame *f,
+      int64_t deadline) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    /* Only server sends unmasked frames. */
+    if(dsock_slow(obj->client)) {errno = EINVAL; return -1;}
+    if(dsock_slow(obj->txerr)) {errno = obj->txerr; return -1;}
+    int rc = websock_waittx(obj, deadline);
     if(dsock_slow(rc < 0)) return -1;
-    size_t pos = 0;
+    if(dsock_slow(obj->txstream)) {errno = EBUSY; return -1;}
+    obj->txbusy = 1;
+    rc = bsend(obj->s, f->data, f->len, deadline);
+    websock_txdone(obj);
+    if(dsock_slow(rc < 0)) {obj->txerr = errno; return -1;}
+    return websock_flushcontrol(obj, deadline);
+}
+
+/* State of a broadcast shared by the coroutines writing the frame. */
+struct websock_bcast {
+    struct websock_frame *frame;
+    const int *hs;
+    int *errs;
+    size_t nhs;
+    /* Index of the next connection to write to. */
+    size_t next;
+    int64_t deadline;
+};
+
+/* Writes the frame to one connection after another until there are no
+   connections left. */
+static coroutine void websock_bcastworker(struct websock_bcast *bc) {
+    while(bc->next < bc->nhs) {
+        size_t i = bc->next++;
+        int rc = websock_sendencoded(bc->hs[i], bc->frame, bc->deadline);
+        bc->errs[i] = rc < 0 ? errno : 0;
+    }
+}
+
+int websock_broadcast(int f, const int *hs, int *errs, size_t nhs,
+      int64_t deadline) {
+    int err;
+    struct websock_frame *frame = hquery(f, websock_frame_type);
+    if(dsock_slow(!frame)) {err = errno; goto error1;}
+    if(dsock_slow(nhs == 0)) return 0;
+    int *res = errs;
+    if(!res) {
+        res = malloc(nhs * sizeof(int));
+        if(dsock_slow(!res)) {err = ENOMEM; goto error1;}
+    }
+    /* Connections are written to by a fixed number of coroutines, so that
+       a slow peer doesn't hold up delivery to the others while the cost
+       doesn't grow with the number of connections. */
+    int b = bundle();
+    if(dsock_slow(b < 0)) {err = errno; goto error2;}
+    /* Keep the frame alive even if the handle is closed while a send is
+       blocked. */
+    frame->refs++;
+    struct websock_bcast bc = {frame, hs, res, nhs, 0, deadline};
+    size_t nworkers = MIN(nhs, WEBSOCK_BCASTWORKERS);
+    size_t i;
+    for(i = 0; i != nworkers; ++i) {
+        int rc = bundle_go(b, websock_bcastworker(&bc));
+        if(dsock_slow(rc < 0)) break;
+    }
+    /* If no coroutine could be started there's no one to do the work. */
+    if(dsock_slow(i == 0)) {err = errno; goto error3;}
+    /* Each send obeys the deadline on its own. If canceled, closing the
+       bundle stops the sends that are still in progress. */
+    int rc = bundle_wait(b, -1);
+    err = errno;
+    int rc2 = hclose(b);
+    dsock_assert(rc2 == 0);
+    websock_frame_unref(frame);
+    if(dsock_slow(rc < 0)) goto error2;
+    int sent = 0;
+    for(i = 0; i != nhs; ++i)
+        if(dsock_fast(res[i] == 0)) sent++;
+    if(res != errs) free(res);
+    return sent;
+error3:
+    rc2 = hclose(b);
+    dsock_assert(rc2 == 0);
+    websock_frame_unref(frame);
+error2:
+    if(res != errs) free(res);
+error1:
+    errno = err;
+    return -1;
+}
+
+static int websock_recvcontrol(struct websock_sock *obj, uint8_t *hdr1,
+      int64_t deadline) {
+    if(dsock_slow(!(hdr1[0] & 0x80) || (hdr1[1] & 0x7f) > 125)) {
+        errno = obj->rxerr = EPROTO; return -1;}
+    if(dsock_slow(!!(obj->client) ^ !(hdr1[1] & 0x80))) {
+        errno = obj->rxerr = EPROTO; return -1;}
+    size_t len = hdr1[1] & 0x7f;
+    uint8_t buf[4 + 125];
+    size_t sz = obj->client ? len : len + 4;
+    int rc = brecv(obj->s, buf, sz, deadline);
+    if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
+    uint8_t *payload = buf;
+    if(!obj->client) {
+        payload = buf + 4;
+        wsmask(payload, payload, len, buf, 0);
+    }
+    switch(hdr1[0] & 0x0f) {
+    case 8:
+        /* Close frame. Echo the status code and refuse any further
+           receiving. If a frame is being sent at the moment, echo it once
+           the frame is done. */
+        if(!obj->txerr && !obj->closepending) {
+            memcpy(obj->close, payload, len >= 2 ? 2 : 0);
+            obj->closelen = len >= 2 ? 2 : 0;
+            if(obj->txbusy) {
+                obj->closepending = 1;
+            }
+            else {
+                rc = websock_sendcontrol(obj, 8, obj->close, obj->closelen,
+                    deadline);
+                if(dsock_slow(rc < 0)) {obj->rxerr = EPIPE; return -1;}
+                obj->txerr = EPIPE;
+            }
+        }
+        errno = obj->rxerr = EPIPE;
+        return -1;
+    case 9:
+        /* Ping frame. Reply with pong carrying the same payload. If a message
+           is being sent at the moment, do so once it's done. */
+        memcpy(obj->pong, payload, len);
+        obj->ponglen = len;
+        if(obj->txbusy) {
+            obj->pongpending = 1;
+            return 0;
+        }
+        if(dsock_slow(obj->txerr)) return 0;
+        return websock_sendcontrol(obj, 10, obj->pong, obj->ponglen,
+            deadline);
+    case 10:
+        /* Pong frame. If it corresponds to the last ping we've sent update
+           the round-trip time estimate. Unsolicited pongs are ignored. */
+        if(len == 8 && obj->pingts >= 0 &&
+              (int64_t)dsock_getll(payload) == obj->pingts) {
+            int64_t rtt = now() - obj->pingts;
+            obj->srtt = obj->srtt < 0 ? rtt : (7 * obj->srtt + rtt) / 8;
+            obj->pingts = -1;
+        }
+        return 0;
+    default:
+        dsock_assert(0);
+    }
+}
+
+int websock_ping(int s, int64_t deadline) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(obj->txerr)) {errno = obj->txerr; return -1;}
+    int rc = websock_waittx(obj, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    uint8_t ts[8];
+    int64_t nw = now();
+    dsock_putll(ts, nw);
+    rc = websock_sendcontrol(obj, 9, ts, 8, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    obj->pingts = nw;
+    return 0;
+}
+
+int64_t websock_rtt(int s) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    if(obj->srtt < 0) {errno = EAGAIN; return -1;}
+    return obj->srtt;
+}
+
+/* Receives headers of frames until a data frame is found. Control frames
+   are processed on the way. */
+static int websock_recvhdr(struct websock_sock *obj, int64_t deadline) {
     while(1) {
         uint8_t hdr1[2];
         int rc = brecv(obj->s, hdr1, 2, deadline);
         if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
         if(hdr1[0] & 0x70) {errno = obj->rxerr = EPROTO; return -1;}
         int opcode = hdr1[0] & 0x0f;
-        switch(opcode) {
-        case 0:
-        case 1:
-        case 2:
-            goto dataframe;
-        case 8:
-            /* TODO: close frame */
-            dsock_assert(0);
-        case 9:
-            /* TODO: ping frame */
-            dsock_assert(0);
-        case 10:
-            /* TODO: pong frame */
-            dsock_assert(0);
-        default:
-            errno = obj->rxerr = EPROTO;
-            return -1;
+        if(dsock_slow((opcode > 2 && opcode < 8) || opcode > 10)) {
+            errno = obj->rxerr = EPROTO; return -1;}
+        /* Control frames can be interleaved with fragments of a message.
+           They are processed here and never passed to the user. */
+        if(opcode >= 8) {
+            rc = websock_recvcontrol(obj, hdr1, deadline);
+            if(dsock_slow(rc < 0)) return -1;
+            continue;
         }
-dataframe:
+        /* First frame of a message carries the opcode, the following ones
+           must be continuations. */
+        if(dsock_slow(!obj->rxinmsg != !!opcode)) {
+            errno = obj->rxerr = EPROTO; return -1;}
         if(!!(obj->client) ^ !(hdr1[1] & 0x80)) {
             errno = obj->rxerr = EPROTO; return -1;}
-        size_t sz = hdr1[1] & 0x7f;
+        uint64_t sz = hdr1[1] & 0x7f;
         if(sz == 126) {
             uint8_t hdr2[2];
             int rc = brecv(obj->s, hdr2, 2, deadline);
@@ -212,37 +718,138 @@ dataframe:
             if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
             sz = dsock_getll(hdr2);
         }
-        uint8_t mask[4];
         if(!obj->client) {
-            int rc = brecv(obj->s, mask, 4, deadline);
+            int rc = brecv(obj->s, obj->rxmask, 4, deadline);
             if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
         }
-        if(dsock_slow(sz > len)) {errno = obj->rxerr = EMSGSIZE; return -1;}
+        if(!obj->rxinmsg) {
+            obj->rxtext = opcode == 1;
+            if(obj->rxtext) utf8_init(&obj->rxutf8);
+        }
+        obj->rxinmsg = 1;
+        obj->rxfin = !!(hdr1[0] & 0x80);
+        obj->rxleft = sz;
+        obj->rxoff = 0;
+        return 0;
+    }
+}
+
+/* Receives 'len' bytes of the current frame to the user's buffers at offset
+   'pos'. Server receives the data in batches and unmasks each batch as soon
+   as it arrives, while it's still in the cache. Each byte is unmasked
+   exactly once. */
+static int websock_recvdata(struct websock_sock *obj, struct iolist *first,
+      struct iolist *last, size_t pos, size_t len, int64_t deadline) {
+    dsock_assert(len <= obj->rxleft);
+    size_t done = 0;
+    while(done < len) {
+        size_t n = obj->client ? len : MIN(len - done, WEBSOCK_RXBATCH);
         struct iol_slice slc;
-        iol_slice_init(&slc, first, last, pos, sz);
-        rc = brecvl(obj->s, &slc.first, slc.last, deadline);
-        iol_slice_term(&slc);
-        if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
-        if(!obj->client) {
-            /* Unmask the frame data. */
-            size_t i, mpos = 0;
+        iol_slice_init(&slc, first, last, pos + done, n);
+        int rc = brecvl(obj->s, &slc.first, slc.last, deadline);
+        if(dsock_fast(rc == 0 && !obj->client)) {
+            size_t off = obj->rxoff;
             struct iolist *it;
-            for(it = first; it; it = it->iol_next)
-                for(i = 0; i != it->iol_len; ++i)
-                    ((uint8_t*)it->iol_base)[i] ^= mask[mpos++ % 4];
+            for(it = &slc.first; it; it = it->iol_next) {
+                if(it->iol_base)
+                    wsmask(it->iol_base, it->iol_base, it->iol_len,
+                        obj->rxmask, off);
+                off += it->iol_len;
+            }
         }
+        /* Text is validated while still in the cache, too. */
+        if(rc == 0 && obj->rxtext) {
+            struct iolist *it;
+            for(it = &slc.first; it; it = it->iol_next) {
+                if(it->iol_base &&
+                      utf8_feed(&obj->rxutf8, it->iol_base, it->iol_len) < 0) {
+                    rc = -1;
+                    errno = EPROTO;
+                    break;
+                }
+            }
+        }
+        iol_slice_term(&slc);
+        if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
+        done += n;
+        obj->rxoff += n;
+        obj->rxleft -= n;
+    }
+    return 0;
+}
+
+static ssize_t websock_mrecvl(struct msock_vfs *mvfs,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    struct websock_sock *obj = dsock_cont(mvfs, struct websock_sock, mvfs);
+    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
+    /* Message partially received by websock_recvpart() can't be finished
+       by mrecv(). */
+    if(dsock_slow(obj->rxinmsg)) {errno = EBUSY; return -1;}
+    size_t len;
+    int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) return -1;
+    size_t pos = 0;
+    while(1) {
+        rc = websock_recvhdr(obj, deadline);
+        if(dsock_slow(rc < 0)) return -1;
+        if(dsock_slow(obj->rxleft > len - pos)) {
+            errno = obj->rxerr = EMSGSIZE; return -1;}
+        size_t sz = obj->rxleft;
+        rc = websock_recvdata(obj, first, last, pos, sz, deadline);
+        if(dsock_slow(rc < 0)) return -1;
         pos += sz;
-        len -= sz;
-        if(hdr1[0] & 0x80)
+        if(obj->rxfin)
             break;
     }
+    obj->rxinmsg = 0;
+    if(dsock_slow(obj->rxtext && utf8_done(&obj->rxutf8) < 0)) {
+        errno = obj->rxerr = EPROTO; return -1;}
     return pos;
 }
 
+ssize_t websock_recvpart(int s, struct iolist *first, struct iolist *last,
+      int *eom, int64_t deadline) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
+    size_t len;
+    int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) return -1;
+    size_t pos = 0;
+    *eom = 0;
+    while(1) {
+        if(obj->rxleft == 0) {
+            /* End of the message. */
+            if(obj->rxinmsg && obj->rxfin) {
+                obj->rxinmsg = 0;
+                if(dsock_slow(obj->rxtext && utf8_done(&obj->rxutf8) < 0)) {
+                    errno = obj->rxerr = EPROTO; return -1;}
+                *eom = 1;
+                return pos;
+            }
+            /* Return what we have rather than waiting for the next frame. */
+            if(pos > 0) return pos;
+            rc = websock_recvhdr(obj, deadline);
+            if(dsock_slow(rc < 0)) return -1;
+            continue;
+        }
+        if(pos == len) return pos;
+        size_t sz = MIN(obj->rxleft, len - pos);
+        rc = websock_recvdata(obj, first, last, pos, sz, deadline);
+        if(dsock_slow(rc < 0)) return -1;
+        pos += sz;
+    }
+}
+
 static void websock_hclose(struct hvfs *hvfs) {
     struct websock_sock *obj = (struct websock_sock*)hvfs;
     int rc = hclose(obj->s);
     dsock_assert(rc == 0);
+    rc = hclose(obj->txch[0]);
+    dsock_assert(rc == 0);
+    rc = hclose(obj->txch[1]);
+    dsock_assert(rc == 0);
+    free(obj->txbuf);
     free(obj);
 }
 
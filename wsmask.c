@@ -0,0 +1,111 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <string.h>
+
+#include "utils.h"
+#include "wsmask.h"
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#define WSMASK_X86 1
+#include <immintrin.h>
+#endif
+
+/* Each kernel processes as many whole vectors as possible and returns
+   number of bytes processed. Vector sizes are multiples of 4 so the mask
+   stays aligned to the start of the vector. */
+
+#if defined WSMASK_X86
+
+__attribute__((target("avx2")))
+static size_t wsmask_avx2(uint8_t *dst, const uint8_t *src, size_t len,
+      uint32_t m) {
+    __m256i vm = _mm256_set1_epi32((int)m);
+    size_t i;
+    for(i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(v, vm));
+    }
+    return i;
+}
+
+static int wsmask_hasavx2(void) {
+    static int avx2 = -1;
+    if(dsock_slow(avx2 < 0)) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return avx2;
+}
+
+#endif
+
+#if defined __SSE2__
+
+#include <emmintrin.h>
+
+static size_t wsmask_sse2(uint8_t *dst, const uint8_t *src, size_t len,
+      uint32_t m) {
+    __m128i vm = _mm_set1_epi32((int)m);
+    size_t i;
+    for(i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(v, vm));
+    }
+    return i;
+}
+
+#endif
+
+void wsmask(uint8_t *dst, const uint8_t *src, size_t len,
+      const uint8_t *mask, size_t pos) {
+    /* Rotate the mask so that it starts at the first byte. */
+    uint8_t rm[4];
+    rm[0] = mask[pos % 4];
+    rm[1] = mask[(pos + 1) % 4];
+    rm[2] = mask[(pos + 2) % 4];
+    rm[3] = mask[(pos + 3) % 4];
+    uint32_t m;
+    memcpy(&m, rm, 4);
+    size_t i = 0;
+#if defined WSMASK_X86
+    if(len >= 64 && wsmask_hasavx2())
+        i = wsmask_avx2(dst, src, len, m);
+#endif
+#if defined __SSE2__
+    i += wsmask_sse2(dst + i, src + i, len - i, m);
+#endif
+    /* Portable word-at-a-time fallback. memcpy() compiles into a plain
+       unaligned load or store where the platform supports it. */
+    uint64_t m64 = ((uint64_t)m << 32) | m;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, src + i, 8);
+        v ^= m64;
+        memcpy(dst + i, &v, 8);
+    }
+    for(; i != len; ++i)
+        dst[i] = src[i] ^ rm[i % 4];
+}
+
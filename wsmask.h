@@ -0,0 +1,39 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef DSOCK_WSMASK_H_INCLUDED
+#define DSOCK_WSMASK_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* XORs 'len' bytes from 'src' with the 4-byte WebSocket mask and stores
+   the result to 'dst'. 'dst' may be the same as 'src'. 'pos' is the offset of
+   the first byte within the masked payload so that masking can be continued
+   across multiple buffers. Neither buffer has to be aligned. */
+void wsmask(uint8_t *dst, const uint8_t *src, size_t len,
+    const uint8_t *mask, size_t pos);
+
+#endif
+